@@ -126,34 +126,9 @@ gpt_list_table(int xtra UNUSED_PARAM)
 	{
 		return;
 	}
-	if (multiboot_partition != -1 && current_rootfs_sub_dir[0] == '\0')
-	{
-		sprintf(kernel_name, "kernel%d", multiboot_partition);
-		sprintf(rootfs_name, "rootfs%d", multiboot_partition);
-	}
-	else if (multiboot_partition != -1 && current_rootfs_sub_dir[0] != '\0') // box with rootSubDir feature
-	{
-		if (multiboot_partition == 1)
-		{
-			// hd51, h7,... have seperate partition for rootfs1
-			strcpy(kernel_name_hd51, "linuxkernel");
-			strcpy(rootfs_name_hd51, "linuxrootfs");
-			// h17 don't have this -> so also set kernel_name, rootfs_name
-			sprintf(kernel_name, "linuxkernel%d", multiboot_partition);
-			strcpy(rootfs_name, "userdata");
-		}
-		else
-		{
-			sprintf(kernel_name, "linuxkernel%d", multiboot_partition);
-			strcpy(rootfs_name, "userdata");
-		}
+	// adapted for ofgwrite: names from the partition name rules
+	if (active_part_rule_flags(PART_SRC_GPT) & PART_RULE_SUBDIR) // box with rootSubDir feature
 		sprintf(rootfs_sub_dir, "linuxrootfs%d", multiboot_partition);
-	}
-	else
-	{
-		strcpy(kernel_name, "kernel");
-		strcpy(rootfs_name, "rootfs");
-	}
 	for (i = 0; i < n_parts; i++) {
 		gpt_partition *p = gpt_part(i);
 		if (p->lba_start) {
@@ -171,23 +146,12 @@ gpt_list_table(int xtra UNUSED_PARAM)
 			int k;
 			for (k = 0; k<19; k++)
 				partname[k] = (char)p->name[k];
-			if (strcmp(partname, kernel_name) == 0)
-			{
-				ext4_kernel_dev_found(disk_device, i+1);
-				found_kernel = 1;
-			}
-			if (strcmp(partname, rootfs_name) == 0)
-			{
-				ext4_rootfs_dev_found(disk_device, i+1);
-				found_rootfs = 1;
-			}
-			// for hd51, h7, ... search also for special rootfs and kernel names
-			if (kernel_name_hd51[0] != '\0' && strcmp(partname, kernel_name_hd51) == 0)
+			if (match_part_name(PART_SRC_GPT, PART_KERNEL, partname))
 			{
 				ext4_kernel_dev_found(disk_device, i+1);
 				found_kernel = 1;
 			}
-			if (rootfs_name_hd51[0] != '\0' && strcmp(partname, rootfs_name_hd51) == 0)
+			if (match_part_name(PART_SRC_GPT, PART_ROOTFS, partname))
 			{
 				ext4_rootfs_dev_found(disk_device, i+1);
 				found_rootfs = 1;
@@ -224,6 +224,7 @@ typedef struct transformer_state_t {
 	time_t   mtime;     /* gunzip code may set this on exit */
 } transformer_state_t;
 
+extern unsigned transformer_bufsize;
 void init_transformer_state(transformer_state_t *xstate) FAST_FUNC;
 ssize_t transformer_write(transformer_state_t *xstate, const void *buf, size_t bufsize) FAST_FUNC;
 ssize_t xtransformer_write(transformer_state_t *xstate, const void *buf, size_t bufsize) FAST_FUNC;
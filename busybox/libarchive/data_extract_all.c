@@ -3,6 +3,9 @@
  * Licensed under GPLv2 or later, see file LICENSE in this source tree.
  */
 
+// changed for ofgwrite
+#include "../ofgwrite.h"
+
 #include "libbb.h"
 #include "bb_archive.h"
 
@@ -121,6 +124,8 @@ void FAST_FUNC data_extract_all(archive_handle_t *archive_handle)
 			file_header->mode
 			);
 		bb_copyfd_exact_size(archive_handle->src_fd, dst_fd, file_header->size);
+		// changed for ofgwrite
+		extract_sync_file(dst_fd, file_header->size);
 		close(dst_fd);
 #ifdef ARCHIVE_REPLACE_VIA_RENAME
 		if (archive_handle->ah_flags & ARCHIVE_REPLACE_VIA_RENAME) {
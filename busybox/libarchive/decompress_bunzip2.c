@@ -70,7 +70,8 @@
 #define RETVAL_OBSOLETE_INPUT           (dbg("%d", __LINE__), -7)
 
 /* Other housekeeping constants */
-#define IOBUF_SIZE          4096
+// changed for ofgwrite
+#define IOBUF_SIZE          (transformer_bufsize ? transformer_bufsize : 4096)
 
 /* This is what we know about each Huffman coding group */
 struct group_data {
@@ -119,10 +120,6 @@ struct bunzip_data {
 static unsigned get_bits(bunzip_data *bd, int bits_wanted)
 {
 	unsigned bits = 0;
-	// changed for ofgwrite
-	static long long bz2_current_pos = 0;
-	static int bz2_current_percent = 0;
-	static int bz2_new_percent = 0;
 
 	/* Cache bd->inbufBitCount in a CPU register (hopefully): */
 	int bit_count = bd->inbufBitCount;
@@ -139,13 +136,7 @@ static unsigned get_bits(bunzip_data *bd, int bits_wanted)
 				longjmp(bd->jmpbuf, RETVAL_UNEXPECTED_INPUT_EOF);
 			bd->inbufPos = 0;
 			// changed for ofgwrite
-			bz2_current_pos += bd->inbufCount;
-			bz2_new_percent = (int)(bz2_current_pos * 100 / rootfs_file_stat.st_size);
-			if (bz2_new_percent > bz2_current_percent)
-			{
-				set_step_progress(bz2_new_percent);
-				bz2_current_percent = bz2_new_percent;
-			}
+			progress_add(bd->inbufCount);
 		}
 
 		/* Avoid 32-bit overflow (dump bit buffer to top of output) */
@@ -818,8 +809,6 @@ unpack_bz2_stream(transformer_state_t *xstate)
  release_mem:
 	dealloc_bunzip(bd);
 	free(outbuf);
-	// changed for ofgwrite
-	set_step_progress(100);
 
 	return i ? i : IF_DESKTOP(total_written) + 0;
 }
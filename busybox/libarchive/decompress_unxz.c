@@ -47,20 +47,18 @@ unpack_xz_stream(transformer_state_t *xstate)
 	struct xz_buf iobuf;
 	struct xz_dec *state;
 	unsigned char *membuf;
-	IF_DESKTOP(long long) int total = 0;
 	// changed for ofgwrite
-	long long xz_current_pos = 0;
-	int xz_current_percent = 0;
-	int xz_new_percent = 0;
+	unsigned bufsize = transformer_bufsize ? transformer_bufsize : BUFSIZ;
+	IF_DESKTOP(long long) int total = 0;
 
 	if (!global_crc32_table)
 		global_crc32_table = crc32_filltable(NULL, /*endian:*/ 0);
 
 	memset(&iobuf, 0, sizeof(iobuf));
-	membuf = xmalloc(2 * BUFSIZ);
+	membuf = xmalloc(2 * bufsize);
 	iobuf.in = membuf;
-	iobuf.out = membuf + BUFSIZ;
-	iobuf.out_size = BUFSIZ;
+	iobuf.out = membuf + bufsize;
+	iobuf.out_size = bufsize;
 
 	if (!xstate || xstate->check_signature == 0) {
 		/* Preload XZ file signature */
@@ -74,7 +72,7 @@ unpack_xz_stream(transformer_state_t *xstate)
 	xz_result = X_OK;
 	while (1) {
 		if (iobuf.in_pos == iobuf.in_size) {
-			int rd = safe_read(xstate->src_fd, membuf, BUFSIZ);
+			int rd = safe_read(xstate->src_fd, membuf, bufsize);
 			if (rd < 0) {
 				bb_error_msg(bb_msg_read_error);
 				total = -1;
@@ -85,13 +83,7 @@ unpack_xz_stream(transformer_state_t *xstate)
 			iobuf.in_size = rd;
 			iobuf.in_pos = 0;
 			// changed for ofgwrite
-			xz_current_pos += rd;
-			xz_new_percent = (int)(xz_current_pos * 100 / rootfs_file_stat.st_size);
-			if (xz_new_percent > xz_current_percent)
-			{
-				set_step_progress(xz_new_percent);
-				xz_current_percent = xz_new_percent;
-			}
+			progress_add(rd);
 		}
 		if (xz_result == XZ_STREAM_END) {
 			/*
@@ -141,8 +133,6 @@ unpack_xz_stream(transformer_state_t *xstate)
 
 	xz_dec_end(state);
 	free(membuf);
-	// changed for ofgwrite
-	set_step_progress(100);
 
 	return total;
 }
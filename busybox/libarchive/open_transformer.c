@@ -6,6 +6,9 @@
 #include "libbb.h"
 #include "bb_archive.h"
 
+// changed for ofgwrite: I/O buffer size of the bunzip2 and unxz decompressors, 0 = their default
+unsigned transformer_bufsize = 0;
+
 void FAST_FUNC init_transformer_state(transformer_state_t *xstate)
 {
 	memset(xstate, 0, sizeof(*xstate));
@@ -5,6 +5,17 @@
 #include <unistd.h>
 
 
+// copies the name of a device table entry like 4M(kernel) to name
+static void entry_part_name(const char* entry, const char* end, char* name, size_t size)
+{
+	const char* open = memchr(entry, '(', end - entry);
+	const char* close = open ? memchr(open, ')', end - open) : NULL;
+
+	name[0] = '\0';
+	if (open && close && (size_t)(close - open) <= size)
+		snprintf(name, close - open, "%s", open + 1);
+}
+
 // search device table for specific partition names
 int search_via_part_names(char* device_table)
 {
@@ -12,53 +23,15 @@ int search_via_part_names(char* device_table)
 	char device_name[100];
 	char cmp_kernel_name[50];
 	char cmp_rootfs_name[50];
+	char name[72];
+	const char* kernel_pattern;
+	const char* rootfs_pattern;
+	unsigned long long kernel_rules = 0;
+	unsigned long long rootfs_rules = 0;
+	unsigned long long entry_kernel_rules, entry_rootfs_rules;
+	int rule_flags;
 	char* pos;
-
-	// Search for rootfs and kernel partitions. Both have to be on the same device.
-	if (strstr(device_table, "(kernel)") != NULL && strstr(device_table, "(dreambox-rootfs)") != NULL)
-	{
-		strcpy(cmp_kernel_name, "(kernel)");
-		strcpy(cmp_rootfs_name, "(dreambox-rootfs)");
-	}
-	else if (strstr(device_table, "(kernel)") != NULL && strstr(device_table, "(rootfs)") != NULL)
-	{
-		strcpy(cmp_kernel_name, "(kernel)");
-		strcpy(cmp_rootfs_name, "(rootfs)");
-	}
-	else if (strstr(device_table, "(ekernel)") != NULL && strstr(device_table, "(rootfs)") != NULL)
-	{
-		strcpy(cmp_kernel_name, "(ekernel)");
-		strcpy(cmp_rootfs_name, "(rootfs)");
-	}
-	else if (strstr(device_table, "(exkernel)") != NULL && strstr(device_table, "(exrootfs)") != NULL)
-	{
-		strcpy(cmp_kernel_name, "(exkernel)");
-		strcpy(cmp_rootfs_name, "(exrootfs)");
-	}
-	else if (strstr(device_table, "(boot)") != NULL && strstr(device_table, "(root)") != NULL)
-	{
-		strcpy(cmp_kernel_name, "(boot)");
-		strcpy(cmp_rootfs_name, "(root)");
-	}
-	else if (strstr(device_table, "(linuxkernel)") != NULL && strstr(device_table, "(linuxrootfs)") != NULL)
-	{
-		strcpy(cmp_kernel_name, "(linuxkernel)");
-		strcpy(cmp_rootfs_name, "(linuxrootfs)");
-	}
-	else if ( access( "/dev/block/by-name/flag", F_OK) != -1 && current_rootfs_sub_dir[0] != '\0')
-	{
-		sprintf(cmp_kernel_name, "(linuxkernel%d)", multiboot_partition);
-		strcpy(cmp_rootfs_name, "(rootfs)");
-		sprintf(rootfs_sub_dir, "linuxrootfs%d", multiboot_partition);
-	}
-	else if (current_rootfs_sub_dir[0] != '\0') // box with rootSubDir feature
-	{
-		sprintf(cmp_kernel_name, "(linuxkernel%d)", multiboot_partition);
-		strcpy(cmp_rootfs_name, "(userdata)");
-		sprintf(rootfs_sub_dir, "linuxrootfs%d", multiboot_partition);
-	}
-	else
-		return 0;
+	char* end;
 
 	// read device name
 	if ((pos = strstr(device_table, ":")) == NULL)
@@ -66,6 +39,26 @@ int search_via_part_names(char* device_table)
 		my_printf("Error: No device name in /proc/cmdline blkdevparts: %s\n", device_table);
 		return -1;
 	}
+
+	// Search for rootfs and kernel partitions. Both have to be on the same device.
+	for (end = pos; *end; )
+	{
+		char* entry = end + 1;
+		end = strchr(entry, ',');
+		if (end == NULL)
+			end = entry + strlen(entry);
+		entry_part_name(entry, end, name, sizeof(name));
+		match_part_name_rules(PART_SRC_CMDLINE, name, &entry_kernel_rules, &entry_rootfs_rules);
+		kernel_rules |= entry_kernel_rules;
+		rootfs_rules |= entry_rootfs_rules;
+	}
+	if (select_part_rule(PART_SRC_CMDLINE, kernel_rules, rootfs_rules, &kernel_pattern, &rootfs_pattern, &rule_flags) == -1)
+		return 0;
+	expand_part_rule_name(kernel_pattern, cmp_kernel_name, sizeof(cmp_kernel_name));
+	expand_part_rule_name(rootfs_pattern, cmp_rootfs_name, sizeof(cmp_rootfs_name));
+	if (rule_flags & PART_RULE_SUBDIR) // box with rootSubDir feature
+		sprintf(rootfs_sub_dir, "linuxrootfs%d", multiboot_partition);
+
 	strncpy(device_name, device_table, pos - device_table);
 	device_name[pos - device_table] = '\0';
 	device_table = pos + 1;
@@ -75,13 +68,14 @@ int search_via_part_names(char* device_table)
 		if ((pos = strstr(device_table, ",")) != NULL)
 			*pos = '\0';
 
-		if (strstr(device_table, cmp_kernel_name) != NULL)
+		entry_part_name(device_table, device_table + strlen(device_table), name, sizeof(name));
+		if (strcmp(name, cmp_kernel_name) == 0)
 		{
 			found_kernel_device = 1;
 			kernel_flash_mode = TARBZ2;
 			sprintf(kernel_device, "/dev/%sp%d", device_name, partition_number);
 		}
-		else if (strstr(device_table, cmp_rootfs_name) != NULL)
+		else if (strcmp(name, cmp_rootfs_name) == 0)
 		{
 			found_rootfs_device = 1;
 			rootfs_flash_mode = TARBZ2;
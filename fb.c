@@ -9,6 +9,12 @@
 #include <linux/kd.h>
 #include <sys/ioctl.h>
 #include <errno.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <syslog.h>
 
 #include "font.h"
 
@@ -23,6 +29,11 @@
 #define FB_HEIGHT 720
 #define FB_BPP 32
 
+// progress updates are shown with at most this frame rate
+#define FB_MAX_FPS 25
+// frame rate of the UI thread
+#define UI_FPS 10
+
 #ifndef FBIO_BLIT
 #define FBIO_SET_MANUAL_BLIT _IOW('F', 0x21, __u8)
 #define FBIO_BLIT 0x22
@@ -39,6 +50,25 @@ int g_step = 1;
 size_t g_fbMapLen = 0;
 int g_fbPages = 1;
 
+struct timespec g_last_blit;
+int g_blit_pending = 0;
+
+// all drawing is done with this lock held, recursive as set_step() calls other locking functions
+pthread_mutex_t g_fb_lock;
+pthread_once_t g_fb_lock_once = PTHREAD_ONCE_INIT;
+
+// UI thread: flash loops only store their progress, the thread paints it with UI_FPS
+pthread_t g_ui_thread;
+atomic_int g_ui_running = 0;
+atomic_int g_ui_step_percent = -1;	// -1: nothing new
+
+// last progress line for the console and last stats line of the step, protected by g_console_lock
+pthread_mutex_t g_console_lock = PTHREAD_MUTEX_INITIALIZER;
+char g_console_line[200];
+atomic_int g_console_pending = 0;
+char g_stats_line[100];
+atomic_int g_stats_pending = 0;
+
 // box
 struct window_t
 {
@@ -62,12 +92,45 @@ struct progressbar
 	int width; // inner dimension
 	int height; // inner dimension
 	int steps;
+	int painted; // width of the painted part
 };
 
 struct progressbar g_pb_overall;
 struct progressbar g_pb_step;
 
+// rectangle in screen coordinates, x2 and y2 are exclusive
+struct fb_rect
+{
+	int x1;
+	int y1;
+	int x2;
+	int y2;
+};
+
+// one row filled with the last used color
+uint32_t* g_fill_row = NULL;
+int g_fill_row_len = 0;
+uint32_t g_fill_row_color;
+
+// debug counters
+unsigned long g_fb_fills = 0;
+unsigned long long g_fb_pixels = 0;
+
+// background image, decoded once and scaled to the screen size
+uint32_t* g_background = NULL;
+int g_background_width = 0;
+int g_background_height = 0;
+
 void paint_box(int x1, int y1, int x2, int y2, char* color);
+void render_string(char* str, int x, int y, char* color, int thick);
+void flush_console_progress();
+void stop_ui_thread();
+// logging of ofgwrite
+extern int log_max_level;
+void my_log(int level, const char *format, ...);
+void log_console_progress(const char* line);
+int decode_mvi(const char* filename, int width, int height, uint32_t* pixels);
+long elapsed_ms(const struct timespec* from, const struct timespec* to);
 
 static int get_safe_pages(void)
 {
@@ -100,12 +163,51 @@ static void clear_all_pages(char *color)
 	g_screeninfo_var.yoffset = saved_yoffset;
 }
 
+static void init_fb_lock()
+{
+	pthread_mutexattr_t attr;
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&g_fb_lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+}
+
+void fb_lock()
+{
+	pthread_once(&g_fb_lock_once, init_fb_lock);
+	pthread_mutex_lock(&g_fb_lock);
+}
+
+void fb_unlock()
+{
+	pthread_mutex_unlock(&g_fb_lock);
+}
+
 void blit()
 {
 	if (g_manual_blit == 1) {
 		if (ioctl(g_fbFd, FBIO_BLIT) < 0)
 			perror("FBIO_BLIT");
+		clock_gettime(CLOCK_MONOTONIC, &g_last_blit);
+	}
+	g_blit_pending = 0;
+}
+
+// Blits at most FB_MAX_FPS times per second. Skipped updates are shown with the next blit.
+void blit_limited()
+{
+	struct timespec now;
+
+	if (g_manual_blit != 1)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (elapsed_ms(&g_last_blit, &now) < 1000 / FB_MAX_FPS)
+	{
+		g_blit_pending = 1;
+		return;
 	}
+	blit();
 }
 
 void enableManualBlit()
@@ -136,12 +238,71 @@ void set_window_dimension()
 	g_window.y2 = g_screeninfo_var.yres / 2 + g_window.height / 2;
 }
 
+// Clips rect to the visible screen and the mapped memory. Returns 0 if nothing is left.
+int clip_rect(struct fb_rect* rect)
+{
+	int max_y = g_screeninfo_var.yres;
+
+	if (!g_lfb || !g_screeninfo_fix.line_length)
+		return 0;
+	// don't write behind the mapping
+	if (g_fbMapLen && (g_screeninfo_var.yoffset + max_y) * g_screeninfo_fix.line_length > g_fbMapLen)
+		max_y = g_fbMapLen / g_screeninfo_fix.line_length - g_screeninfo_var.yoffset;
+
+	if (rect->x1 < 0)
+		rect->x1 = 0;
+	if (rect->y1 < 0)
+		rect->y1 = 0;
+	if (rect->x2 > (int)g_screeninfo_var.xres)
+		rect->x2 = g_screeninfo_var.xres;
+	if (rect->y2 > max_y)
+		rect->y2 = max_y;
+	return rect->x1 < rect->x2 && rect->y1 < rect->y2;
+}
+
+// Fills rect with color. One row is prepared in memory and copied to each framebuffer line.
+void fill_rect(struct fb_rect rect, char* color)
+{
+	uint32_t pixel;
+	int width, y, i;
+	unsigned char* line;
+
+	if (!clip_rect(&rect))
+		return;
+	width = rect.x2 - rect.x1;
+	memcpy(&pixel, color, 4);
+
+	if (width > g_fill_row_len)
+	{
+		uint32_t* row = realloc(g_fill_row, width * 4);
+		if (!row)
+			return;
+		g_fill_row = row;
+		g_fill_row_len = width;
+		g_fill_row_color = ~pixel; // force refill
+	}
+	if (g_fill_row_color != pixel)
+	{
+		for (i = 0; i < g_fill_row_len; i++)
+			g_fill_row[i] = pixel;
+		g_fill_row_color = pixel;
+	}
+
+	line = &g_lfb[(rect.x1 + g_screeninfo_var.xoffset) * 4 + (rect.y1 + g_screeninfo_var.yoffset) * g_screeninfo_fix.line_length];
+	for (y = rect.y1; y < rect.y2; y++)
+	{
+		memcpy(line, g_fill_row, width * 4);
+		line += g_screeninfo_fix.line_length;
+	}
+
+	g_fb_fills++;
+	g_fb_pixels += (unsigned long long)width * (rect.y2 - rect.y1);
+}
+
 void paint_box(int x1, int y1, int x2, int y2, char* color)
 {
-	int x,y;
-	for (y = y1; y < y2; y++)
-		for (x = x1; x < x2; x++)
-			memcpy(&g_lfb[(x + g_screeninfo_var.xoffset) * 4 + (y + g_screeninfo_var.yoffset) * g_screeninfo_fix.line_length], color, 4);
+	struct fb_rect rect = { x1, y1, x2, y2 };
+	fill_rect(rect, color);
 }
 
 void init_progressbars(int steps)
@@ -169,6 +330,9 @@ void init_progressbars(int steps)
 
 void paint_progressbars()
 {
+	g_pb_overall.painted = 0;
+	g_pb_step.painted = 0;
+
 	// paint white border around overall progressbar
 	paint_box(g_pb_overall.x1, g_pb_overall.y1, g_pb_overall.x2, g_pb_overall.y2, WHITE);
 
@@ -192,6 +356,8 @@ void paint_progressbars()
 
 void close_framebuffer()
 {
+	stop_ui_thread();
+
 	// hide all old osd content
 	if (g_lfb)
 		clear_all_pages(TRANS);
@@ -202,6 +368,7 @@ void close_framebuffer()
 	{
 		msync(g_lfb, g_fbMapLen ? g_fbMapLen : g_screeninfo_fix.smem_len, MS_SYNC);
 		munmap(g_lfb, g_fbMapLen ? g_fbMapLen : g_screeninfo_fix.smem_len);
+		g_lfb = NULL;
 		g_fbMapLen = 0;
 	}
 
@@ -210,7 +377,13 @@ void close_framebuffer()
 		disableManualBlit();
 		close(g_fbFd);
 		g_fbFd = -1;
+		if (log_max_level >= LOG_DEBUG)
+			my_log(LOG_DEBUG, "Framebuffer: %lu fills, %llu pixels painted\n", g_fb_fills, g_fb_pixels);
 	}
+
+	free(g_fill_row);
+	g_fill_row = NULL;
+	g_fill_row_len = 0;
 }
 
 int get_screeninfo()
@@ -394,6 +567,30 @@ int set_fb_resolution()
 	return 1;
 }
 
+// Paints only the columns of the bar which changed since the last call
+void paint_progress(struct progressbar* pb, int percent)
+{
+	int x = pb->x1 + pb->outer_border_width + pb->inner_border_width;
+	int y = pb->y1 + pb->outer_border_width + pb->inner_border_width;
+	int width = (int)(pb->width / 100.0 * percent);
+
+	if (width > pb->painted)
+		paint_box(x + pb->painted, y, x + width, y + pb->height, WHITE);
+	else if (width < pb->painted)
+		paint_box(x + width, y, x + pb->painted, y + pb->height, BLACK);
+	pb->painted = width;
+}
+
+static void paint_step_progress(int percent)
+{
+	paint_progress(&g_pb_step, percent);
+	// start and end of a step are always shown
+	if (percent == 0 || percent == 100)
+		blit();
+	else
+		blit_limited();
+}
+
 void set_step_progress(int percent)
 {
 	if (g_fbFd == -1)
@@ -403,15 +600,163 @@ void set_step_progress(int percent)
 		percent = 0;
 	if (percent > 100)
 		percent = 100;
-	int x = g_pb_step.x1 + g_pb_step.outer_border_width + g_pb_step.inner_border_width;
-	int y = g_pb_step.y1 + g_pb_step.outer_border_width + g_pb_step.inner_border_width;
-
-	paint_box(x
-			, y
-			, (int)(x + g_pb_step.width / 100.0 * percent)
-			, y + g_pb_step.height
-			, WHITE);
-	blit();
+
+	if (atomic_load(&g_ui_running))
+	{
+		atomic_store(&g_ui_step_percent, percent);
+		return;
+	}
+	fb_lock();
+	paint_step_progress(percent);
+	fb_unlock();
+}
+
+// stats line directly below the step progressbar, it ends where the error text starts
+static void paint_step_stats(char* str)
+{
+	int y = g_pb_step.y2;
+
+	paint_box(g_window.x1 + 10, y, g_window.x2, y + CHAR_HEIGHT, BLACK);
+	render_string(str, g_window.x1 + 10, y, WHITE, 0);
+	blit_limited();
+}
+
+static void flush_step_stats()
+{
+	char line[sizeof(g_stats_line)];
+
+	if (!atomic_load(&g_stats_pending))
+		return;
+	pthread_mutex_lock(&g_console_lock);
+	strcpy(line, g_stats_line);
+	atomic_store(&g_stats_pending, 0);
+	pthread_mutex_unlock(&g_console_lock);
+
+	fb_lock();
+	paint_step_stats(line);
+	fb_unlock();
+}
+
+// Sets the stats line of the step. It is painted by the UI thread or directly if the thread isn't running.
+void set_step_stats(const char* str)
+{
+	if (g_fbFd == -1)
+		return;
+
+	pthread_mutex_lock(&g_console_lock);
+	snprintf(g_stats_line, sizeof(g_stats_line), "%s", str);
+	atomic_store(&g_stats_pending, 1);
+	pthread_mutex_unlock(&g_console_lock);
+
+	if (!atomic_load(&g_ui_running))
+		flush_step_stats();
+}
+
+// Sets the progress line on the console. It is printed by the UI thread or directly if the thread isn't running.
+void set_console_progress(const char* fmt, ...)
+{
+	va_list ap;
+
+	pthread_mutex_lock(&g_console_lock);
+	va_start(ap, fmt);
+	vsnprintf(g_console_line, sizeof(g_console_line), fmt, ap);
+	va_end(ap);
+	atomic_store(&g_console_pending, 1);
+	pthread_mutex_unlock(&g_console_lock);
+
+	if (!atomic_load(&g_ui_running))
+		flush_console_progress();
+}
+
+// Prints the pending progress line. Called before other console output to keep the order.
+// The line goes through the logger queue under the lock, so it can't overtake a message logged later.
+void flush_console_progress()
+{
+	if (!atomic_load(&g_console_pending))
+		return;
+	pthread_mutex_lock(&g_console_lock);
+	if (atomic_exchange(&g_console_pending, 0))
+		log_console_progress(g_console_line);
+	pthread_mutex_unlock(&g_console_lock);
+}
+
+static void* ui_thread(void* arg)
+{
+	int percent;
+
+	while (atomic_load(&g_ui_running))
+	{
+		fb_lock();
+		percent = atomic_exchange(&g_ui_step_percent, -1);
+		if (percent != -1)
+			paint_step_progress(percent);
+		else if (g_blit_pending)
+			blit();
+		fb_unlock();
+
+		flush_step_stats();
+		flush_console_progress();
+		usleep(1000000 / UI_FPS);
+	}
+	return NULL;
+}
+
+// don't fork while the UI thread holds a lock, a forked child has no UI thread
+static void ui_thread_atfork_prepare()
+{
+	fb_lock();
+	pthread_mutex_lock(&g_console_lock);
+}
+
+static void ui_thread_atfork_parent()
+{
+	pthread_mutex_unlock(&g_console_lock);
+	fb_unlock();
+}
+
+static void ui_thread_atfork_child()
+{
+	// the owner of a recursive mutex changes with fork, so it can't be unlocked here
+	pthread_mutex_init(&g_console_lock, NULL);
+	init_fb_lock();
+	atomic_store(&g_ui_running, 0);
+}
+
+void start_ui_thread()
+{
+	static int atfork_registered = 0;
+
+	if (atomic_load(&g_ui_running))
+		return;
+	if (!atfork_registered)
+	{
+		pthread_atfork(ui_thread_atfork_prepare, ui_thread_atfork_parent, ui_thread_atfork_child);
+		atfork_registered = 1;
+	}
+	atomic_store(&g_ui_step_percent, -1);
+	atomic_store(&g_ui_running, 1);
+	if (pthread_create(&g_ui_thread, NULL, ui_thread, NULL) != 0)
+	{
+		atomic_store(&g_ui_running, 0);
+		my_printf("Error: Cannot start UI thread. Painting progress directly\n");
+	}
+}
+
+void stop_ui_thread()
+{
+	int percent;
+
+	if (!atomic_load(&g_ui_running))
+		return;
+	atomic_store(&g_ui_running, 0);
+	pthread_join(g_ui_thread, NULL);
+
+	// show last state
+	percent = atomic_exchange(&g_ui_step_percent, -1);
+	if (percent != -1)
+		paint_step_progress(percent);
+	flush_step_stats();
+	flush_console_progress();
 }
 
 void set_overall_progress(int step)
@@ -421,51 +766,117 @@ void set_overall_progress(int step)
 		percent = 0;
 	if (percent > 100)
 		percent = 100;
-	int x = g_pb_overall.x1 + g_pb_overall.outer_border_width + g_pb_overall.inner_border_width;
-	int y = g_pb_overall.y1 + g_pb_overall.outer_border_width + g_pb_overall.inner_border_width;
 
 	// paint overall bar
-	paint_box(x
-			, y
-			, (int)(x + g_pb_overall.width / 100.0 * percent)
-			, y + g_pb_overall.height
-			, WHITE);
+	paint_progress(&g_pb_overall, percent);
 
 	if (percent >= 99)
 		return;
 	// reset step progressbar
-	x = g_pb_step.x1 + g_pb_step.outer_border_width + g_pb_step.inner_border_width;
-	y = g_pb_step.y1 + g_pb_step.outer_border_width + g_pb_step.inner_border_width;
-	paint_box(x
-			, y
-			, x + g_pb_step.width
-			, y + g_pb_step.height
-			, BLACK);
+	paint_progress(&g_pb_step, 0);
 }
 
-void render_char(char ch, int x, int y, char* color, int thick)
+// Glyph cache: each font row is stored as runs of set pixels, so text is drawn with one memcpy per run
+#define FONT_GLYPHS (int)(sizeof(font) / sizeof(font[0]))
+#define MAX_GLYPH_RUNS ((CHAR_WIDTH + 1) / 2)
+#define MAX_TEXT_COLORS 4
+
+struct glyph_run
 {
-	const unsigned short* bitmap = font[ch-0x20];
+	unsigned char x;
+	unsigned char len;
+};
 
-	int h, w, line;
-	const unsigned int pos = (y + g_screeninfo_var.yoffset) * g_screeninfo_fix.line_length + (x + g_screeninfo_var.xoffset) * 4;
-	for (h = 0; h < CHAR_HEIGHT; h++)
+struct glyph_row
+{
+	int count;
+	struct glyph_run runs[MAX_GLYPH_RUNS];
+};
+
+struct glyph_row g_glyphs[FONT_GLYPHS][CHAR_HEIGHT];
+int g_glyphs_ready = 0;
+
+// rows of text pixels for each used color, long enough for the widest run of a thick glyph
+uint32_t g_text_colors[MAX_TEXT_COLORS];
+uint32_t g_text_rows[MAX_TEXT_COLORS][2 * CHAR_WIDTH];
+int g_text_color_count = 0;
+
+static void init_glyph_cache()
+{
+	struct glyph_row* row;
+	int ch, h, w, line;
+
+	for (ch = 0; ch < FONT_GLYPHS; ch++)
 	{
-		line = bitmap[h] >> 2;  // ignore 2 lsb bits
-		for (w = CHAR_WIDTH - 1; w >= 0; w--)
+		for (h = 0; h < CHAR_HEIGHT; h++)
 		{
-			if ((line & 0x01) == 0x01)
+			row = &g_glyphs[ch][h];
+			row->count = 0;
+			line = font[ch][h] >> 2;  // ignore 2 lsb bits, msb is the left pixel
+			for (w = 0; w < CHAR_WIDTH; w++)
 			{
-				memcpy(&g_lfb[pos + (thick + 1) * h * g_screeninfo_fix.line_length + (thick + 1) * w * 4], color, 4);
-				if (thick)
+				if (!(line & (1 << (CHAR_WIDTH - 1 - w))))
+					continue;
+				if (row->count > 0 && row->runs[row->count - 1].x + row->runs[row->count - 1].len == w)
+					row->runs[row->count - 1].len++;
+				else
 				{
-					memcpy(&g_lfb[pos + 2 * h * g_screeninfo_fix.line_length + 2 * w * 4 + 4], color, 4);
-					memcpy(&g_lfb[pos + (2 * h + 1) * g_screeninfo_fix.line_length + 2 * w * 4], color, 4);
-					memcpy(&g_lfb[pos + (2 * h + 1) * g_screeninfo_fix.line_length + 2 * w * 4 + 4], color, 4);
+					row->runs[row->count].x = w;
+					row->runs[row->count].len = 1;
+					row->count++;
 				}
 			}
+		}
+	}
+	g_glyphs_ready = 1;
+}
+
+static uint32_t* get_text_row(char* color)
+{
+	uint32_t pixel;
+	int i, w;
+
+	memcpy(&pixel, color, 4);
+	for (i = 0; i < g_text_color_count; i++)
+		if (g_text_colors[i] == pixel)
+			return g_text_rows[i];
+
+	// replace the last color if all are used
+	if (i == MAX_TEXT_COLORS)
+		i--;
+	else
+		g_text_color_count++;
+	g_text_colors[i] = pixel;
+	for (w = 0; w < 2 * CHAR_WIDTH; w++)
+		g_text_rows[i][w] = pixel;
+	return g_text_rows[i];
+}
+
+void render_char(char ch, int x, int y, char* color, int thick)
+{
+	const struct glyph_row* row;
+	uint32_t* pixels;
+	unsigned char* line;
+	int scale = thick + 1;
+	int h, r, i;
 
-			line = line >> 1;
+	if (!g_lfb)
+		return;
+	if (!g_glyphs_ready)
+		init_glyph_cache();
+	if (ch < 0x20 || ch - 0x20 >= FONT_GLYPHS)
+		return;
+
+	pixels = get_text_row(color);
+	line = &g_lfb[(y + g_screeninfo_var.yoffset) * g_screeninfo_fix.line_length + (x + g_screeninfo_var.xoffset) * 4];
+	for (h = 0; h < CHAR_HEIGHT; h++)
+	{
+		row = &g_glyphs[ch - 0x20][h];
+		for (i = 0; i < scale; i++)
+		{
+			for (r = 0; r < row->count; r++)
+				memcpy(line + row->runs[r].x * scale * 4, pixels, row->runs[r].len * scale * 4);
+			line += g_screeninfo_fix.line_length;
 		}
 	}
 }
@@ -482,6 +893,8 @@ void set_title(char* str)
 	if (g_fbFd == -1)
 		return;
 
+	fb_lock();
+
 	// hide text
 	paint_box(g_window.x1 + 10
 			, g_window.y1 + g_window.height * 0.10
@@ -497,6 +910,7 @@ void set_title(char* str)
 				, 1);
 
 	blit();
+	fb_unlock();
 }
 
 void set_sub_title(char* str)
@@ -504,6 +918,8 @@ void set_sub_title(char* str)
 	if (g_fbFd == -1)
 		return;
 
+	fb_lock();
+
 	// hide text
 	paint_box(g_window.x1 + 10
 			, g_window.y1 + g_window.height * 0.2
@@ -519,6 +935,7 @@ void set_sub_title(char* str)
 				, 0);
 
 	blit();
+	fb_unlock();
 }
 
 void set_overall_text(char* str)
@@ -526,6 +943,8 @@ void set_overall_text(char* str)
 	if (g_fbFd == -1)
 		return;
 
+	fb_lock();
+
 	// hide text
 	paint_box(g_window.x1 + 10
 			, g_window.y1 + g_window.height * 0.35
@@ -541,6 +960,7 @@ void set_overall_text(char* str)
 				, 0);
 
 	blit();
+	fb_unlock();
 }
 
 void set_step_text(char* str)
@@ -548,6 +968,8 @@ void set_step_text(char* str)
 	if (g_fbFd == -1)
 		return;
 
+	fb_lock();
+
 	// hide text
 	paint_box(g_window.x1 + 10
 			, g_window.y1 + g_window.height * 0.6
@@ -563,6 +985,7 @@ void set_step_text(char* str)
 				, 0);
 
 	blit();
+	fb_unlock();
 }
 
 void set_step(char* str)
@@ -570,10 +993,19 @@ void set_step(char* str)
 	if (g_fbFd == -1)
 		return;
 
+	fb_lock();
+
+	// stats of the last step are not valid anymore
+	pthread_mutex_lock(&g_console_lock);
+	atomic_store(&g_stats_pending, 0);
+	pthread_mutex_unlock(&g_console_lock);
+	paint_step_stats("");
+
 	set_step_text(str);
 	set_overall_progress(g_step);
 	g_step++;
 	set_step_progress(0);
+	fb_unlock();
 }
 
 void set_step_without_incr(char* str)
@@ -581,9 +1013,12 @@ void set_step_without_incr(char* str)
 	if (g_fbFd == -1)
 		return;
 
+	fb_lock();
+
 	set_step_text(str);
 	set_overall_progress(g_step);
 	blit();
+	fb_unlock();
 }
 
 void set_info_text(char* str)
@@ -591,6 +1026,8 @@ void set_info_text(char* str)
 	if (g_fbFd == -1)
 		return;
 
+	fb_lock();
+
 	// display text
 	render_string(str
 				, g_window.x1 + 10
@@ -599,6 +1036,7 @@ void set_info_text(char* str)
 				, 0);
 
 	blit();
+	fb_unlock();
 }
 
 void set_error_text(char* str)
@@ -606,6 +1044,8 @@ void set_error_text(char* str)
 	if (g_fbFd == -1)
 		return;
 
+	fb_lock();
+
 	// hide text
 	paint_box(g_window.x1 + 10
 			, g_window.y1 + g_window.height * 0.9
@@ -621,6 +1061,7 @@ void set_error_text(char* str)
 				, 0);
 
 	blit();
+	fb_unlock();
 }
 
 void set_error_text1(char* str)
@@ -628,6 +1069,13 @@ void set_error_text1(char* str)
 	if (g_fbFd == -1)
 		return;
 
+	fb_lock();
+
+	// don't paint a pending stats line over the error
+	pthread_mutex_lock(&g_console_lock);
+	atomic_store(&g_stats_pending, 0);
+	pthread_mutex_unlock(&g_console_lock);
+
 	// hide text
 	paint_box(g_window.x1 + 10
 			, g_window.y1 + g_window.height * 0.85
@@ -643,6 +1091,7 @@ void set_error_text1(char* str)
 				, 0);
 
 	blit();
+	fb_unlock();
 }
 
 void set_error_text2(char* str)
@@ -650,6 +1099,13 @@ void set_error_text2(char* str)
 	if (g_fbFd == -1)
 		return;
 
+	fb_lock();
+
+	// don't paint a pending stats line over the error
+	pthread_mutex_lock(&g_console_lock);
+	atomic_store(&g_stats_pending, 0);
+	pthread_mutex_unlock(&g_console_lock);
+
 	// hide text
 	paint_box(g_window.x1 + 10
 			, g_window.y1 + g_window.height * 0.91
@@ -665,34 +1121,89 @@ void set_error_text2(char* str)
 				, 0);
 
 	blit();
+	fb_unlock();
 }
 
+static const char* background_images[] = {
+	"/etc/enigma2/bootlogo.mvi",
+	"/etc/enigma2/backdrop.mvi",
+	"/usr/share/bootlogo.mvi",
+	"/usr/share/backdrop.mvi",
+	NULL
+};
+
+// Paints the decoded background image into the visible page
+static void paint_background()
+{
+	struct fb_rect rect = { 0, 0, g_background_width, g_background_height };
+	int y;
+
+	if (!clip_rect(&rect))
+		return;
+	for (y = rect.y1; y < rect.y2; y++)
+		memcpy(&g_lfb[(y + g_screeninfo_var.yoffset) * g_screeninfo_fix.line_length + (rect.x1 + g_screeninfo_var.xoffset) * 4]
+			, &g_background[y * g_background_width + rect.x1]
+			, (rect.x2 - rect.x1) * 4);
+}
+
+// The background image is decoded in software, so no showiframe process is needed and it also works
+// after pivot_root. If the image can't be decoded, showiframe is used as before.
 int loadBackgroundImage()
 {
-	int ret;
+	char cmd[100];
+	const char* filename = NULL;
+	int width = g_screeninfo_var.xres;
+	int height = g_screeninfo_var.yres;
+	struct timespec start, end;
+	int i;
 
-	// search for background image
-	if (access("/etc/enigma2/bootlogo.mvi", R_OK) != 0)
-		if (access("/etc/enigma2/backdrop.mvi", R_OK) != 0)
-			if (access("/usr/share/bootlogo.mvi", R_OK) != 0)
-				if (access("/usr/share/backdrop.mvi", R_OK) != 0)
-					return 0;
-				else
-					ret = system("/usr/bin/showiframe /usr/share/backdrop.mvi");
-			else
-				ret = system("/usr/bin/showiframe /usr/share/bootlogo.mvi");
+	// decoded for another resolution
+	if (g_background && (g_background_width != width || g_background_height != height))
+	{
+		free(g_background);
+		g_background = NULL;
+	}
+
+	if (!g_background)
+	{
+		// search for background image
+		for (i = 0; background_images[i] != NULL; i++)
+		{
+			if (access(background_images[i], R_OK) == 0)
+			{
+				filename = background_images[i];
+				break;
+			}
+		}
+		if (filename == NULL)
+			return 0;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		g_background = malloc((size_t)width * height * sizeof(*g_background));
+		if (g_background && decode_mvi(filename, width, height, g_background))
+		{
+			g_background_width = width;
+			g_background_height = height;
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			my_printf("Decoded background image %s in %ld ms\n", filename, elapsed_ms(&start, &end));
+		}
 		else
-			ret = system("/usr/bin/showiframe /etc/enigma2/backdrop.mvi");
-	else
-		ret = system("/usr/bin/showiframe /etc/enigma2/bootlogo.mvi");
+		{
+			free(g_background);
+			g_background = NULL;
+			snprintf(cmd, sizeof(cmd), "/usr/bin/showiframe %s", filename);
+			return system(cmd) == 0;
+		}
+	}
 
-	if (ret != 0)
-		return 0;
+	paint_background();
 	return 1;
 }
 
 int init_framebuffer(int steps)
 {
+	stop_ui_thread();
+
 	if (g_fbFd == -1)
 		if (!open_framebuffer())
 		{
@@ -740,12 +1251,15 @@ int init_framebuffer(int steps)
 		paint_box(0, 0, g_screeninfo_var.xres, g_screeninfo_var.yres, TRANS);
 
 	init_progressbars(steps);
+	start_ui_thread();
 
 	return 1;
 }
 
 int show_main_window(int show_background_image, const char* version)
 {
+	fb_lock();
+
 	// hide all old osd content
 	if (g_lfb)
 		clear_all_pages(TRANS);
@@ -768,5 +1282,6 @@ int show_main_window(int show_background_image, const char* version)
 	strcpy(version_string, "written by Betacentauri  v.");
 	strcat(version_string, version);
 	set_sub_title(version_string);
+	fb_unlock();
 	return 1;
 }
@@ -1,7 +1,30 @@
 #include "ofgwrite.h"
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <getopt.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mount.h>
+#include <sys/statvfs.h>
+#include <sys/wait.h>
+#include <linux/fs.h>
+
+// extracted rootfs is expected to be at most this factor bigger than the image file
+#define UNPACK_SIZE_FACTOR 5
+
+// ext2/3/4 superblock
+#define EXT_SUPERBLOCK_OFFSET 1024
+#define EXT_MAGIC_OFFSET 56
+#define EXT_UUID_OFFSET 104
+#define EXT_LABEL_OFFSET 120
+#define EXT_MAGIC 0xEF53
+
+static pid_t rm_old_rootfs_pid = -1;
 
 int flash_ext4_kernel(char* device, char* filename, off_t kernel_file_size, int quiet, int no_write)
 {
@@ -26,10 +49,9 @@ int flash_ext4_kernel(char* device, char* filename, off_t kernel_file_size, int
 	}
 
 	set_step("Writing ext4 kernel");
+	progress_begin("Writing ext4 kernel", kernel_file_size);
 	int ret;
 	long long readBytes = 0;
-	int current_percent = 0;
-	int new_percent     = 0;
 	while (!feof(kernel_file))
 	{
 		// Don't add my_printf for debugging! Debug messages will be written to kernel device!
@@ -44,12 +66,7 @@ int flash_ext4_kernel(char* device, char* filename, off_t kernel_file_size, int
 			return 0;
 		}
 		readBytes += ret;
-		new_percent = readBytes * 100/ kernel_file_size;
-		if (current_percent < new_percent)
-		{
-			set_step_progress(new_percent);
-			current_percent = new_percent;
-		}
+		progress_update(readBytes);
 		if (!no_write)
 		{
 			ret = fwrite(buffer, ret, 1, kernel_dev);
@@ -65,26 +82,17 @@ int flash_ext4_kernel(char* device, char* filename, off_t kernel_file_size, int
 
 	fclose(kernel_file);
 	fclose(kernel_dev);
+	progress_end();
 
 	return 1;
 }
 
 int rm_rootfs(char* directory, int quiet, int no_write)
 {
-	optind = 0; // reset getopt_long
-	char* argv[] = {
-		"rm",		// program name
-		"-r",		// recursive
-		"-f",		// force
-		directory,	// directory
-		NULL
-	};
-	int argc = (int)(sizeof(argv) / sizeof(argv[0])) - 1;
-
 	if (!quiet)
-		my_printf("Delete rootfs: rm -r -f %s\n", directory);
+		my_printf("Delete rootfs: %s\n", directory);
 	if (!no_write)
-		if (rm_main(argc, argv) != 0)
+		if (!rm_tree(directory, quiet))
 			return 0;
 
 	return 1;
@@ -92,6 +100,7 @@ int rm_rootfs(char* directory, int quiet, int no_write)
 
 int untar_rootfs(char* filename, char* directory, int quiet, int no_write)
 {
+	int ret;
 	optind = 0; // reset getopt_long
 	char* argv[] = {
 		"tar",		// program name
@@ -107,43 +116,461 @@ int untar_rootfs(char* filename, char* directory, int quiet, int no_write)
 	if (!quiet)
 		my_printf("Untar: tar xf %s\n", filename);
 	if (!no_write)
-		if (tar_main(argc, argv) != 0)
+	{
+		extract_sync_begin(directory, quiet);
+		ret = tar_main(argc, argv);
+		extract_sync_end(ret == 0, quiet);
+		if (ret != 0)
 			return 0;
+		progress_end();
+	}
+
+	return 1;
+}
+
+// Checks whether the filesystem has enough free space to hold old and new rootfs at the same time
+int rootfs_swap_possible(const char* mount_point, off_t image_size)
+{
+	struct statvfs fs_stat;
+	unsigned long long free_bytes;
+	unsigned long long needed_bytes = (unsigned long long)image_size * UNPACK_SIZE_FACTOR;
+
+	if (statvfs(mount_point, &fs_stat) != 0)
+		return 0;
+
+	free_bytes = (unsigned long long)fs_stat.f_bavail * fs_stat.f_frsize;
+	my_printf("Free space on %s: %llu bytes, needed for swap: %llu bytes\n", mount_point, free_bytes, needed_bytes);
+	return free_bytes >= needed_bytes;
+}
+
+// Builds the sibling directory names used for extracting the new and keeping the old rootfs
+void get_rootfs_swap_paths(const char* path, char* new_path, char* old_path)
+{
+	char base[1000];
+
+	strcpy(base, path);
+	if (base[strlen(base) - 1] == '/') // cut '/'
+		base[strlen(base) - 1] = '\0';
+	sprintf(new_path, "%s.ofgwrite_new/", base);
+	sprintf(old_path, "%s.ofgwrite_old/", base);
+}
+
+// Removes leftovers of an aborted flash and creates the empty directory for the new rootfs
+int prepare_rootfs_swap(const char* new_path, const char* old_path, int quiet)
+{
+	struct stat dir_stat;
+
+	if (stat(new_path, &dir_stat) == 0)
+		rm_rootfs((char*)new_path, quiet, 0);
+	if (stat(old_path, &dir_stat) == 0)
+		rm_rootfs((char*)old_path, quiet, 0);
+
+	// becomes the root directory of the new rootfs
+	if (mkdir(new_path, 0755) != 0)
+	{
+		my_printf("Error creating directory %s: %s\n", new_path, strerror(errno));
+		return 0;
+	}
+
+	return 1;
+}
+
+// Moves the old rootfs away and the new rootfs into place. Both renames are atomic.
+// Returns 1 if an old rootfs was moved away, 0 if there was none and -1 on error.
+int swap_rootfs_dirs(const char* path, const char* new_path, const char* old_path)
+{
+	int old_present = 1;
+
+	if (rename(path, old_path) != 0)
+	{
+		if (errno != ENOENT)
+		{
+			my_printf("Error renaming %s to %s: %s\n", path, old_path, strerror(errno));
+			return -1;
+		}
+		old_present = 0;
+	}
+
+	if (rename(new_path, path) != 0)
+	{
+		my_printf("Error renaming %s to %s: %s\n", new_path, path, strerror(errno));
+		if (old_present)
+			rename(old_path, path); // try to restore old rootfs
+		return -1;
+	}
+
+	my_printf("Swapped rootfs: %s -> %s\n", new_path, path);
+	return old_present;
+}
+
+// Deletes the old rootfs in a child process, so that the delete isn't part of the flash critical path
+void start_background_rm(char* directory, int quiet)
+{
+	pid_t pid = fork();
+	if (pid < 0)
+	{
+		my_printf("Error fork failed. Deleting old rootfs in foreground\n");
+		rm_rootfs(directory, quiet, 0);
+		return;
+	}
+	else if (pid == 0)
+	{
+		nice(10);
+		rm_rootfs(directory, 1, 0);
+		_exit(EXIT_SUCCESS);
+	}
+
+	if (!quiet)
+		my_printf("Deleting old rootfs %s in background (pid %d)\n", directory, pid);
+	rm_old_rootfs_pid = pid;
+}
+
+// Waits until the background delete is finished. Needs to be called before the rootfs gets unmounted.
+void wait_background_rm(int quiet)
+{
+	if (rm_old_rootfs_pid <= 0)
+		return;
+
+	if (!quiet)
+		my_printf("Waiting for deletion of old rootfs\n");
+	waitpid(rm_old_rootfs_pid, NULL, 0);
+	rm_old_rootfs_pid = -1;
+
+	if (trim_rootfs)
+		fstrim_rootfs("/oldroot_remount/", quiet);
+}
+
+// Returns 1 on success, 0 on error and -1 if the swap isn't possible and nothing was changed
+int flash_unpack_rootfs_swap(char* filename, char* path, int quiet)
+{
+	int ret;
+	char new_path[1000];
+	char old_path[1000];
+
+	get_rootfs_swap_paths(path, new_path, old_path);
+	if (!prepare_rootfs_swap(new_path, old_path, quiet))
+	{
+		my_printf("Cannot swap rootfs. Deleting rootfs instead\n");
+		return -1;
+	}
+
+	set_step("Extracting rootfs");
+	phase_begin(PHASE_FLASH);
+	progress_begin("Extracting rootfs", rootfs_file_stat.st_size);
+	if (!untar_rootfs(filename, new_path, quiet, 0))
+	{
+		my_printf("Error extracting rootfs\n");
+		rm_rootfs(new_path, quiet, 0);
+		return 0;
+	}
+
+	set_step("Deleting rootfs");
+	phase_begin(PHASE_DELETE);
+	ret = swap_rootfs_dirs(path, new_path, old_path);
+	if (ret < 0)
+		return 0;
+	if (ret > 0)
+		start_background_rm(old_path, quiet);
+
+	return 1;
+}
+
+// Reads uuid and label of an ext filesystem. They are kept when the partition gets formatted.
+int read_ext_uuid_label(const char* device, char* uuid, char* label)
+{
+	unsigned char sb[EXT_LABEL_OFFSET + 16];
+	int fd;
+
+	uuid[0] = '\0';
+	label[0] = '\0';
+	fd = open(device, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	if (pread(fd, sb, sizeof(sb), EXT_SUPERBLOCK_OFFSET) != sizeof(sb)
+	 || (sb[EXT_MAGIC_OFFSET] | (sb[EXT_MAGIC_OFFSET + 1] << 8)) != EXT_MAGIC)
+	{
+		close(fd);
+		return 0;
+	}
+	close(fd);
+
+	const unsigned char* u = &sb[EXT_UUID_OFFSET];
+	sprintf(uuid, "%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x",
+		u[0], u[1], u[2], u[3], u[4], u[5], u[6], u[7], u[8], u[9], u[10], u[11], u[12], u[13], u[14], u[15]);
+	memcpy(label, &sb[EXT_LABEL_OFFSET], 16);
+	label[16] = '\0';
+	return 1;
+}
+
+// Discards all blocks of the device, so that mkfs doesn't need to do it and the FTL knows the old data is unused
+int discard_device(const char* device, int quiet)
+{
+	unsigned long long range[2];
+	struct timespec start, end;
+	int fd;
+	int ret;
+
+	fd = open(device, O_WRONLY);
+	if (fd < 0)
+		return 0;
+	range[0] = 0;
+	if (ioctl(fd, BLKGETSIZE64, &range[1]) != 0)
+	{
+		close(fd);
+		return 0;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	ret = ioctl(fd, BLKDISCARD, &range);
+	close(fd);
+	if (ret != 0)
+	{
+		if (!quiet)
+			my_printf("Discard of %s not supported: %s\n", device, strerror(errno));
+		return 0;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (!quiet)
+		my_printf("Discarded %llu bytes on %s in %ld ms\n", range[1], device, elapsed_ms(&start, &end));
+	return 1;
+}
+
+// Tells the device which blocks are unused after deleting the old rootfs, so that writes during extraction are faster
+int fstrim_rootfs(const char* mount_point, int quiet)
+{
+	struct fstrim_range range;
+	struct timespec start, end;
+	int fd;
+	int ret;
+
+	fd = open(mount_point, O_RDONLY | O_DIRECTORY);
+	if (fd < 0)
+	{
+		my_printf("Error opening %s for trim: %s\n", mount_point, strerror(errno));
+		return 0;
+	}
+
+	memset(&range, 0, sizeof(range));
+	range.len = ~0ULL;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	ret = ioctl(fd, FITRIM, &range);
+	close(fd);
+	if (ret != 0)
+	{
+		my_printf("Trim of %s not supported: %s\n", mount_point, strerror(errno));
+		return 0;
+	}
+
+	// range.len contains the number of trimmed bytes
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (!quiet)
+		my_printf("Trimmed %llu bytes on %s in %ld ms\n", (unsigned long long)range.len, mount_point, elapsed_ms(&start, &end));
+	return 1;
+}
+
+// Runs a program without a shell, so that arguments like the label are passed unchanged.
+// Returns the exit code or -1 if it couldn't be run.
+static int run_program(char* const argv[], int silent)
+{
+	pid_t pid;
+	int status;
+	int fd;
+
+	pid = fork();
+	if (pid < 0)
+		return -1;
+	if (pid == 0)
+	{
+		if (silent)
+		{
+			fd = open("/dev/null", O_WRONLY);
+			if (fd >= 0)
+			{
+				dup2(fd, STDOUT_FILENO);
+				dup2(fd, STDERR_FILENO);
+			}
+		}
+		execvp(argv[0], argv);
+		_exit(127);
+	}
+	if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status))
+		return -1;
+	return WEXITSTATUS(status);
+}
+
+// Creates an empty filesystem on the rootfs device instead of deleting all files.
+// mkfs.<fs_type> of the box is used, without it the rootfs is deleted.
+// The device needs to be mounted at mount_point. It's mounted again afterwards.
+// Nothing is destroyed if the filesystem is still mounted somewhere else, e.g. at /oldroot when processes
+// kept running from it. After the discard there is no way back, so any later error is fatal.
+// Returns 1 on success, 0 if the old filesystem is still mounted and -1 if nothing is mounted anymore.
+int format_rootfs_device(const char* device, const char* mount_point, const char* fs_type, int quiet)
+{
+	char uuid[40];
+	char label[20];
+	char mkfs[40];
+	char* argv[12];
+	struct timespec start, end;
+	int discarded;
+	int argc = 0;
+	int ret;
+	int fd;
+
+	if (!fs_type)
+		fs_type = "ext4";
+	snprintf(mkfs, sizeof(mkfs), "mkfs.%s", fs_type);
+
+	// check mkfs is available before anything is destroyed
+	argv[0] = mkfs;
+	argv[1] = "-V";
+	argv[2] = NULL;
+	if (run_program(argv, 1) != 0)
+	{
+		my_printf("%s not available. Deleting rootfs instead\n", mkfs);
+		return 0;
+	}
+
+	read_ext_uuid_label(device, uuid, label);
+	if (umount(mount_point) != 0)
+	{
+		my_printf("Error unmounting %s: %s. Deleting rootfs instead\n", mount_point, strerror(errno));
+		return 0;
+	}
+
+	// a block device can't be opened exclusively as long as it's mounted anywhere
+	fd = open(device, O_RDONLY | O_EXCL);
+	if (fd < 0)
+	{
+		my_printf("%s is still in use: %s. Deleting rootfs instead\n", device, strerror(errno));
+		if (mount(device, mount_point, fs_type, 0, NULL) != 0)
+		{
+			my_printf("Error mounting %s again: %s\n", device, strerror(errno));
+			return -1;
+		}
+		return 0;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	discarded = discard_device(device, quiet);
+	// mkfs opens the device exclusively itself
+	close(fd);
+
+	argv[argc++] = mkfs;
+	argv[argc++] = "-F";
+	argv[argc++] = "-q";
+	if (discarded)
+	{
+		argv[argc++] = "-E";
+		argv[argc++] = "nodiscard";
+	}
+	if (uuid[0] != '\0')
+	{
+		argv[argc++] = "-U";
+		argv[argc++] = uuid;
+	}
+	if (label[0] != '\0')
+	{
+		argv[argc++] = "-L";
+		argv[argc++] = label;
+	}
+	argv[argc++] = (char*)device;
+	argv[argc] = NULL;
+	if (!quiet)
+		my_printf("Formatting rootfs: %s%s%s%s%s %s\n", mkfs, discarded ? " -E nodiscard" : "",
+			uuid[0] != '\0' ? " -U " : "", uuid, label[0] != '\0' ? " -L <label>" : "", device);
+	ret = run_program(argv, 0);
+	if (ret != 0 && discarded)
+	{
+		my_printf("Error formatting %s after discarding it\n", device);
+		return -1;
+	}
+
+	if (mount(device, mount_point, fs_type, 0, NULL) != 0)
+	{
+		my_printf("Error mounting %s after formatting: %s\n", device, strerror(errno));
+		return -1;
+	}
+	if (ret != 0)
+	{
+		my_printf("Error formatting %s. Deleting rootfs instead\n", device);
+		return 0;
+	}
 
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (!quiet)
+		my_printf("Formatted rootfs in %ld ms\n", elapsed_ms(&start, &end));
 	return 1;
 }
 
 int flash_unpack_rootfs(char* filename, int quiet, int no_write)
 {
 	int ret;
+	int swapped = 0;
 	char path[1000];
 
-	// instead of creating new filesystem just delete whole content
-	set_step("Deleting rootfs");
 	strcpy(path, "/oldroot_remount/");
 	if (current_rootfs_sub_dir[0] != '\0' && rootsubdir_check == 0) // box with rootSubDir feature
 	{
 		strcat(path, rootfs_sub_dir);
 		strcat(path, "/");
-	}
-	if (!no_write)
-	{
-		ret = rm_rootfs(path, quiet, no_write); // ignore return value as it always fails, because oldroot_remount cannot be removed
+
+		// extract into sibling directory and swap it into place if there is enough space for both rootfs
+		if (!no_write && rootfs_swap_possible("/oldroot_remount/", rootfs_file_stat.st_size))
+		{
+			ret = flash_unpack_rootfs_swap(filename, path, quiet);
+			if (ret == 0)
+				return 0;
+			swapped = ret > 0;
+		}
 	}
 
-	set_step("Extracting rootfs");
-	set_step_progress(0);
-	if (!no_write && current_rootfs_sub_dir[0] != '\0' && rootsubdir_check == 0) // box with rootSubDir feature
-		mkdir(path, 777); // directory is maybe not present
-	if (!untar_rootfs(filename, path, quiet, no_write))
+	if (!swapped)
 	{
-		my_printf("Error extracting rootfs\n");
-		return 0;
+		// whole partition: creating new filesystem is faster than deleting all files
+		if (format_rootfs && rootfs_flash_mode == TARBZ2 && path[strlen("/oldroot_remount/")] == '\0')
+		{
+			set_step("Formatting rootfs");
+			phase_begin(PHASE_DELETE);
+			if (!no_write)
+			{
+				ret = format_rootfs_device(rootfs_device, "/oldroot_remount/", rootfs_fs_type, quiet);
+				if (ret < 0)
+					return 0;
+				if (ret == 0)
+				{
+					ret = rm_rootfs(path, quiet, no_write); // ignore return value as it always fails, because oldroot_remount cannot be removed
+					if (trim_rootfs)
+						fstrim_rootfs("/oldroot_remount/", quiet);
+				}
+			}
+		}
+		else
+		{
+			// instead of creating new filesystem just delete whole content
+			set_step("Deleting rootfs");
+			phase_begin(PHASE_DELETE);
+			if (!no_write)
+			{
+				ret = rm_rootfs(path, quiet, no_write); // ignore return value as it always fails, because oldroot_remount cannot be removed
+				if (trim_rootfs)
+					fstrim_rootfs("/oldroot_remount/", quiet);
+			}
+		}
+
+		set_step("Extracting rootfs");
+		phase_begin(PHASE_FLASH);
+		progress_begin("Extracting rootfs", rootfs_file_stat.st_size);
+		if (!no_write && current_rootfs_sub_dir[0] != '\0' && rootsubdir_check == 0) // box with rootSubDir feature
+			mkdir(path, 0755); // directory is maybe not present
+		if (!untar_rootfs(filename, path, quiet, no_write))
+		{
+			my_printf("Error extracting rootfs\n");
+			return 0;
+		}
 	}
-	// sync filesystem double because of sdcard
-	sync();
-	sync();
-	sleep(1);
+	phase_begin(PHASE_SYNC);
+	sync_rootfs(quiet);
 	ret = chdir("/"); // needed to be able to umount filesystem
 	return 1;
 }
@@ -781,7 +781,10 @@ int cp_rootfs(char* source, char* target, int quiet, int no_write)
 int flash_ubi_loop_subdir(char* filename, char* nfi_filename, int quiet, int no_write)
 {
 	int ret;
+	int swap;
 	char rootfs_path[1000];
+	char copy_path[1000];
+	char old_path[1000];
 	char ubi_mount_path[1000];
 
 	strcpy(rootfs_path, "/oldroot_remount/");
@@ -799,18 +802,37 @@ int flash_ubi_loop_subdir(char* filename, char* nfi_filename, int quiet, int no_
 		return 0;
 	}
 
-	set_step("Deleting rootfs");
-	if (!no_write)
+	// copy into sibling directory and swap it into place if there is enough space for both rootfs
+	swap = !no_write && rootfs_swap_possible("/oldroot_remount/", rootfs_file_stat.st_size);
+	if (swap)
 	{
-		ret = rm_rootfs(rootfs_path, quiet, no_write); // ignore return value as it always fails, because oldroot_remount cannot be removed
+		get_rootfs_swap_paths(rootfs_path, copy_path, old_path);
+		set_step("Preparing rootfs");
+		if (!prepare_rootfs_swap(copy_path, old_path, quiet))
+			swap = 0;
 	}
 
-	if (!no_write)
+	if (!swap)
 	{
-		mkdir(rootfs_path, 777);
+		strcpy(copy_path, rootfs_path);
+		set_step("Deleting rootfs");
+		phase_begin(PHASE_DELETE);
+		if (!no_write)
+		{
+			ret = rm_rootfs(rootfs_path, quiet, no_write); // ignore return value as it always fails, because oldroot_remount cannot be removed
+			if (trim_rootfs)
+				fstrim_rootfs("/oldroot_remount/", quiet);
+		}
+
+		if (!no_write)
+		{
+			mkdir(rootfs_path, 0755);
+		}
 	}
+
 	set_step("Copying rootfs");
-	if (!cp_rootfs(ubi_mount_path, rootfs_path, quiet, no_write))
+	phase_begin(PHASE_FLASH);
+	if (!cp_rootfs(ubi_mount_path, copy_path, quiet, no_write))
 	{
 		sync();
 		umount_ubi_image(ubi_mount_path, quiet, no_write);
@@ -826,6 +848,14 @@ int flash_ubi_loop_subdir(char* filename, char* nfi_filename, int quiet, int no_
 	{
 		rmdir(ubi_mount_path);
 	}
+	if (swap)
+	{
+		ret = swap_rootfs_dirs(rootfs_path, copy_path, old_path);
+		if (ret < 0)
+			return 0;
+		if (ret > 0)
+			start_background_rm(old_path, quiet);
+	}
 
 	return 1;
 }
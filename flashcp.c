@@ -45,6 +45,15 @@
 #include <syslog.h>
 #include <linux/reboot.h>
 
+// progress output of ofgwrite UI
+void set_console_progress(const char* fmt, ...);
+void progress_begin(const char* name, long long total);
+void progress_update(long long done);
+void progress_end();
+
+// logging of ofgwrite
+void my_vlog(int level, FILE* stream, const char *format, va_list ap);
+
 typedef int bool;
 #define true 1
 #define false 0
@@ -82,18 +91,12 @@ typedef int bool;
 
 static void log_printf (int level,const char *fmt, ...)
 {
-	FILE *fp = level == LOG_NORMAL ? stdout : stderr;
-	va_list ap, ap2;
+	va_list ap;
+
+	// console and syslog are written by the logger of ofgwrite
 	va_start (ap,fmt);
-	va_copy(ap2, ap);
-	// print to console
-	vfprintf (fp,fmt,ap);
+	my_vlog (level == LOG_NORMAL ? LOG_INFO : LOG_ERR, level == LOG_NORMAL ? stdout : stderr, fmt, ap);
 	va_end (ap);
-
-	// print to syslog
-	vsyslog(LOG_INFO, fmt, ap2);
-	va_end(ap2);
-	fflush (fp);
 }
 
 static void showusage(bool error)
@@ -303,6 +306,7 @@ int flashcp_main (int argc,char *argv[])
 		set_step("Erasing rootfs");
 	else
 		set_step("Erasing kernel");
+	progress_begin("Erasing", erase.length);
 
 	if (flags & FLAG_VERBOSE)
 	{
@@ -312,9 +316,9 @@ int flashcp_main (int argc,char *argv[])
 		log_printf (LOG_NORMAL,"Erasing blocks: 0/%d (0%%)",blocks);
 		for (i = 1; i <= blocks; i++)
 		{
-			set_step_progress(PERCENTAGE (i,blocks));
+			progress_update((long long)(i - 1) * mtd.erasesize);
 			if (i%200 == 0)
-				log_printf (LOG_NORMAL,"\rErasing blocks: %d/%d (%d%%)",i,blocks,PERCENTAGE (i,blocks));
+				set_console_progress ("\rErasing blocks: %d/%d (%d%%)",i,blocks,PERCENTAGE (i,blocks));
 			if (ioctl (dev_fd,MEMERASE,&erase) < 0)
 			{
 				log_printf (LOG_NORMAL,"\n");
@@ -342,6 +346,8 @@ int flashcp_main (int argc,char *argv[])
 			return -1;
 		}
 	}
+	progress_update(erase.start + erase.length);
+	progress_end();
 	DEBUG("Erased %u / %luk bytes\n",erase.length,filestat.st_size);
 
 	/**********************************
@@ -352,6 +358,7 @@ int flashcp_main (int argc,char *argv[])
 		set_step("Writing rootfs");
 	else
 		set_step("Writing kernel");
+	progress_begin("Writing", filestat.st_size);
 
 	if (flags & FLAG_VERBOSE) log_printf (LOG_NORMAL,"Writing data: 0k/%luk (0%%)",KB (filestat.st_size));
 	size = filestat.st_size;
@@ -363,11 +370,11 @@ int flashcp_main (int argc,char *argv[])
 		if (size < BUFSIZE) i = size;
 		if (flags & FLAG_VERBOSE)
 			if ((KB (written + i)/1000) % 20 == 0)
-				log_printf (LOG_NORMAL,"\rWriting data: %dk/%luk (%lu%%)",
+				set_console_progress ("\rWriting data: %dk/%luk (%lu%%)",
 						KB (written + i),
 						KB (filestat.st_size),
 						PERCENTAGE (written + i,filestat.st_size));
-		set_step_progress(PERCENTAGE (written + i,filestat.st_size));
+		progress_update(written);
 
 		/* read from filename */
 		ret = safe_read (fil_fd,filename,src,i,flags & FLAG_VERBOSE);
@@ -402,6 +409,8 @@ int flashcp_main (int argc,char *argv[])
 		written += i;
 		size -= i;
 	}
+	progress_update(written);
+	progress_end();
 	if (flags & FLAG_VERBOSE)
 		log_printf (LOG_NORMAL,
 				"\rWriting data: %luk/%luk (100%%)\n",
@@ -434,8 +443,7 @@ int flashcp_main (int argc,char *argv[])
 		if (size < BUFSIZE) i = size;
 		if (flags & FLAG_VERBOSE)
 			if ((KB (written + i)/1000) % 10 == 0)
-				log_printf (LOG_NORMAL,
-						"\rVerifying data: %dk/%luk (%lu%%)",
+				set_console_progress ("\rVerifying data: %dk/%luk (%lu%%)",
 						KB (written + i),
 						KB (filestat.st_size),
 						PERCENTAGE (written + i,filestat.st_size));
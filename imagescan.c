@@ -0,0 +1,224 @@
+#include "ofgwrite.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+// Image directory manifest
+// The image directory is read once. Each file is stat'ed once and regular files are classified by
+// their first bytes. Kernel, rootfs and nfi files are chosen by name, the content only decides between
+// files with a known name, so stray files in the image directory are never flashed.
+
+static const char* magic_names[] = {
+	"unknown", "ubi", "bzip2", "xz", "nfi", "uimage", "jffs2"
+};
+
+// rootfs file names
+static const char* rootfs_names[] = {
+	"rootfs.bin",			// ET-xx00, XP1000
+	"root_cfe_auto.bin",	// Solo2
+	"root_cfe_auto.jffs2",	// other VU boxes
+	"oe_rootfs.bin",		// DAGS boxes
+	"e2jffs2.img",			// Spark boxes
+	"rootfs.tar.bz2",		// solo4k
+	"rootfs.ubi",			// Zgemma H9
+	"rootfs.tar.xz",		// dream
+	"rootfs-one.tar.bz2",	// dreamone
+	"rootfs-two.tar.bz2",	// dreamtwo
+	NULL
+};
+
+static int ends_with(const char* name, const char* suffix)
+{
+	size_t len = strlen(name);
+	size_t suffix_len = strlen(suffix);
+
+	return len >= suffix_len && strcmp(name + len - suffix_len, suffix) == 0;
+}
+
+static enum ImageMagicEnum sniff_magic(const unsigned char* buf, ssize_t len)
+{
+	static const unsigned char xz_magic[] = { 0xFD, '7', 'z', 'X', 'Z', 0x00 };
+
+	if (len >= 4 && memcmp(buf, "UBI#", 4) == 0)
+		return MAGIC_UBI;
+	if (len >= 3 && memcmp(buf, "BZh", 3) == 0)
+		return MAGIC_BZIP2;
+	if (len >= 6 && memcmp(buf, xz_magic, 6) == 0)
+		return MAGIC_XZ;
+	if (len >= 3 && memcmp(buf, "NFI", 3) == 0)
+		return MAGIC_NFI;
+	if (len >= 4 && buf[0] == 0x27 && buf[1] == 0x05 && buf[2] == 0x19 && buf[3] == 0x56)
+		return MAGIC_UIMAGE;
+	if (len >= 2 && ((buf[0] == 0x85 && buf[1] == 0x19) || (buf[0] == 0x19 && buf[1] == 0x85)))
+		return MAGIC_JFFS2;
+	return MAGIC_UNKNOWN;
+}
+
+static int compare_image_files(const void* a, const void* b)
+{
+	return strcmp(((const struct image_file*)a)->name, ((const struct image_file*)b)->name);
+}
+
+// Reads directory path (ending with /) into manifest. Returns 1 on success.
+int build_image_manifest(const char* path, struct image_manifest* manifest)
+{
+	struct image_file* files;
+	struct image_file* file;
+	struct dirent* entry;
+	unsigned char buf[8];
+	ssize_t len;
+	int fd;
+	DIR* d;
+
+	memset(manifest, 0, sizeof(*manifest));
+	snprintf(manifest->path, sizeof(manifest->path), "%s", path);
+
+	d = opendir(path);
+	if (!d)
+		return 0;
+	while ((entry = readdir(d)) != NULL)
+	{
+		if (entry->d_name[0] == '.' || strlen(entry->d_name) >= sizeof(file->name))
+			continue;
+		files = realloc(manifest->files, (manifest->count + 1) * sizeof(*files));
+		if (files == NULL)
+			break;
+		manifest->files = files;
+		file = &files[manifest->count];
+		memset(file, 0, sizeof(*file));
+		strcpy(file->name, entry->d_name);
+		if (fstatat(dirfd(d), entry->d_name, &file->st, 0) != 0 || S_ISDIR(file->st.st_mode))
+			continue;
+		if (S_ISREG(file->st.st_mode))
+		{
+			fd = openat(dirfd(d), entry->d_name, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+			if (fd >= 0)
+			{
+				len = read(fd, buf, sizeof(buf));
+				file->magic = sniff_magic(buf, len);
+				close(fd);
+			}
+		}
+		manifest->count++;
+	}
+	closedir(d);
+
+	// readdir order depends on the filesystem, sort to get the same choice every time
+	qsort(manifest->files, manifest->count, sizeof(*manifest->files), compare_image_files);
+	return 1;
+}
+
+void free_image_manifest(struct image_manifest* manifest)
+{
+	free(manifest->files);
+	manifest->files = NULL;
+	manifest->count = 0;
+}
+
+const char* image_magic_name(enum ImageMagicEnum magic)
+{
+	return magic_names[magic];
+}
+
+// Candidates score 2 for a known name and 3 if the content matches, too. Other files score 0.
+static int kernel_score(const struct image_file* file)
+{
+	if ((strstr(file->name, "kernel") != NULL && strstr(file->name, ".bin") != NULL)	// ET-xx00, XP1000, VU boxes, DAGS boxes
+	 || strcmp(file->name, "uImage") == 0)												// Spark boxes
+		return 2 + (file->magic == MAGIC_UIMAGE);
+	return 0;
+}
+
+static int rootfs_score(const struct image_file* file)
+{
+	int score = 0;
+	int i;
+
+	for (i = 0; rootfs_names[i] != NULL; i++)
+		if (strcmp(file->name, rootfs_names[i]) == 0)
+			break;
+	if (rootfs_names[i] != NULL || ends_with(file->name, ".tar.xz")) // *.tar.xz for dream dm520
+		score += 2;
+	if (score == 0)
+		return 0;
+
+	switch (file->magic)
+	{
+		case MAGIC_BZIP2: return score + (strstr(file->name, ".tar.bz2") != NULL);
+		case MAGIC_XZ:    return score + (strstr(file->name, ".tar.xz") != NULL);
+		case MAGIC_UBI:
+		case MAGIC_JFFS2: return score + (strstr(file->name, ".tar.") == NULL);
+		default:          return score;
+	}
+}
+
+static int nfi_score(const struct image_file* file)
+{
+	if (!ends_with(file->name, ".nfi"))
+		return 0;
+	return 2 + (file->magic == MAGIC_NFI);
+}
+
+// Returns the file with the best score. On equal score the first one in name order.
+static const struct image_file* select_image(const struct image_manifest* manifest, int (*score)(const struct image_file*), const char* what)
+{
+	const struct image_file* best = NULL;
+	int best_score = 0;
+	int s;
+	int i;
+
+	for (i = 0; i < manifest->count; i++)
+	{
+		s = score(&manifest->files[i]);
+		if (s == 0)
+			continue;
+		if (s > best_score)
+		{
+			if (best != NULL)
+				my_printf("Ignoring %s file: %s\n", what, best->name);
+			best = &manifest->files[i];
+			best_score = s;
+		}
+		else
+			my_printf("Ignoring %s file: %s\n", what, manifest->files[i].name);
+	}
+	return best;
+}
+
+const struct image_file* select_kernel_image(const struct image_manifest* manifest)
+{
+	return select_image(manifest, kernel_score, "kernel");
+}
+
+const struct image_file* select_rootfs_image(const struct image_manifest* manifest)
+{
+	return select_image(manifest, rootfs_score, "rootfs");
+}
+
+const struct image_file* select_nfi_image(const struct image_manifest* manifest)
+{
+	return select_image(manifest, nfi_score, "nfi");
+}
+
+// Image type of a rootfs file. The content wins over the name.
+enum ImageTypeEnum rootfs_image_type(const struct image_file* file)
+{
+	switch (file->magic)
+	{
+		case MAGIC_BZIP2: return TAR_BASED;
+		case MAGIC_XZ:    return TAR_UBI;
+		case MAGIC_UBI:
+		case MAGIC_JFFS2: return UBI;
+		default:          break;
+	}
+	if (ends_with(file->name, ".tar.xz"))
+		return TAR_UBI;
+	if (strstr(file->name, ".tar.") != NULL)
+		return TAR_BASED;
+	return UBI;
+}
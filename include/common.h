@@ -63,7 +63,7 @@ extern "C" {
 /* Verbose messages */
 #define bareverbose(verbose, fmt, ...) do {                        \
 	if (verbose)                                               \
-		printf(fmt, ##__VA_ARGS__);                        \
+		my_printf(fmt, ##__VA_ARGS__);                     \
 } while(0)
 #define verbose(verbose, fmt, ...) \
 	bareverbose(verbose, "%s: " fmt "\n", PROGRAM_NAME, ##__VA_ARGS__)
@@ -0,0 +1,385 @@
+#include "ofgwrite.h"
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <syslog.h>
+#include <sched.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+
+// Logging of my_printf and my_fprintf
+// Messages are formatted once into a slot of a ring buffer and a logger thread writes them to the
+// console, syslog and the log file, so slow syslog socket writes are not done in the flash loops.
+// The slots are claimed without a lock (bounded queue with a sequence number per slot). Without the
+// logger thread, e.g. in forked children, messages are written directly.
+
+#define LOG_SLOTS 256
+#define LOG_SLOT_SIZE 256
+
+struct log_slot
+{
+	atomic_uint seq;	// == position: free, == position + 1: message ready
+	int level;
+	int console_only;	// progress lines of the UI
+	FILE* stream;
+	char* long_msg;		// messages which don't fit into msg
+	char msg[LOG_SLOT_SIZE];
+};
+
+static struct log_slot log_slots[LOG_SLOTS];
+static atomic_uint log_head;	// next position to claim
+static atomic_uint log_done;	// next position to write
+static atomic_int log_running = 0;
+static pthread_t log_thread;
+static pthread_mutex_t log_write_lock = PTHREAD_MUTEX_INITIALIZER;
+static sem_t log_sem;
+
+static int log_levels[LOG_SINK_COUNT] = { LOG_INFO, LOG_INFO, LOG_DEBUG };
+static FILE* log_file = NULL;
+int log_max_level = LOG_INFO;
+
+static const char* level_names[] = {
+	"emerg", "alert", "crit", "err", "warning", "notice", "info", "debug"
+};
+
+static void update_max_level()
+{
+	log_max_level = log_levels[LOG_SINK_CONSOLE] > log_levels[LOG_SINK_SYSLOG] ? log_levels[LOG_SINK_CONSOLE] : log_levels[LOG_SINK_SYSLOG];
+	if (log_file != NULL && log_levels[LOG_SINK_FILE] > log_max_level)
+		log_max_level = log_levels[LOG_SINK_FILE];
+}
+
+static int parse_level(const char* str, int len)
+{
+	char* endptr;
+	long val;
+	int i;
+
+	for (i = 0; i <= LOG_DEBUG; i++)
+		if (strlen(level_names[i]) == len && strncasecmp(str, level_names[i], len) == 0)
+			return i;
+	val = strtol(str, &endptr, 10);
+	if (endptr != str + len || val < 0 || val > LOG_DEBUG)
+		return -1;
+	return val;
+}
+
+// Sets the levels of the sinks like "info,notice,debug" (console, syslog, log file). Missing levels are kept.
+int set_log_levels(const char* arg)
+{
+	int levels[LOG_SINK_COUNT];
+	const char* p = arg;
+	int sink = 0;
+	int len;
+
+	memcpy(levels, log_levels, sizeof(levels));
+	while (sink < LOG_SINK_COUNT)
+	{
+		len = strcspn(p, ",");
+		if (len > 0 && (levels[sink] = parse_level(p, len)) < 0)
+			return 0;
+		sink++;
+		if (p[len] == '\0')
+			break;
+		p += len + 1;
+	}
+	if (sink == LOG_SINK_COUNT && p[strcspn(p, ",")] != '\0')
+		return 0;
+	memcpy(log_levels, levels, sizeof(levels));
+	update_max_level();
+	return 1;
+}
+
+int open_log_file(const char* filename)
+{
+	log_file = fopen(filename, "a");
+	if (log_file == NULL)
+	{
+		my_printf("Error: Cannot open log file %s: %s\n", filename, strerror(errno));
+		return 0;
+	}
+	// line buffered, forked children write directly and exit without flushing
+	setvbuf(log_file, NULL, _IOLBF, 0);
+	update_max_level();
+	return 1;
+}
+
+// Closes the log file if it's on the filesystem of path, otherwise the open file keeps it busy
+void close_log_file_on(const char* path)
+{
+	struct stat file_st;
+	struct stat path_st;
+	FILE* file;
+
+	if (log_file == NULL || fstat(fileno(log_file), &file_st) != 0 || stat(path, &path_st) != 0
+	 || file_st.st_dev != path_st.st_dev)
+		return;
+	my_printf("Log file is on %s. Closing it, so that %s can be unmounted\n", path, path);
+	flush_logger();
+	pthread_mutex_lock(&log_write_lock);
+	file = log_file;
+	log_file = NULL;
+	update_max_level();
+	pthread_mutex_unlock(&log_write_lock);
+	fclose(file);
+}
+
+static void write_message(int level, FILE* stream, int console_only, const char* msg)
+{
+	if (level <= log_levels[LOG_SINK_CONSOLE])
+		fputs(msg, stream);
+	if (console_only)
+		return;
+	if (level <= log_levels[LOG_SINK_SYSLOG])
+		syslog(level, "%s", msg);
+	if (log_file != NULL && level <= log_levels[LOG_SINK_FILE])
+		fputs(msg, log_file);
+}
+
+// Writes all ready messages. Returns 0 if there was nothing to write.
+static int write_messages()
+{
+	struct log_slot* slot;
+	unsigned int pos;
+	int written = 0;
+
+	pthread_mutex_lock(&log_write_lock);
+	pos = atomic_load(&log_done);
+	for (;;)
+	{
+		slot = &log_slots[pos % LOG_SLOTS];
+		if (atomic_load_explicit(&slot->seq, memory_order_acquire) != pos + 1)
+			break;
+		write_message(slot->level, slot->stream, slot->console_only, slot->long_msg != NULL ? slot->long_msg : slot->msg);
+		free(slot->long_msg);
+		slot->long_msg = NULL;
+		atomic_store_explicit(&slot->seq, pos + LOG_SLOTS, memory_order_release);
+		pos++;
+		atomic_store(&log_done, pos);
+		written = 1;
+	}
+	if (written)
+		fflush(stdout);
+	pthread_mutex_unlock(&log_write_lock);
+	return written;
+}
+
+static void* logger_thread(void* arg)
+{
+	while (atomic_load(&log_running))
+	{
+		while (sem_wait(&log_sem) != 0 && errno == EINTR)
+			;
+		write_messages();
+	}
+	return NULL;
+}
+
+static void reset_ring()
+{
+	unsigned int i;
+
+	for (i = 0; i < LOG_SLOTS; i++)
+	{
+		log_slots[i].long_msg = NULL;
+		atomic_store(&log_slots[i].seq, i);
+	}
+	atomic_store(&log_head, 0);
+	atomic_store(&log_done, 0);
+}
+
+// Waits until all messages logged so far are written
+void flush_logger()
+{
+	unsigned int head = atomic_load(&log_head);
+
+	if (!atomic_load(&log_running))
+		return;
+	while ((int)(atomic_load(&log_done) - head) < 0)
+	{
+		sem_post(&log_sem);
+		sched_yield();
+	}
+}
+
+// the messages are written by the parent, the child writes directly
+static void logger_atfork_prepare()
+{
+	flush_logger();
+	pthread_mutex_lock(&log_write_lock);
+	fflush(stdout);
+}
+
+static void logger_atfork_parent()
+{
+	pthread_mutex_unlock(&log_write_lock);
+}
+
+static void logger_atfork_child()
+{
+	pthread_mutex_init(&log_write_lock, NULL);
+	if (atomic_load(&log_running))
+	{
+		atomic_store(&log_running, 0);
+		reset_ring();
+	}
+}
+
+void start_logger()
+{
+	static int initialized = 0;
+
+	if (atomic_load(&log_running))
+		return;
+	if (!initialized)
+	{
+		reset_ring();
+		sem_init(&log_sem, 0, 0);
+		pthread_atfork(logger_atfork_prepare, logger_atfork_parent, logger_atfork_child);
+		atexit(stop_logger);
+		initialized = 1;
+	}
+	atomic_store(&log_running, 1);
+	if (pthread_create(&log_thread, NULL, logger_thread, NULL) != 0)
+	{
+		atomic_store(&log_running, 0);
+		my_printf("Error: Cannot start logger thread. Logging directly\n");
+	}
+}
+
+// Stops the logger thread after all messages are written
+void stop_logger()
+{
+	if (!atomic_load(&log_running))
+		return;
+	flush_logger();
+	atomic_store(&log_running, 0);
+	sem_post(&log_sem);
+	pthread_join(log_thread, NULL);
+	write_messages();
+	if (log_file != NULL)
+		fflush(log_file);
+}
+
+static void queue_message(int level, FILE* stream, int console_only, const char* fmt, va_list ap)
+{
+	struct log_slot* slot;
+	unsigned int pos;
+	unsigned int seq;
+	va_list ap2;
+	int len;
+
+	pos = atomic_load(&log_head);
+	for (;;)
+	{
+		slot = &log_slots[pos % LOG_SLOTS];
+		seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+		if (seq == pos)
+		{
+			if (atomic_compare_exchange_weak(&log_head, &pos, pos + 1))
+				break;
+		}
+		else if ((int)(seq - pos) < 0)
+		{
+			// full, wait for the logger thread
+			sem_post(&log_sem);
+			sched_yield();
+			pos = atomic_load(&log_head);
+		}
+		else
+			pos = atomic_load(&log_head);
+	}
+
+	slot->level = level;
+	slot->console_only = console_only;
+	slot->stream = stream;
+	va_copy(ap2, ap);
+	len = vsnprintf(slot->msg, sizeof(slot->msg), fmt, ap);
+	if (len >= (int)sizeof(slot->msg))
+	{
+		slot->long_msg = malloc(len + 1);
+		if (slot->long_msg != NULL)
+			vsnprintf(slot->long_msg, len + 1, fmt, ap2);
+	}
+	va_end(ap2);
+	atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+	sem_post(&log_sem);
+}
+
+void my_vlog(int level, FILE* stream, const char* fmt, va_list ap)
+{
+	char* msg;
+
+	if (level > log_max_level)
+		return;
+	// progress line of the UI thread first
+	flush_console_progress();
+	if (atomic_load(&log_running))
+	{
+		queue_message(level, stream, 0, fmt, ap);
+		return;
+	}
+	if (vasprintf(&msg, fmt, ap) < 0)
+		return;
+	write_message(level, stream, 0, msg);
+	free(msg);
+}
+
+static void queue_console_line(const char* fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	queue_message(LOG_INFO, stdout, 1, fmt, ap);
+	va_end(ap);
+}
+
+// Writes a progress line of the UI to the console only. Through the queue while the logger thread
+// runs, so it stays in order with the messages logged before.
+void log_console_progress(const char* line)
+{
+	if (LOG_INFO > log_levels[LOG_SINK_CONSOLE])
+		return;
+	if (atomic_load(&log_running))
+	{
+		queue_console_line("%s", line);
+		return;
+	}
+	pthread_mutex_lock(&log_write_lock);
+	fputs(line, stdout);
+	fflush(stdout);
+	pthread_mutex_unlock(&log_write_lock);
+}
+
+void my_log(int level, const char* fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	my_vlog(level, stdout, fmt, ap);
+	va_end(ap);
+}
+
+void my_printf(char const *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	my_vlog(LOG_INFO, stdout, fmt, ap);
+	va_end(ap);
+}
+
+void my_fprintf(FILE * f, char const *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	my_vlog(LOG_INFO, f, fmt, ap);
+	va_end(ap);
+}
@@ -0,0 +1,388 @@
+#include "ofgwrite.h"
+#include "mtdemu.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+
+#include <mtd/ubi-media.h>
+#include <libubigen.h>
+
+// Benchmark of the flash write paths
+// Runs flash_erase, nandwrite, ubiformat and flashcp with the arguments used by ofgwrite against an
+// emulated MTD device (mtdemu.c), so changes to their loops can be measured on a PC.
+
+enum BenchTestEnum
+{
+	BENCH_FLASH_ERASE, BENCH_NANDWRITE, BENCH_UBIFORMAT, BENCH_FLASHCP, BENCH_COUNT
+};
+
+static const char* bench_names[BENCH_COUNT] = {
+	"flash_erase", "nandwrite", "ubiformat", "flashcp"
+};
+
+struct bench_result
+{
+	long ms;
+	struct mtdemu_stats stats;
+	int ret;
+};
+
+static struct mtdemu_config config;
+static char image_filename[1010];
+static long long image_size;
+static int verbose = 0;
+
+// UI of ofgwrite isn't available
+int set_step(char* str) { return 0; }
+void set_step_progress(int percent) {}
+void set_step_stats(const char* str) {}
+void set_console_progress(const char* fmt, ...) {}
+void flush_console_progress() {}
+void set_info_text(char* str) {}
+void phase_add_bytes(long long bytes) {}
+
+static void printUsage()
+{
+	printf("Usage: ofgwrite_mtdbench <parameter>\n");
+	printf("Options:\n");
+	printf("   -d --device=<file>     backing file of the emulated MTD device (default /tmp/ofgwrite_mtdbench.mtd)\n");
+	printf("   -s --size=<MB>         device size (default 64)\n");
+	printf("   -e --eb-size=<KB>      eraseblock size (default 128)\n");
+	printf("   -p --page-size=<bytes> page size (default 2048)\n");
+	printf("   -o --oob-size=<bytes>  OOB size (default 64)\n");
+	printf("   -b --bad=<eb>[,<eb>]   bad eraseblocks\n");
+	printf("   -E --erase-us=<us>     emulated latency of an eraseblock erase (default 0)\n");
+	printf("   -P --program-us=<us>   emulated latency of a page program (default 0)\n");
+	printf("   -i --image=<MB>        image size (default half of the device)\n");
+	printf("   -r --repeat=<n>        repeat every test n times and use the fastest run (default 3)\n");
+	printf("   -t --test=<name>[,<name>] flash_erase, nandwrite, ubiformat and/or flashcp (default all)\n");
+	printf("   -v --verbose           show output of the flash tools\n");
+	printf("   -h --help              show help\n");
+}
+
+static int parse_int(const char* str, int* val, int min)
+{
+	char* endptr;
+	long l;
+
+	errno = 0;
+	l = strtol(str, &endptr, 10);
+	if (errno != 0 || endptr == str || *endptr != '\0' || l < min || l > INT32_MAX)
+		return 0;
+	*val = l;
+	return 1;
+}
+
+static int parse_bad(const char* arg)
+{
+	char buf[1000];
+	char* tok;
+
+	snprintf(buf, sizeof(buf), "%s", arg);
+	for (tok = strtok(buf, ","); tok != NULL; tok = strtok(NULL, ","))
+	{
+		if (config.bad_count == MTDEMU_MAX_BAD || !parse_int(tok, &config.bad[config.bad_count], 0))
+			return 0;
+		config.bad_count++;
+	}
+	return 1;
+}
+
+static int parse_tests(const char* arg, int* tests)
+{
+	char buf[1000];
+	char* tok;
+	int i;
+
+	snprintf(buf, sizeof(buf), "%s", arg);
+	memset(tests, 0, BENCH_COUNT * sizeof(*tests));
+	for (tok = strtok(buf, ","); tok != NULL; tok = strtok(NULL, ","))
+	{
+		for (i = 0; i < BENCH_COUNT; i++)
+			if (strcmp(tok, bench_names[i]) == 0)
+				break;
+		if (i == BENCH_COUNT)
+			return 0;
+		tests[i] = 1;
+	}
+	return 1;
+}
+
+// xorshift, the data must not be compressible or 0xFF
+static void fill_random(unsigned char* buf, size_t len, uint32_t* state)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+	{
+		*state ^= *state << 13;
+		*state ^= *state >> 17;
+		*state ^= *state << 5;
+		buf[i] = *state;
+	}
+}
+
+// Raw image for nandwrite and flashcp or UBI image with valid EC headers for ubiformat
+static int create_image(int ubi)
+{
+	struct ubigen_info ui;
+	unsigned char* buf;
+	uint32_t state = 0x2545F491;
+	long long done;
+	int fd;
+	int ret = 1;
+
+	buf = malloc(config.eb_size);
+	if (buf == NULL)
+		return 0;
+	fd = open(image_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+	{
+		free(buf);
+		return 0;
+	}
+	ubigen_info_init(&ui, config.eb_size, config.page_size, config.page_size, 0, 1, 0x4F465257);
+	for (done = 0; done < image_size && ret; done += config.eb_size)
+	{
+		if (ubi)
+		{
+			// UBI images have partially used eraseblocks, ubiformat drops the 0xFF pages
+			memset(buf, 0xFF, config.eb_size);
+			ubigen_init_ec_hdr(&ui, (struct ubi_ec_hdr*)buf, 0);
+			fill_random(buf + ui.data_offs, (config.eb_size - ui.data_offs) * 3 / 4, &state);
+		}
+		else
+			fill_random(buf, config.eb_size, &state);
+		ret = write(fd, buf, config.eb_size) == config.eb_size;
+	}
+	free(buf);
+	if (close(fd) != 0)
+		ret = 0;
+	return ret;
+}
+
+static int run_main(int test)
+{
+	char* device = config.path;
+
+	optind = 0; // reset getopt_long
+	switch (test)
+	{
+		case BENCH_FLASH_ERASE:
+		{
+			char* argv[] = { "flash_erase", device, "0", "0", NULL };
+			return flash_erase_main(4, argv);
+		}
+		case BENCH_NANDWRITE:
+		{
+			char* argv[] = { "nandwrite", "-pm", device, image_filename, NULL };
+			return nandwrite_main(4, argv);
+		}
+		case BENCH_UBIFORMAT:
+		{
+			char* argv[] = { "ubiformat", device, "-f", image_filename, "-D", NULL };
+			return ubiformat_main(5, argv);
+		}
+		case BENCH_FLASHCP:
+		{
+			char* argv[] = { "flashcp", "-v", image_filename, device, NULL };
+			return flashcp_main(4, argv);
+		}
+	}
+	return -1;
+}
+
+// Runs the flash tool with the arguments used by ofgwrite. Returns its exit code.
+static int run_tool(int test)
+{
+	int null_fd = -1;
+	int stdout_fd = -1;
+	int ret;
+
+	// output of the flash tools would be measured, too
+	if (!verbose)
+	{
+		fflush(stdout);
+		null_fd = open("/dev/null", O_WRONLY);
+		stdout_fd = dup(STDOUT_FILENO);
+		if (null_fd >= 0 && stdout_fd >= 0)
+			dup2(null_fd, STDOUT_FILENO);
+	}
+	ret = run_main(test);
+	if (null_fd >= 0 && stdout_fd >= 0)
+	{
+		fflush(stdout);
+		dup2(stdout_fd, STDOUT_FILENO);
+	}
+	if (null_fd >= 0)
+		close(null_fd);
+	if (stdout_fd >= 0)
+		close(stdout_fd);
+	return ret;
+}
+
+static int run_bench(int test, int repeat, struct bench_result* result)
+{
+	struct mtdemu_config test_config = config;
+	struct timespec start, end;
+	long ms;
+	int i;
+
+	// flashcp is used for NOR flash
+	test_config.nor = test == BENCH_FLASHCP;
+	if (test_config.nor)
+		test_config.bad_count = 0;
+	if (test != BENCH_FLASH_ERASE && !create_image(test == BENCH_UBIFORMAT))
+	{
+		fprintf(stderr, "Error creating image %s: %s\n", image_filename, strerror(errno));
+		return 0;
+	}
+
+	result->ms = -1;
+	for (i = 0; i < repeat; i++)
+	{
+		if (!mtdemu_create(&test_config))
+		{
+			fprintf(stderr, "Error creating %s: %s\n", test_config.path, strerror(errno));
+			return 0;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		result->ret = run_tool(test);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		ms = elapsed_ms(&start, &end);
+		fflush(stdout);
+		if (result->ret != 0)
+			break;
+		if (result->ms < 0 || ms < result->ms)
+		{
+			result->ms = ms;
+			result->stats = mtdemu_stats;
+		}
+	}
+	mtdemu_remove();
+	unlink(image_filename);
+	return 1;
+}
+
+static void print_results(const int* tests, const struct bench_result* results)
+{
+	const struct bench_result* r;
+	double s;
+	int i;
+
+	printf("\n%-12s %8s %8s %9s %10s %10s %9s %9s\n", "test", "ms", "erases", "pages", "erases/s", "pages/s", "MB/s", "delay ms");
+	for (i = 0; i < BENCH_COUNT; i++)
+	{
+		if (!tests[i])
+			continue;
+		r = &results[i];
+		if (r->ret != 0 || r->ms < 0)
+		{
+			printf("%-12s failed (%d)\n", bench_names[i], r->ret);
+			continue;
+		}
+		// below the timer resolution there is no meaningful rate
+		if (r->ms == 0)
+		{
+			printf("%-12s %8ld %8lld %9lld %10s %10s %9s %9lld\n", bench_names[i], r->ms,
+					r->stats.erases, r->stats.programs, "-", "-", "-", r->stats.latency_us / 1000);
+			continue;
+		}
+		s = r->ms / 1000.0;
+		printf("%-12s %8ld %8lld %9lld %10.0f %10.0f %9.1f %9lld\n", bench_names[i], r->ms,
+				r->stats.erases, r->stats.programs, r->stats.erases / s, r->stats.programs / s,
+				r->stats.bytes_written / s / (1024 * 1024), r->stats.latency_us / 1000);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	static const char *short_options = "d:s:e:p:o:b:E:P:i:r:t:vh";
+	static const struct option long_options[] = {
+												{"device"    , required_argument, NULL, 'd'},
+												{"size"      , required_argument, NULL, 's'},
+												{"eb-size"   , required_argument, NULL, 'e'},
+												{"page-size" , required_argument, NULL, 'p'},
+												{"oob-size"  , required_argument, NULL, 'o'},
+												{"bad"       , required_argument, NULL, 'b'},
+												{"erase-us"  , required_argument, NULL, 'E'},
+												{"program-us", required_argument, NULL, 'P'},
+												{"image"     , required_argument, NULL, 'i'},
+												{"repeat"    , required_argument, NULL, 'r'},
+												{"test"      , required_argument, NULL, 't'},
+												{"verbose"   , no_argument      , NULL, 'v'},
+												{"help"      , no_argument      , NULL, 'h'},
+												{NULL        , no_argument      , NULL,  0} };
+	struct bench_result results[BENCH_COUNT];
+	int tests[BENCH_COUNT] = { 1, 1, 1, 1 };
+	int size_mb = 64;
+	int eb_kb = 128;
+	int image_mb = 0;
+	int repeat = 3;
+	int ok = 1;
+	int opt;
+	int i;
+
+	strcpy(config.path, "/tmp/ofgwrite_mtdbench.mtd");
+	config.page_size = 2048;
+	config.oob_size = 64;
+	while ((opt = getopt_long(argc, argv, short_options, long_options, NULL)) != -1)
+	{
+		switch (opt)
+		{
+			case 'd': snprintf(config.path, sizeof(config.path), "%s", optarg); break;
+			case 's': ok = parse_int(optarg, &size_mb, 1); break;
+			case 'e': ok = parse_int(optarg, &eb_kb, 1); break;
+			case 'p': ok = parse_int(optarg, &config.page_size, 1); break;
+			case 'o': ok = parse_int(optarg, &config.oob_size, 0); break;
+			case 'b': ok = parse_bad(optarg); break;
+			case 'E': ok = parse_int(optarg, &config.erase_us, 0); break;
+			case 'P': ok = parse_int(optarg, &config.program_us, 0); break;
+			case 'i': ok = parse_int(optarg, &image_mb, 1); break;
+			case 'r': ok = parse_int(optarg, &repeat, 1); break;
+			case 't': ok = parse_tests(optarg, tests); break;
+			case 'v': verbose = 1; break;
+			default: ok = 0; break;
+		}
+		if (!ok)
+		{
+			printUsage();
+			return EXIT_FAILURE;
+		}
+	}
+
+	config.eb_size = eb_kb * 1024;
+	config.eb_cnt = (int)((long long)size_mb * 1024 * 1024 / config.eb_size);
+	if (config.eb_size % config.page_size != 0 || config.eb_cnt < 4)
+	{
+		fprintf(stderr, "Error: Eraseblock size must be a multiple of the page size and the device at least 4 eraseblocks\n");
+		return EXIT_FAILURE;
+	}
+	image_size = image_mb > 0 ? (long long)image_mb * 1024 * 1024 : (long long)size_mb * 1024 * 1024 / 2;
+	image_size = image_size / config.eb_size * config.eb_size;
+	if (image_size + (long long)config.bad_count * config.eb_size > (long long)config.eb_cnt * config.eb_size)
+	{
+		fprintf(stderr, "Error: Image doesn't fit into the device\n");
+		return EXIT_FAILURE;
+	}
+	snprintf(image_filename, sizeof(image_filename), "%s.img", config.path);
+
+	set_log_levels(verbose ? "info,emerg" : "err,emerg");
+
+	fprintf(stderr, "Emulated MTD: %d eraseblocks of %d KB, page %d, OOB %d, %d bad, erase %d us, program %d us, image %lld MB\n",
+			config.eb_cnt, eb_kb, config.page_size, config.oob_size, config.bad_count,
+			config.erase_us, config.program_us, image_size / (1024 * 1024));
+	for (i = 0; i < BENCH_COUNT; i++)
+		if (tests[i] && !run_bench(i, repeat, &results[i]))
+			return EXIT_FAILURE;
+
+	print_results(tests, results);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,437 @@
+#include "mtdemu.h"
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <linux/falloc.h>
+
+#include <mtd/mtd-user.h>
+#include <libmtd.h>
+
+// MTD emulation for ofgwrite_mtdbench
+// Replaces lib/libmtd.a. The functions of libmtd work on a sparse backing file with configurable
+// geometry, bad blocks and erase/program latency. flashcp uses the MTD character device directly,
+// so read, write and ioctl are wrapped at link time (-Wl,--wrap) for descriptors of the backing file.
+// The data is stored inverted, so that holes read as erased flash (0xFF) and erasing punches holes.
+
+#define MTDEMU_MAX_FDS 1024
+#define MTDEMU_BUF_SIZE 65536
+
+struct mtdemu_stats mtdemu_stats;
+
+static struct mtdemu_config emu;
+static int emu_present = 0;
+static char emu_fds[MTDEMU_MAX_FDS];
+static unsigned char emu_buf[MTDEMU_BUF_SIZE];
+
+int __real_open64(const char* path, int flags, ...);
+int __real_close(int fd);
+ssize_t __real_read(int fd, void* buf, size_t count);
+ssize_t __real_write(int fd, const void* buf, size_t count);
+int __real_ioctl(int fd, unsigned long request, ...);
+
+static void invert(unsigned char* dst, const unsigned char* src, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		dst[i] = ~src[i];
+}
+
+// Short delays are busy waits, sleeping would take much longer than a page program
+static void emulate_latency(long long us)
+{
+	struct timespec end, now;
+
+	if (us <= 0)
+		return;
+	mtdemu_stats.latency_us += us;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	end.tv_sec += us / 1000000;
+	end.tv_nsec += (us % 1000000) * 1000;
+	if (end.tv_nsec >= 1000000000)
+	{
+		end.tv_sec++;
+		end.tv_nsec -= 1000000000;
+	}
+	if (us >= 1000)
+	{
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &end, NULL) == EINTR)
+			;
+		return;
+	}
+	do
+		clock_gettime(CLOCK_MONOTONIC, &now);
+	while (now.tv_sec < end.tv_sec || (now.tv_sec == end.tv_sec && now.tv_nsec < end.tv_nsec));
+}
+
+static int is_bad(int eb)
+{
+	int i;
+
+	for (i = 0; i < emu.bad_count; i++)
+		if (emu.bad[i] == eb)
+			return 1;
+	return 0;
+}
+
+static int erase_block(int fd, int eb)
+{
+	off_t offs = (off_t)eb * emu.eb_size;
+	int done;
+
+	if (eb < 0 || eb >= emu.eb_cnt)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	if (is_bad(eb))
+	{
+		errno = EIO;
+		return -1;
+	}
+	if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offs, emu.eb_size) != 0)
+	{
+		// no hole punching: write erased data
+		memset(emu_buf, 0, sizeof(emu_buf));
+		for (done = 0; done < emu.eb_size; done += MTDEMU_BUF_SIZE)
+			if (pwrite(fd, emu_buf, emu.eb_size - done < MTDEMU_BUF_SIZE ? emu.eb_size - done : MTDEMU_BUF_SIZE, offs + done) < 0)
+				return -1;
+	}
+	mtdemu_stats.erases++;
+	emulate_latency(emu.erase_us);
+	return 0;
+}
+
+static ssize_t program(int fd, const unsigned char* data, size_t len, off_t offs)
+{
+	size_t done = 0;
+	size_t chunk;
+	ssize_t ret;
+
+	while (done < len)
+	{
+		chunk = len - done < MTDEMU_BUF_SIZE ? len - done : MTDEMU_BUF_SIZE;
+		invert(emu_buf, data + done, chunk);
+		if (offs < 0)
+			ret = __real_write(fd, emu_buf, chunk);
+		else
+			ret = pwrite(fd, emu_buf, chunk, offs + done);
+		if (ret <= 0)
+			return done > 0 ? (ssize_t)done : ret;
+		done += ret;
+	}
+	mtdemu_stats.programs += (len + emu.page_size - 1) / emu.page_size;
+	mtdemu_stats.bytes_written += len;
+	emulate_latency((long long)emu.program_us * ((len + emu.page_size - 1) / emu.page_size));
+	return done;
+}
+
+// Creates a new sparse backing file. All eraseblocks are erased.
+int mtdemu_create(const struct mtdemu_config* config)
+{
+	int fd;
+
+	emu = *config;
+	memset(&mtdemu_stats, 0, sizeof(mtdemu_stats));
+	fd = __real_open64(emu.path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return 0;
+	if (ftruncate(fd, (off_t)emu.eb_size * emu.eb_cnt) != 0)
+	{
+		__real_close(fd);
+		return 0;
+	}
+	__real_close(fd);
+	emu_present = 1;
+	return 1;
+}
+
+void mtdemu_remove()
+{
+	if (emu_present)
+		unlink(emu.path);
+	emu_present = 0;
+}
+
+libmtd_t libmtd_open(void)
+{
+	if (!emu_present)
+	{
+		errno = ENODEV;
+		return NULL;
+	}
+	return &emu;
+}
+
+void libmtd_close(libmtd_t desc)
+{
+}
+
+int mtd_dev_present(libmtd_t desc, int mtd_num)
+{
+	return mtd_num == 0;
+}
+
+int mtd_get_info(libmtd_t desc, struct mtd_info *info)
+{
+	memset(info, 0, sizeof(*info));
+	info->mtd_dev_cnt = 1;
+	info->sysfs_supported = 1;
+	return 0;
+}
+
+int mtd_get_dev_info1(libmtd_t desc, int mtd_num, struct mtd_dev_info *mtd)
+{
+	if (mtd_num != 0)
+	{
+		errno = ENODEV;
+		return -1;
+	}
+	memset(mtd, 0, sizeof(*mtd));
+	mtd->major = 90;
+	mtd->type = emu.nor ? MTD_NORFLASH : MTD_NANDFLASH;
+	strcpy((char*)mtd->type_str, emu.nor ? "nor" : "nand");
+	strcpy((char*)mtd->name, "mtdemu");
+	mtd->size = (long long)emu.eb_size * emu.eb_cnt;
+	mtd->eb_cnt = emu.eb_cnt;
+	mtd->eb_size = emu.eb_size;
+	mtd->min_io_size = emu.nor ? 1 : emu.page_size;
+	mtd->subpage_size = mtd->min_io_size;
+	mtd->oob_size = emu.nor ? 0 : emu.oob_size;
+	mtd->region_cnt = 0;
+	mtd->writable = 1;
+	mtd->bb_allowed = !emu.nor;
+	return 0;
+}
+
+int mtd_get_dev_info(libmtd_t desc, const char *node, struct mtd_dev_info *mtd)
+{
+	if (!emu_present || strcmp(node, emu.path) != 0)
+	{
+		errno = ENODEV;
+		return -1;
+	}
+	return mtd_get_dev_info1(desc, 0, mtd);
+}
+
+int mtd_probe_node(libmtd_t desc, const char *node)
+{
+	return emu_present && strcmp(node, emu.path) == 0;
+}
+
+int mtd_lock(const struct mtd_dev_info *mtd, int fd, int eb)
+{
+	return 0;
+}
+
+int mtd_unlock(const struct mtd_dev_info *mtd, int fd, int eb)
+{
+	return 0;
+}
+
+int mtd_is_locked(const struct mtd_dev_info *mtd, int fd, int eb)
+{
+	return 0;
+}
+
+int mtd_erase(libmtd_t desc, const struct mtd_dev_info *mtd, int fd, int eb)
+{
+	return erase_block(fd, eb);
+}
+
+int mtd_regioninfo(int fd, int regidx, struct region_info_user *reginfo)
+{
+	errno = ENODEV;
+	return -1;
+}
+
+int mtd_torture(libmtd_t desc, const struct mtd_dev_info *mtd, int fd, int eb)
+{
+	return erase_block(fd, eb);
+}
+
+int mtd_is_bad(const struct mtd_dev_info *mtd, int fd, int eb)
+{
+	if (eb < 0 || eb >= emu.eb_cnt)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	return mtd->bb_allowed && is_bad(eb);
+}
+
+int mtd_mark_bad(const struct mtd_dev_info *mtd, int fd, int eb)
+{
+	if (!is_bad(eb) && emu.bad_count < MTDEMU_MAX_BAD)
+		emu.bad[emu.bad_count++] = eb;
+	return 0;
+}
+
+int mtd_read(const struct mtd_dev_info *mtd, int fd, int eb, int offs,
+	     void *buf, int len)
+{
+	ssize_t ret;
+
+	if (eb < 0 || eb >= emu.eb_cnt || offs < 0 || offs + len > emu.eb_size)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	ret = pread(fd, buf, len, (off_t)eb * emu.eb_size + offs);
+	if (ret != len)
+	{
+		if (ret >= 0)
+			errno = EIO;
+		return -1;
+	}
+	invert(buf, buf, len);
+	mtdemu_stats.reads++;
+	mtdemu_stats.bytes_read += len;
+	return 0;
+}
+
+int mtd_write(libmtd_t desc, const struct mtd_dev_info *mtd, int fd, int eb,
+	      int offs, void *data, int len, void *oob, int ooblen,
+	      uint8_t mode)
+{
+	if (eb < 0 || eb >= emu.eb_cnt || offs < 0 || offs + len > emu.eb_size
+	 || offs % mtd->min_io_size != 0 || len % mtd->min_io_size != 0)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	if (is_bad(eb))
+	{
+		errno = EIO;
+		return -1;
+	}
+	// OOB data isn't stored
+	if (data != NULL && program(fd, data, len, (off_t)eb * emu.eb_size + offs) != len)
+		return -1;
+	return 0;
+}
+
+int mtd_read_oob(libmtd_t desc, const struct mtd_dev_info *mtd, int fd,
+		 uint64_t start, uint64_t length, void *data)
+{
+	memset(data, 0xFF, length);
+	return 0;
+}
+
+int mtd_write_oob(libmtd_t desc, const struct mtd_dev_info *mtd, int fd,
+		  uint64_t start, uint64_t length, void *data)
+{
+	return 0;
+}
+
+int mtd_write_img(const struct mtd_dev_info *mtd, int fd, int eb, int offs,
+		  const char *img_name)
+{
+	errno = EOPNOTSUPP;
+	return -1;
+}
+
+// MTD character device, used by flashcp
+
+int __wrap_open64(const char* path, int flags, ...)
+{
+	mode_t mode = 0;
+	va_list ap;
+	int fd;
+
+	if (flags & (O_CREAT | O_TMPFILE))
+	{
+		va_start(ap, flags);
+		mode = va_arg(ap, mode_t);
+		va_end(ap);
+	}
+	fd = __real_open64(path, flags, mode);
+	if (fd >= 0 && fd < MTDEMU_MAX_FDS)
+		emu_fds[fd] = emu_present && strcmp(path, emu.path) == 0;
+	return fd;
+}
+
+int __wrap_close(int fd)
+{
+	if (fd >= 0 && fd < MTDEMU_MAX_FDS)
+		emu_fds[fd] = 0;
+	return __real_close(fd);
+}
+
+static int is_emulated(int fd)
+{
+	return fd >= 0 && fd < MTDEMU_MAX_FDS && emu_fds[fd];
+}
+
+ssize_t __wrap_read(int fd, void* buf, size_t count)
+{
+	ssize_t ret = __real_read(fd, buf, count);
+
+	if (ret > 0 && is_emulated(fd))
+	{
+		invert(buf, buf, ret);
+		mtdemu_stats.reads++;
+		mtdemu_stats.bytes_read += ret;
+	}
+	return ret;
+}
+
+ssize_t __wrap_write(int fd, const void* buf, size_t count)
+{
+	if (!is_emulated(fd))
+		return __real_write(fd, buf, count);
+	return program(fd, buf, count, -1);
+}
+
+int __wrap_ioctl(int fd, unsigned long request, ...)
+{
+	struct mtd_info_user* info;
+	struct erase_info_user* erase;
+	va_list ap;
+	void* arg;
+	uint32_t offs;
+
+	va_start(ap, request);
+	arg = va_arg(ap, void*);
+	va_end(ap);
+	if (!is_emulated(fd))
+		return __real_ioctl(fd, request, arg);
+
+	switch (request)
+	{
+		case MEMGETINFO:
+			info = arg;
+			memset(info, 0, sizeof(*info));
+			info->type = emu.nor ? MTD_NORFLASH : MTD_NANDFLASH;
+			info->flags = emu.nor ? MTD_CAP_NORFLASH : MTD_CAP_NANDFLASH;
+			info->size = (uint32_t)emu.eb_size * emu.eb_cnt;
+			info->erasesize = emu.eb_size;
+			info->writesize = emu.nor ? 1 : emu.page_size;
+			info->oobsize = emu.nor ? 0 : emu.oob_size;
+			return 0;
+		case MEMERASE:
+			erase = arg;
+			if (erase->start % emu.eb_size != 0 || erase->length % emu.eb_size != 0)
+			{
+				errno = EINVAL;
+				return -1;
+			}
+			for (offs = erase->start; offs < erase->start + erase->length; offs += emu.eb_size)
+				if (erase_block(fd, offs / emu.eb_size) != 0)
+					return -1;
+			return 0;
+		case MTDFILEMODE:
+			return 0;
+		default:
+			errno = ENOTTY;
+			return -1;
+	}
+}
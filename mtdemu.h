@@ -0,0 +1,37 @@
+#ifndef __MTDEMU_H__
+#define __MTDEMU_H__
+
+// MTD device emulated in a sparse file for ofgwrite_mtdbench
+
+#define MTDEMU_MAX_BAD 64
+
+struct mtdemu_config
+{
+	char path[1000];		// backing file, also used as device node name
+	int nor;				// NOR flash like for flashcp, otherwise NAND
+	int eb_size;
+	int page_size;
+	int oob_size;
+	int eb_cnt;
+	int erase_us;			// latency of an eraseblock erase
+	int program_us;			// latency of a page program
+	int bad_count;
+	int bad[MTDEMU_MAX_BAD];
+};
+
+struct mtdemu_stats
+{
+	long long erases;
+	long long programs;		// pages
+	long long reads;
+	long long bytes_written;
+	long long bytes_read;
+	long long latency_us;	// emulated erase and program time
+};
+
+extern struct mtdemu_stats mtdemu_stats;
+
+int mtdemu_create(const struct mtdemu_config* config);
+void mtdemu_remove();
+
+#endif
@@ -0,0 +1,795 @@
+#include "ofgwrite.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// Decoder for .mvi background images
+// A .mvi file is a MPEG-1 or MPEG-2 video elementary stream with one I-frame, which showiframe passes
+// to the hardware decoder. Only intra coded 4:2:0 frame pictures are needed for that, so the first
+// picture is decoded here in software and scaled to the framebuffer size.
+
+#define MVI_MAX_SIZE (4 * 1024 * 1024)
+#define MVI_MAX_WIDTH 1920
+#define MVI_MAX_HEIGHT 1088
+
+// variable length codes as written in ISO/IEC 13818-2 annex B, the sign bit is not part of the code
+struct vlc_code
+{
+	const char* bits;
+	short a;
+	short b;
+};
+
+struct vlc
+{
+	unsigned short code;
+	unsigned char len;
+	short a;
+	short b;
+};
+
+#define VLC_EOB -1
+#define VLC_ESCAPE -2
+#define VLC_STUFFING -3
+
+// table B.1 macroblock_address_increment
+static const struct vlc_code mba_codes[] = {
+	{ "1", 1 }, { "011", 2 }, { "010", 3 }, { "0011", 4 }, { "0010", 5 }, { "00011", 6 }, { "00010", 7 },
+	{ "0000111", 8 }, { "0000110", 9 }, { "00001011", 10 }, { "00001010", 11 }, { "00001001", 12 },
+	{ "00001000", 13 }, { "00000111", 14 }, { "00000110", 15 }, { "0000010111", 16 }, { "0000010110", 17 },
+	{ "0000010101", 18 }, { "0000010100", 19 }, { "0000010011", 20 }, { "0000010010", 21 },
+	{ "00000100011", 22 }, { "00000100010", 23 }, { "00000100001", 24 }, { "00000100000", 25 },
+	{ "00000011111", 26 }, { "00000011110", 27 }, { "00000011101", 28 }, { "00000011100", 29 },
+	{ "00000011011", 30 }, { "00000011010", 31 }, { "00000011001", 32 }, { "00000011000", 33 },
+	{ "00000001000", VLC_ESCAPE }, { "00000001111", VLC_STUFFING }, { NULL }
+};
+
+// tables B.12 and B.13 dct_dc_size
+static const struct vlc_code dc_luma_codes[] = {
+	{ "00", 1 }, { "01", 2 }, { "100", 0 }, { "101", 3 }, { "110", 4 }, { "1110", 5 }, { "11110", 6 },
+	{ "111110", 7 }, { "1111110", 8 }, { "11111110", 9 }, { "111111110", 10 }, { "111111111", 11 }, { NULL }
+};
+
+static const struct vlc_code dc_chroma_codes[] = {
+	{ "00", 0 }, { "01", 1 }, { "10", 2 }, { "110", 3 }, { "1110", 4 }, { "11110", 5 }, { "111110", 6 },
+	{ "1111110", 7 }, { "11111110", 8 }, { "111111110", 9 }, { "1111111110", 10 }, { "1111111111", 11 }, { NULL }
+};
+
+// codes from (0,16) on are the same in tables B.14 and B.15
+#define DCT_COMMON_CODES \
+	{ "000000000111 11", 0, 16 }, { "000000000111 10", 0, 17 }, { "000000000111 01", 0, 18 }, \
+	{ "000000000111 00", 0, 19 }, { "000000000110 11", 0, 20 }, { "000000000110 10", 0, 21 }, \
+	{ "000000000110 01", 0, 22 }, { "000000000110 00", 0, 23 }, { "000000000101 11", 0, 24 }, \
+	{ "000000000101 10", 0, 25 }, { "000000000101 01", 0, 26 }, { "000000000101 00", 0, 27 }, \
+	{ "000000000100 11", 0, 28 }, { "000000000100 10", 0, 29 }, { "000000000100 01", 0, 30 }, \
+	{ "000000000100 00", 0, 31 }, { "000000000011 000", 0, 32 }, { "000000000010 111", 0, 33 }, \
+	{ "000000000010 110", 0, 34 }, { "000000000010 101", 0, 35 }, { "000000000010 100", 0, 36 }, \
+	{ "000000000010 011", 0, 37 }, { "000000000010 010", 0, 38 }, { "000000000010 001", 0, 39 }, \
+	{ "000000000010 000", 0, 40 }, { "000000000011 111", 1, 8 }, { "000000000011 110", 1, 9 }, \
+	{ "000000000011 101", 1, 10 }, { "000000000011 100", 1, 11 }, { "000000000011 011", 1, 12 }, \
+	{ "000000000011 010", 1, 13 }, { "000000000011 001", 1, 14 }, { "000000000001 0011", 1, 15 }, \
+	{ "000000000001 0010", 1, 16 }, { "000000000001 0001", 1, 17 }, { "000000000001 0000", 1, 18 }, \
+	{ "000000000001 0100", 6, 3 }, { "000000000001 1010", 11, 2 }, { "000000000001 1001", 12, 2 }, \
+	{ "000000000001 1000", 13, 2 }, { "000000000001 0111", 14, 2 }, { "000000000001 0110", 15, 2 }, \
+	{ "000000000001 0101", 16, 2 }, { "000000000001 1111", 27, 1 }, { "000000000001 1110", 28, 1 }, \
+	{ "000000000001 1101", 29, 1 }, { "000000000001 1100", 30, 1 }, { "000000000001 1011", 31, 1 }
+
+// codes of table B.14 and B.15 with 10 to 13 bits which are the same
+#define DCT_COMMON_SHORT_CODES \
+	{ "0000 0001 1100", 3, 3 }, { "0000 0001 0010", 4, 3 }, { "0000 0001 1110", 6, 2 }, \
+	{ "0000 0001 0101", 7, 2 }, { "0000 0001 0001", 8, 2 }, { "0000 0001 1111", 17, 1 }, \
+	{ "0000 0001 1010", 18, 1 }, { "0000 0001 1001", 19, 1 }, { "0000 0001 0111", 20, 1 }, \
+	{ "0000 0001 0110", 21, 1 }, { "0000 0000 1011 0", 1, 6 }, { "0000 0000 1010 1", 1, 7 }, \
+	{ "0000 0000 1010 0", 2, 5 }, { "0000 0000 1001 1", 3, 4 }, { "0000 0000 1001 0", 5, 3 }, \
+	{ "0000 0000 1000 1", 9, 2 }, { "0000 0000 1000 0", 10, 2 }, { "0000 0000 1111 1", 22, 1 }, \
+	{ "0000 0000 1111 0", 23, 1 }, { "0000 0000 1110 1", 24, 1 }, { "0000 0000 1110 0", 25, 1 }, \
+	{ "0000 0000 1101 1", 26, 1 }
+
+// table B.14 DCT coefficients table zero, without the first coefficient code of non intra blocks
+static const struct vlc_code dct_zero_codes[] = {
+	{ "10", VLC_EOB }, { "11", 0, 1 }, { "011", 1, 1 }, { "0100", 0, 2 }, { "0101", 2, 1 },
+	{ "0010 1", 0, 3 }, { "0011 1", 3, 1 }, { "0011 0", 4, 1 }, { "0001 10", 1, 2 }, { "0001 11", 5, 1 },
+	{ "0001 01", 6, 1 }, { "0001 00", 7, 1 }, { "0000 110", 0, 4 }, { "0000 100", 2, 2 },
+	{ "0000 111", 8, 1 }, { "0000 101", 9, 1 }, { "0000 01", VLC_ESCAPE }, { "0010 0110", 0, 5 },
+	{ "0010 0001", 0, 6 }, { "0010 0101", 1, 3 }, { "0010 0100", 3, 2 }, { "0010 0111", 10, 1 },
+	{ "0010 0011", 11, 1 }, { "0010 0010", 12, 1 }, { "0010 0000", 13, 1 }, { "0000 0010 10", 0, 7 },
+	{ "0000 0011 00", 1, 4 }, { "0000 0010 11", 2, 3 }, { "0000 0011 11", 4, 2 }, { "0000 0010 01", 5, 2 },
+	{ "0000 0011 10", 14, 1 }, { "0000 0011 01", 15, 1 }, { "0000 0010 00", 16, 1 },
+	{ "0000 0001 1101", 0, 8 }, { "0000 0001 1000", 0, 9 }, { "0000 0001 0011", 0, 10 },
+	{ "0000 0001 0000", 0, 11 }, { "0000 0001 1011", 1, 5 }, { "0000 0001 0100", 2, 4 },
+	{ "0000 0000 1101 0", 0, 12 }, { "0000 0000 1100 1", 0, 13 }, { "0000 0000 1100 0", 0, 14 },
+	{ "0000 0000 1011 1", 0, 15 },
+	DCT_COMMON_SHORT_CODES,
+	DCT_COMMON_CODES,
+	{ NULL }
+};
+
+// table B.15 DCT coefficients table one, used with intra_vlc_format
+static const struct vlc_code dct_one_codes[] = {
+	{ "10", 0, 1 }, { "010", 1, 1 }, { "110", 0, 2 }, { "0110", VLC_EOB }, { "0111", 0, 3 },
+	{ "0010 1", 2, 1 }, { "0011 1", 3, 1 }, { "0011 0", 1, 2 }, { "1110 0", 0, 4 }, { "1110 1", 0, 5 },
+	{ "0001 10", 4, 1 }, { "0001 11", 5, 1 }, { "0001 01", 0, 6 }, { "0001 00", 0, 7 },
+	{ "0000 01", VLC_ESCAPE }, { "0000 110", 6, 1 }, { "0000 100", 7, 1 }, { "0000 111", 2, 2 },
+	{ "0000 101", 8, 1 }, { "1111 000", 9, 1 }, { "1111 001", 1, 3 }, { "1111 010", 10, 1 },
+	{ "1111 011", 0, 8 }, { "1111 100", 0, 9 }, { "0010 0110", 3, 2 }, { "0010 0001", 11, 1 },
+	{ "0010 0101", 12, 1 }, { "0010 0100", 13, 1 }, { "0010 0111", 1, 4 }, { "1111 1100", 2, 3 },
+	{ "1111 1101", 4, 2 }, { "0010 0011", 0, 10 }, { "0010 0010", 0, 11 }, { "0010 0000", 1, 5 },
+	{ "1111 1010", 0, 12 }, { "1111 1011", 0, 13 }, { "1111 1110", 0, 14 }, { "1111 1111", 0, 15 },
+	{ "0000 0010 0", 5, 2 }, { "0000 0010 1", 14, 1 }, { "0000 0011 1", 15, 1 }, { "0000 0011 01", 16, 1 },
+	{ "0000 0011 00", 2, 4 },
+	DCT_COMMON_SHORT_CODES,
+	DCT_COMMON_CODES,
+	{ NULL }
+};
+
+static const unsigned char zigzag_scan[64] = {
+	 0,  1,  8, 16,  9,  2,  3, 10, 17, 24, 32, 25, 18, 11,  4,  5,
+	12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13,  6,  7, 14, 21, 28,
+	35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+	58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63
+};
+
+static const unsigned char alternate_scan[64] = {
+	 0,  8, 16, 24,  1,  9,  2, 10, 17, 25, 32, 40, 48, 56, 57, 49,
+	41, 33, 26, 18,  3, 11,  4, 12, 19, 27, 34, 42, 50, 58, 35, 43,
+	51, 59, 20, 28,  5, 13,  6, 14, 21, 29, 36, 44, 52, 60, 37, 45,
+	53, 61, 22, 30,  7, 15, 23, 31, 38, 46, 54, 62, 39, 47, 55, 63
+};
+
+static const unsigned char default_intra_matrix[64] = {
+	 8, 16, 19, 22, 26, 27, 29, 34,
+	16, 16, 22, 24, 27, 29, 34, 37,
+	19, 22, 26, 27, 29, 34, 34, 38,
+	22, 22, 26, 27, 29, 34, 37, 40,
+	22, 26, 27, 29, 32, 35, 40, 48,
+	26, 27, 29, 32, 35, 40, 48, 58,
+	26, 27, 29, 34, 38, 46, 56, 69,
+	27, 29, 35, 38, 46, 56, 69, 83
+};
+
+static const unsigned char non_linear_quant[32] = {
+	 0,  1,  2,  3,  4,  5,  6,  7,  8, 10, 12, 14, 16, 18, 20, 22,
+	24, 28, 32, 36, 40, 44, 48, 52, 56, 64, 72, 80, 88, 96, 104, 112
+};
+
+// cos(k * pi / 16), k = 0..8
+static const double idct_cos[9] = {
+	1.0, 0.980785280403230, 0.923879532511287, 0.831469612302545, 0.707106781186548,
+	0.555570233019602, 0.382683432365090, 0.195090322016128, 0.0
+};
+
+struct bitreader
+{
+	const unsigned char* buf;
+	size_t len;
+	size_t pos;		// in bits
+};
+
+struct mvi_decoder
+{
+	struct bitreader br;
+	int mpeg2;
+	int width;
+	int height;
+	int mb_width;
+	int mb_height;
+	int progressive_sequence;
+	int chroma_format;
+	int intra_dc_precision;
+	int picture_structure;
+	int frame_pred_frame_dct;
+	int concealment_motion_vectors;
+	int q_scale_type;
+	int intra_vlc_format;
+	const unsigned char* scan;
+	unsigned char intra_matrix[64];
+	int quantiser_scale;
+	int dc_pred[3];
+	unsigned char* planes[3];
+	int stride[3];
+};
+
+static struct vlc mba_vlc[sizeof(mba_codes) / sizeof(mba_codes[0])];
+static struct vlc dc_luma_vlc[sizeof(dc_luma_codes) / sizeof(dc_luma_codes[0])];
+static struct vlc dc_chroma_vlc[sizeof(dc_chroma_codes) / sizeof(dc_chroma_codes[0])];
+static struct vlc dct_zero_vlc[sizeof(dct_zero_codes) / sizeof(dct_zero_codes[0])];
+static struct vlc dct_one_vlc[sizeof(dct_one_codes) / sizeof(dct_one_codes[0])];
+static double idct_table[8][8];
+static int tables_ready = 0;
+
+static void build_vlc(const struct vlc_code* codes, struct vlc* vlc)
+{
+	const char* c;
+
+	for (; codes->bits != NULL; codes++, vlc++)
+	{
+		vlc->code = 0;
+		vlc->len = 0;
+		for (c = codes->bits; *c; c++)
+		{
+			if (*c == ' ')
+				continue;
+			vlc->code = (vlc->code << 1) | (*c - '0');
+			vlc->len++;
+		}
+		vlc->a = codes->a;
+		vlc->b = codes->b;
+	}
+	vlc->len = 0;
+}
+
+static void init_tables()
+{
+	int u, x, k;
+	double c;
+
+	build_vlc(mba_codes, mba_vlc);
+	build_vlc(dc_luma_codes, dc_luma_vlc);
+	build_vlc(dc_chroma_codes, dc_chroma_vlc);
+	build_vlc(dct_zero_codes, dct_zero_vlc);
+	build_vlc(dct_one_codes, dct_one_vlc);
+
+	// idct_table[u][x] = C(u) / 2 * cos((2x + 1) * u * pi / 16)
+	for (u = 0; u < 8; u++)
+	{
+		for (x = 0; x < 8; x++)
+		{
+			k = ((2 * x + 1) * u) % 32;
+			if (k > 16)
+				k = 32 - k;
+			c = k > 8 ? -idct_cos[16 - k] : idct_cos[k];
+			idct_table[u][x] = (u == 0 ? idct_cos[4] : 1.0) / 2 * c;
+		}
+	}
+	tables_ready = 1;
+}
+
+static unsigned int show_bits(struct bitreader* br, int n)
+{
+	size_t byte = br->pos >> 3;
+	uint32_t val = 0;
+	int i;
+
+	for (i = 0; i < 4; i++)
+		val = (val << 8) | (byte + i < br->len ? br->buf[byte + i] : 0);
+	return (val << (br->pos & 7)) >> (32 - n);
+}
+
+static unsigned int get_bits(struct bitreader* br, int n)
+{
+	unsigned int val = show_bits(br, n);
+
+	br->pos += n;
+	return val;
+}
+
+static int bits_left(struct bitreader* br)
+{
+	return br->pos < br->len * 8;
+}
+
+// Moves to the byte after the next start code prefix 00 00 01. Returns the start code or -1.
+static int next_start_code(struct bitreader* br)
+{
+	size_t i = (br->pos + 7) >> 3;
+
+	for (; i + 3 < br->len; i++)
+	{
+		if (br->buf[i] == 0 && br->buf[i + 1] == 0 && br->buf[i + 2] == 1)
+		{
+			br->pos = (i + 4) * 8;
+			return br->buf[i + 3];
+		}
+	}
+	br->pos = br->len * 8;
+	return -1;
+}
+
+static const struct vlc* get_vlc(struct bitreader* br, const struct vlc* vlc)
+{
+	for (; vlc->len; vlc++)
+	{
+		if (show_bits(br, vlc->len) == vlc->code)
+		{
+			br->pos += vlc->len;
+			return vlc;
+		}
+	}
+	return NULL;
+}
+
+static void load_matrix(struct bitreader* br, unsigned char* matrix)
+{
+	int i;
+
+	// transmitted in zigzag order
+	for (i = 0; i < 64; i++)
+		matrix[zigzag_scan[i]] = get_bits(br, 8);
+}
+
+static int parse_sequence_header(struct mvi_decoder* dec)
+{
+	struct bitreader* br = &dec->br;
+
+	dec->width = get_bits(br, 12);
+	dec->height = get_bits(br, 12);
+	get_bits(br, 4 + 4);		// aspect_ratio_information, frame_rate_code
+	get_bits(br, 18 + 1 + 10 + 1);	// bit_rate_value, marker_bit, vbv_buffer_size_value, constrained_parameters_flag
+	if (get_bits(br, 1))
+		load_matrix(br, dec->intra_matrix);
+	else
+		memcpy(dec->intra_matrix, default_intra_matrix, 64);
+	if (get_bits(br, 1))
+		br->pos += 64 * 8;		// non intra matrix isn't needed
+	return dec->width > 0 && dec->height > 0;
+}
+
+static void parse_extension(struct mvi_decoder* dec)
+{
+	struct bitreader* br = &dec->br;
+
+	switch (get_bits(br, 4))
+	{
+		case 1:	// sequence extension
+			dec->mpeg2 = 1;
+			get_bits(br, 8);	// profile_and_level_indication
+			dec->progressive_sequence = get_bits(br, 1);
+			dec->chroma_format = get_bits(br, 2);
+			dec->width |= get_bits(br, 2) << 12;
+			dec->height |= get_bits(br, 2) << 12;
+			break;
+		case 3:	// quant matrix extension
+			if (get_bits(br, 1))
+				load_matrix(br, dec->intra_matrix);
+			break;
+		case 8:	// picture coding extension
+			get_bits(br, 16);	// f_codes
+			dec->intra_dc_precision = get_bits(br, 2);
+			dec->picture_structure = get_bits(br, 2);
+			get_bits(br, 1);	// top_field_first
+			dec->frame_pred_frame_dct = get_bits(br, 1);
+			dec->concealment_motion_vectors = get_bits(br, 1);
+			dec->q_scale_type = get_bits(br, 1);
+			dec->intra_vlc_format = get_bits(br, 1);
+			dec->scan = get_bits(br, 1) ? alternate_scan : zigzag_scan;
+			break;
+		default:
+			break;
+	}
+}
+
+static void set_quantiser_scale(struct mvi_decoder* dec, int code)
+{
+	if (!dec->mpeg2)
+		dec->quantiser_scale = code;
+	else if (dec->q_scale_type)
+		dec->quantiser_scale = non_linear_quant[code];
+	else
+		dec->quantiser_scale = code * 2;
+}
+
+static void idct_put(int* block, unsigned char* dst, int stride)
+{
+	double tmp[64];
+	double sum;
+	int x, y, u, v;
+	int val;
+
+	// rows
+	for (v = 0; v < 8; v++)
+	{
+		for (x = 0; x < 8; x++)
+		{
+			sum = 0;
+			for (u = 0; u < 8; u++)
+				sum += idct_table[u][x] * block[v * 8 + u];
+			tmp[v * 8 + x] = sum;
+		}
+	}
+	// columns
+	for (x = 0; x < 8; x++)
+	{
+		for (y = 0; y < 8; y++)
+		{
+			sum = 0;
+			for (v = 0; v < 8; v++)
+				sum += idct_table[v][y] * tmp[v * 8 + x];
+			val = (int)(sum < 0 ? sum - 0.5 : sum + 0.5);
+			dst[y * stride + x] = val < 0 ? 0 : (val > 255 ? 255 : val);
+		}
+	}
+}
+
+// Decodes one intra block. comp is 0 for luma, 1 and 2 for chroma.
+static int decode_block(struct mvi_decoder* dec, int comp, unsigned char* dst, int stride)
+{
+	struct bitreader* br = &dec->br;
+	const struct vlc* vlc;
+	const struct vlc* dct_vlc = dec->intra_vlc_format ? dct_one_vlc : dct_zero_vlc;
+	int block[64];
+	int size, diff, run, level, i, pos, sum;
+
+	memset(block, 0, sizeof(block));
+
+	// DC coefficient, coded as difference to the previous block of the same component
+	vlc = get_vlc(br, comp == 0 ? dc_luma_vlc : dc_chroma_vlc);
+	if (vlc == NULL)
+		return 0;
+	size = vlc->a;
+	diff = 0;
+	if (size > 0)
+	{
+		diff = get_bits(br, size);
+		if (!(diff & (1 << (size - 1))))
+			diff -= (1 << size) - 1;
+	}
+	dec->dc_pred[comp] += diff;
+	block[0] = dec->dc_pred[comp] * (8 >> dec->intra_dc_precision);
+	sum = block[0];
+
+	// AC coefficients
+	for (i = 1; ; )
+	{
+		vlc = get_vlc(br, dct_vlc);
+		if (vlc == NULL)
+			return 0;
+		if (vlc->a == VLC_EOB)
+			break;
+		if (vlc->a == VLC_ESCAPE)
+		{
+			run = get_bits(br, 6);
+			if (dec->mpeg2)
+			{
+				level = get_bits(br, 12);
+				if (level & 0x800)
+					level -= 4096;
+			}
+			else
+			{
+				level = get_bits(br, 8);
+				if (level == 0)
+					level = get_bits(br, 8);
+				else if (level == 128)
+					level = (int)get_bits(br, 8) - 256;
+				else if (level > 128)
+					level -= 256;
+			}
+		}
+		else
+		{
+			run = vlc->a;
+			level = get_bits(br, 1) ? -vlc->b : vlc->b;
+		}
+		i += run;
+		if (i > 63 || level == 0)
+			return 0;
+		pos = dec->scan[i];
+		// MPEG-2: 2 * level * W * scale / 32 with the mapped scale, MPEG-1: 2 * level * W * scale / 16
+		level = level * dec->intra_matrix[pos] * dec->quantiser_scale / (dec->mpeg2 ? 16 : 8);
+		if (!dec->mpeg2 && level != 0 && !(level & 1))
+			level -= level > 0 ? 1 : -1;	// oddification of MPEG-1
+		if (level > 2047)
+			level = 2047;
+		else if (level < -2048)
+			level = -2048;
+		block[pos] = level;
+		sum += level;
+		i++;
+		if (!bits_left(br))
+			return 0;
+	}
+	// mismatch control of MPEG-2
+	if (dec->mpeg2 && !(sum & 1))
+		block[63] ^= 1;
+
+	idct_put(block, dst, stride);
+	return 1;
+}
+
+static int decode_macroblock(struct mvi_decoder* dec, int address)
+{
+	struct bitreader* br = &dec->br;
+	int mb_x = address % dec->mb_width;
+	int mb_y = address / dec->mb_width;
+	int field_dct = 0;
+	int quant;
+	int b, x, y;
+
+	if (mb_y >= dec->mb_height)
+		return 0;
+
+	// macroblock_type of I-pictures: 1 intra, 01 intra with quant
+	if (get_bits(br, 1))
+		quant = 0;
+	else if (get_bits(br, 1))
+		quant = 1;
+	else
+		return 0;
+	if (dec->mpeg2 && dec->picture_structure == 3 && !dec->frame_pred_frame_dct)
+		field_dct = get_bits(br, 1);
+	if (quant)
+		set_quantiser_scale(dec, get_bits(br, 5));
+
+	for (b = 0; b < 4; b++)
+	{
+		x = mb_x * 16 + (b & 1) * 8;
+		if (field_dct)
+		{
+			y = mb_y * 16 + (b >> 1);
+			if (!decode_block(dec, 0, dec->planes[0] + y * dec->stride[0] + x, dec->stride[0] * 2))
+				return 0;
+		}
+		else
+		{
+			y = mb_y * 16 + (b >> 1) * 8;
+			if (!decode_block(dec, 0, dec->planes[0] + y * dec->stride[0] + x, dec->stride[0]))
+				return 0;
+		}
+	}
+	for (b = 1; b < 3; b++)
+		if (!decode_block(dec, b, dec->planes[b] + mb_y * 8 * dec->stride[b] + mb_x * 8, dec->stride[b]))
+			return 0;
+	return 1;
+}
+
+static void reset_dc_pred(struct mvi_decoder* dec)
+{
+	dec->dc_pred[0] = dec->dc_pred[1] = dec->dc_pred[2] = 1 << (7 + dec->intra_dc_precision);
+}
+
+static int decode_slice(struct mvi_decoder* dec, int vertical_position)
+{
+	struct bitreader* br = &dec->br;
+	const struct vlc* vlc;
+	int address = (vertical_position - 1) * dec->mb_width - 1;
+	int increment;
+
+	set_quantiser_scale(dec, get_bits(br, 5));
+	if (dec->mpeg2 && get_bits(br, 1))
+	{
+		get_bits(br, 8);	// intra_slice, reserved_bits
+		while (get_bits(br, 1))
+			get_bits(br, 8);
+	}
+	else if (!dec->mpeg2)
+	{
+		while (get_bits(br, 1))
+			get_bits(br, 8);
+	}
+	reset_dc_pred(dec);
+
+	// macroblocks until the next start code
+	while (bits_left(br) && show_bits(br, 23) != 0)
+	{
+		increment = 0;
+		while (1)
+		{
+			vlc = get_vlc(br, mba_vlc);
+			if (vlc == NULL)
+				return 0;
+			if (vlc->a == VLC_ESCAPE)
+				increment += 33;
+			else if (vlc->a != VLC_STUFFING)
+				break;
+		}
+		increment += vlc->a;
+		if (increment > 1 && address >= (vertical_position - 1) * dec->mb_width)
+			reset_dc_pred(dec);
+		address += increment;
+		if (!decode_macroblock(dec, address))
+			return 0;
+	}
+	return 1;
+}
+
+static int alloc_planes(struct mvi_decoder* dec)
+{
+	int i;
+
+	if (dec->width > MVI_MAX_WIDTH || dec->height > MVI_MAX_HEIGHT)
+	{
+		my_printf("Background image %dx%d is too large\n", dec->width, dec->height);
+		return 0;
+	}
+	if (dec->mpeg2 && dec->chroma_format != 1)
+	{
+		my_printf("Background image: only 4:2:0 is supported\n");
+		return 0;
+	}
+	dec->mb_width = (dec->width + 15) / 16;
+	if (dec->mpeg2 && !dec->progressive_sequence)
+		dec->mb_height = 2 * ((dec->height + 31) / 32);
+	else
+		dec->mb_height = (dec->height + 15) / 16;
+	dec->stride[0] = dec->mb_width * 16;
+	dec->stride[1] = dec->stride[2] = dec->mb_width * 8;
+	for (i = 0; i < 3; i++)
+	{
+		dec->planes[i] = calloc(dec->stride[i], dec->mb_height * (i == 0 ? 16 : 8));
+		if (dec->planes[i] == NULL)
+			return 0;
+	}
+	return 1;
+}
+
+// Decodes the first picture of the stream into the planes of dec
+static int decode_picture(struct mvi_decoder* dec)
+{
+	struct bitreader* br = &dec->br;
+	int in_picture = 0;
+	int code;
+
+	while ((code = next_start_code(br)) != -1)
+	{
+		if (code == 0xB3)		// sequence header
+		{
+			if (in_picture || !parse_sequence_header(dec))
+				break;
+		}
+		else if (code == 0xB5)	// extension
+			parse_extension(dec);
+		else if (code == 0x00)	// picture
+		{
+			if (in_picture)
+				break;
+			if (dec->width == 0)
+				return 0;
+			get_bits(br, 10);	// temporal_reference
+			if (get_bits(br, 3) != 1)
+			{
+				my_printf("Background image is no I-frame\n");
+				return 0;
+			}
+			in_picture = 1;
+		}
+		else if (code >= 0x01 && code <= 0xAF && in_picture)	// slice
+		{
+			if (dec->planes[0] == NULL)
+			{
+				if (dec->mpeg2 && (dec->picture_structure != 3 || dec->concealment_motion_vectors))
+				{
+					my_printf("Background image: field pictures and concealment motion vectors are not supported\n");
+					return 0;
+				}
+				if (!alloc_planes(dec))
+					return 0;
+			}
+			if (!decode_slice(dec, code))
+				return 0;
+		}
+		else if (code == 0xB7 && in_picture)	// sequence end
+			break;
+	}
+	return dec->planes[0] != NULL;
+}
+
+static inline int clamp_255(int val)
+{
+	return val < 0 ? 0 : (val > 255 ? 255 : val);
+}
+
+// BT.601 YCbCr of the picture to a BGRA pixel like in the framebuffer
+static uint32_t picture_pixel(struct mvi_decoder* dec, int x, int y)
+{
+	int luma = 298 * (dec->planes[0][y * dec->stride[0] + x] - 16);
+	int cb = dec->planes[1][(y / 2) * dec->stride[1] + x / 2] - 128;
+	int cr = dec->planes[2][(y / 2) * dec->stride[2] + x / 2] - 128;
+	int r = clamp_255((luma + 409 * cr + 128) >> 8);
+	int g = clamp_255((luma - 100 * cb - 208 * cr + 128) >> 8);
+	int b = clamp_255((luma + 516 * cb + 128) >> 8);
+
+	return 0xFF000000 | (r << 16) | (g << 8) | b;
+}
+
+// Scales the picture bilinear to width x height. Returns 1 on success.
+static int scale_picture(struct mvi_decoder* dec, int width, int height, uint32_t* pixels)
+{
+	uint32_t* rgb;
+	uint32_t p00, p01, p10, p11;
+	int x, y, sx, sy, fx, fy, shift, c;
+	int step_x = ((dec->width - 1) << 16) / (width > 1 ? width - 1 : 1);
+	int step_y = ((dec->height - 1) << 16) / (height > 1 ? height - 1 : 1);
+	uint32_t out;
+
+	rgb = malloc((size_t)dec->width * dec->height * sizeof(*rgb));
+	if (rgb == NULL)
+		return 0;
+	for (y = 0; y < dec->height; y++)
+		for (x = 0; x < dec->width; x++)
+			rgb[y * dec->width + x] = picture_pixel(dec, x, y);
+
+	for (y = 0; y < height; y++)
+	{
+		sy = (y * step_y) >> 16;
+		fy = (y * step_y) & 0xFFFF;
+		if (sy >= dec->height - 1)
+		{
+			sy = dec->height > 1 ? dec->height - 2 : 0;
+			fy = dec->height > 1 ? 0xFFFF : 0;
+		}
+		for (x = 0; x < width; x++)
+		{
+			sx = (x * step_x) >> 16;
+			fx = (x * step_x) & 0xFFFF;
+			if (sx >= dec->width - 1)
+			{
+				sx = dec->width > 1 ? dec->width - 2 : 0;
+				fx = dec->width > 1 ? 0xFFFF : 0;
+			}
+			p00 = rgb[sy * dec->width + sx];
+			p01 = rgb[sy * dec->width + sx + (dec->width > 1)];
+			p10 = rgb[(sy + (dec->height > 1)) * dec->width + sx];
+			p11 = rgb[(sy + (dec->height > 1)) * dec->width + sx + (dec->width > 1)];
+			out = 0xFF000000;
+			for (shift = 0; shift < 24; shift += 8)
+			{
+				c = ((((p00 >> shift) & 0xFF) * (0x10000 - fx) + ((p01 >> shift) & 0xFF) * fx) >> 16) * (0x10000 - fy)
+				  + ((((p10 >> shift) & 0xFF) * (0x10000 - fx) + ((p11 >> shift) & 0xFF) * fx) >> 16) * fy;
+				out |= (uint32_t)(c >> 16) << shift;
+			}
+			pixels[y * width + x] = out;
+		}
+	}
+	free(rgb);
+	return 1;
+}
+
+// Decodes the .mvi file and scales it to width x height BGRA pixels. Returns 1 on success.
+int decode_mvi(const char* filename, int width, int height, uint32_t* pixels)
+{
+	struct mvi_decoder dec;
+	struct stat st;
+	unsigned char* buf;
+	ssize_t len;
+	int ret;
+	int fd;
+	int i;
+
+	if (!tables_ready)
+		init_tables();
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	if (fstat(fd, &st) != 0 || st.st_size <= 0 || st.st_size > MVI_MAX_SIZE)
+	{
+		close(fd);
+		return 0;
+	}
+	buf = malloc(st.st_size);
+	if (buf == NULL)
+	{
+		close(fd);
+		return 0;
+	}
+	len = read(fd, buf, st.st_size);
+	close(fd);
+	if (len != st.st_size)
+	{
+		free(buf);
+		return 0;
+	}
+
+	memset(&dec, 0, sizeof(dec));
+	dec.br.buf = buf;
+	dec.br.len = len;
+	dec.picture_structure = 3;
+	dec.scan = zigzag_scan;
+	memcpy(dec.intra_matrix, default_intra_matrix, 64);
+
+	ret = decode_picture(&dec);
+	if (!ret)
+		my_printf("Error decoding background image %s\n", filename);
+	else if (!(ret = scale_picture(&dec, width, height, pixels)))
+		my_printf("Error scaling background image %s: not enough memory\n", filename);
+
+	for (i = 0; i < 3; i++)
+		free(dec.planes[i]);
+	free(buf);
+	return ret;
+}
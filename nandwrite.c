@@ -37,12 +37,22 @@
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <getopt.h>
+#include <syslog.h>
 
 #include <asm/types.h>
 #include "mtd/mtd-user.h"
 #include "common.h"
 #include <libmtd.h>
 
+// progress output of ofgwrite UI
+void progress_begin(const char* name, long long total);
+void progress_update(long long done);
+void progress_end();
+
+// logging of ofgwrite
+extern int log_max_level;
+void my_log(int level, const char *format, ...);
+
 static void display_help(int status)
 {
 	my_printf(
@@ -343,6 +353,7 @@ int nandwrite_main(int argc, char * const argv[])
 			}
 			imglen = st.st_size - inputskip;
 			ofg_imglen = imglen;
+			progress_begin(PROGRAM_NAME, ofg_imglen);
 		} else
 			imglen = inputsize;
 
@@ -410,8 +421,8 @@ int nandwrite_main(int argc, char * const argv[])
 			}
 
 			baderaseblock = false;
-			if (!quiet)
-				my_fprintf(stdout, "Writing data to block %lld at offset 0x%llx\n",
+			if (!quiet && log_max_level >= LOG_DEBUG)
+				my_log(LOG_DEBUG, "Writing data to block %lld at offset 0x%llx\n",
 						 blockstart / ebsize_aligned, blockstart);
 
 			/* Check all the blocks in an erase block for bad blocks */
@@ -490,7 +501,7 @@ int nandwrite_main(int argc, char * const argv[])
 			filebuf_len += readlen - alreadyread;
 			if (ifd != STDIN_FILENO) {
 				imglen -= tinycnt - alreadyread;
-				set_step_progress((int)((long long)(ofg_imglen - imglen) * 100 / (ofg_imglen)));
+				progress_update(ofg_imglen - imglen);
 			} else if (cnt == 0) {
 				/* No more bytes - we are done after writing the remaining bytes */
 				imglen = 0;
@@ -580,6 +591,7 @@ int nandwrite_main(int argc, char * const argv[])
 	}
 
 	failed = false;
+	progress_end();
 
 closeall:
 	close(ifd);
@@ -0,0 +1,441 @@
+#include "ofgwrite.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <glob.h>
+#include <dirent.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/mount.h>
+#include <sys/syscall.h>
+
+// Stages the minimal root filesystem in /newroot which is needed after pivot_root
+// Files are copied in-process like cp -a instead of starting a shell and cp for each glob.
+// In patterns and destinations %L is replaced by lib64 or lib depending on the box.
+
+#define STAGE_REQUIRED 0x01 // error if nothing matches or copying fails
+#define STAGE_OR_NEXT  0x02 // if this entry fails use next entry instead
+#define STAGE_ANDROID  0x04 // only needed for android images
+#define STAGE_FORMAT   0x08 // only needed for formatting rootfs
+#define STAGE_CONFIG   0x10 // box specific config, also needed with newroot image
+
+#define STAGE_BUF_SIZE 65536
+
+struct stage_entry
+{
+	const char* pattern;
+	const char* dest;
+	int flags;
+};
+
+static const struct stage_entry newroot_entries[] = {
+	// we need init and libs to be able to exec init u later
+	{ "/bin/busybox*",         "/bin",        STAGE_REQUIRED },
+	{ "/bin/sh*",              "/bin",        STAGE_REQUIRED },
+	{ "/bin/bash*",            "/bin",        STAGE_REQUIRED },
+	{ "/sbin/init*",           "/sbin",       STAGE_REQUIRED },
+	{ "/%L/libc*",             "/%L",         STAGE_REQUIRED },
+	{ "/%L/ld*",               "/%L",         STAGE_REQUIRED },
+	{ "/%L/libtinfo*",         "/%L",         STAGE_REQUIRED },
+	{ "/%L/libdl*",            "/%L",         STAGE_REQUIRED },
+	{ "/sbin/blkid*",          "/sbin",       STAGE_REQUIRED | STAGE_ANDROID },
+	{ "/%L/libblkid.*",        "/%L",         STAGE_REQUIRED | STAGE_ANDROID },
+	// libcrypt is moved from /lib to /usr/libX in new OE versions
+	{ "/%L/libcrypt*",         "/%L",         STAGE_REQUIRED | STAGE_OR_NEXT },
+	{ "/usr/%L/libcrypt*",     "/usr/%L",     STAGE_REQUIRED },
+	// automount, autofs is maybe not installed
+	{ "/usr/sbin/autom*",      "/bin",        0 },
+	{ "/etc/auto*",            "/etc",        STAGE_CONFIG },
+	{ "/%L/libpthread*",       "/%L",         0 },
+	{ "/%L/libnss*",           "/%L",         0 },
+	{ "/%L/libnsl*",           "/%L",         0 },
+	{ "/%L/libresolv*",        "/%L",         0 },
+	{ "/%L/librt*",            "/%L",         0 },
+	{ "/usr/%L/libtirp*",      "/usr/%L",     0 },
+	{ "/usr/%L/autofs/*",      "/usr/%L/autofs", 0 },
+	{ "/etc/nsswitch*",        "/etc",        STAGE_CONFIG },
+	{ "/etc/resolv*",          "/etc",        STAGE_CONFIG },
+	// mkfs for formatting rootfs, if not installed rootfs is deleted
+	{ "/sbin/mkfs.ext*",       "/sbin",       STAGE_FORMAT },
+	{ "/sbin/mke2fs*",         "/sbin",       STAGE_FORMAT },
+	{ "/etc/mke2fs.conf",      "/etc",        STAGE_FORMAT | STAGE_CONFIG },
+	{ "/%L/libext2fs*",        "/%L",         STAGE_FORMAT },
+	{ "/%L/libcom_err*",       "/%L",         STAGE_FORMAT },
+	{ "/%L/libe2p*",           "/%L",         STAGE_FORMAT },
+	{ "/%L/libuuid*",          "/%L",         STAGE_FORMAT },
+	{ "/%L/libblkid*",         "/%L",         STAGE_FORMAT },
+	{ "/usr/%L/libext2fs*",    "/usr/%L",     STAGE_FORMAT },
+	{ "/usr/%L/libcom_err*",   "/usr/%L",     STAGE_FORMAT },
+	{ "/usr/%L/libe2p*",       "/usr/%L",     STAGE_FORMAT },
+};
+#define NEWROOT_ENTRIES (int)(sizeof(newroot_entries) / sizeof(newroot_entries[0]))
+
+struct stage_stats
+{
+	unsigned long files;
+	unsigned long long bytes;
+};
+
+static void expand_lib(const char* in, char* out, size_t size, const char* lib)
+{
+	size_t pos = 0;
+
+	while (*in && pos + 1 < size)
+	{
+		if (in[0] == '%' && in[1] == 'L')
+		{
+			pos += snprintf(&out[pos], size - pos, "%s", lib);
+			if (pos >= size)
+				pos = size - 1;
+			in += 2;
+		}
+		else
+			out[pos++] = *in++;
+	}
+	out[pos] = '\0';
+}
+
+// Creates directory with all parents like mkdir -p
+int mkdir_p(const char* path, mode_t mode)
+{
+	char tmp[PATH_MAX];
+	char* p;
+
+	snprintf(tmp, sizeof(tmp), "%s", path);
+	for (p = tmp + 1; *p; p++)
+	{
+		if (*p != '/')
+			continue;
+		*p = '\0';
+		if (mkdir(tmp, mode) != 0 && errno != EEXIST)
+			return 0;
+		*p = '/';
+	}
+	if (mkdir(tmp, mode) != 0 && errno != EEXIST)
+		return 0;
+	return 1;
+}
+
+static ssize_t copy_range(int in_fd, int out_fd, size_t len)
+{
+#ifdef __NR_copy_file_range
+	return syscall(__NR_copy_file_range, in_fd, NULL, out_fd, NULL, len, 0);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+static int copy_data(int in_fd, int out_fd, off_t size)
+{
+	static int copy_range_failed = 0;
+	char buf[STAGE_BUF_SIZE];
+	ssize_t len;
+	off_t done = 0;
+
+	// copy in kernel if possible, tmpfs and the old rootfs are different filesystems so this needs a recent kernel
+	while (!copy_range_failed && done < size)
+	{
+		len = copy_range(in_fd, out_fd, size - done);
+		if (len <= 0)
+		{
+			if (len < 0 && done == 0 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP))
+			{
+				copy_range_failed = 1;
+				break;
+			}
+			if (len < 0)
+				return 0;
+			break;
+		}
+		done += len;
+	}
+	if (done >= size && size > 0)
+		return 1;
+
+	while ((len = read(in_fd, buf, sizeof(buf))) > 0)
+	{
+		char* p = buf;
+		while (len > 0)
+		{
+			ssize_t written = write(out_fd, p, len);
+			if (written <= 0)
+				return 0;
+			p += written;
+			len -= written;
+		}
+	}
+	return len == 0;
+}
+
+static int stage_copy(const char* src, const char* dst, struct stage_stats* stats);
+
+static int stage_copy_dir(const char* src, const char* dst, struct stat* st, struct stage_stats* stats)
+{
+	char src_path[PATH_MAX];
+	char dst_path[PATH_MAX];
+	struct dirent* entry;
+	DIR* dir;
+	int ret = 1;
+
+	if (mkdir(dst, st->st_mode & 07777) != 0 && errno != EEXIST)
+		return 0;
+
+	dir = opendir(src);
+	if (dir == NULL)
+		return 0;
+	while ((entry = readdir(dir)) != NULL)
+	{
+		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+			continue;
+		snprintf(src_path, sizeof(src_path), "%s/%s", src, entry->d_name);
+		snprintf(dst_path, sizeof(dst_path), "%s/%s", dst, entry->d_name);
+		if (!stage_copy(src_path, dst_path, stats))
+			ret = 0;
+	}
+	closedir(dir);
+	chmod(dst, st->st_mode & 07777);
+	return ret;
+}
+
+static int stage_copy_file(const char* src, const char* dst, struct stat* st, struct stage_stats* stats)
+{
+	struct timespec times[2];
+	int in_fd, out_fd;
+	int ret, ret2;
+
+	in_fd = open(src, O_RDONLY | O_CLOEXEC);
+	if (in_fd < 0)
+		return 0;
+	unlink(dst);
+	out_fd = open(dst, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, st->st_mode & 07777);
+	if (out_fd < 0)
+	{
+		close(in_fd);
+		return 0;
+	}
+
+	ret = copy_data(in_fd, out_fd, st->st_size);
+
+	// keep owner, mode and times like cp -a
+	ret2 = fchown(out_fd, st->st_uid, st->st_gid); // errors are ignored like cp -a does
+	fchmod(out_fd, st->st_mode & 07777);
+	times[0] = st->st_atim;
+	times[1] = st->st_mtim;
+	futimens(out_fd, times);
+
+	close(in_fd);
+	if (close(out_fd) != 0)
+		ret = 0;
+	if (ret)
+	{
+		stats->files++;
+		stats->bytes += st->st_size;
+	}
+	return ret;
+}
+
+static int stage_copy(const char* src, const char* dst, struct stage_stats* stats)
+{
+	char target[PATH_MAX];
+	struct stat st;
+	ssize_t len;
+
+	if (lstat(src, &st) != 0)
+		return 0;
+
+	if (S_ISLNK(st.st_mode))
+	{
+		len = readlink(src, target, sizeof(target) - 1);
+		if (len < 0)
+			return 0;
+		target[len] = '\0';
+		unlink(dst);
+		if (symlink(target, dst) != 0)
+			return 0;
+		stats->files++;
+		return 1;
+	}
+	if (S_ISDIR(st.st_mode))
+		return stage_copy_dir(src, dst, &st, stats);
+	if (S_ISREG(st.st_mode))
+		return stage_copy_file(src, dst, &st, stats);
+
+	// device nodes, fifos etc. are not needed
+	return 1;
+}
+
+static int stage_entry(const struct stage_entry* entry, const char* lib, const char* newroot, struct stage_stats* stats)
+{
+	char pattern[PATH_MAX];
+	char dest[PATH_MAX];
+	char dest_dir[PATH_MAX];
+	char dst_path[PATH_MAX];
+	const char* name;
+	glob_t matches;
+	size_t i;
+	int ret = 1;
+
+	expand_lib(entry->pattern, pattern, sizeof(pattern), lib);
+	expand_lib(entry->dest, dest, sizeof(dest), lib);
+	snprintf(dest_dir, sizeof(dest_dir), "%s%s", newroot, dest);
+
+	if (glob(pattern, 0, NULL, &matches) != 0)
+		return 0;
+
+	for (i = 0; i < matches.gl_pathc; i++)
+	{
+		name = strrchr(matches.gl_pathv[i], '/');
+		name = name ? name + 1 : matches.gl_pathv[i];
+		snprintf(dst_path, sizeof(dst_path), "%s/%s", dest_dir, name);
+		if (!stage_copy(matches.gl_pathv[i], dst_path, stats))
+		{
+			my_printf("Error copying %s to %s\n", matches.gl_pathv[i], dest_dir);
+			ret = 0;
+		}
+	}
+	globfree(&matches);
+	return ret;
+}
+
+// Copies binaries, libs and config needed in the new root. Returns 0 if a required file couldn't be copied.
+// With config_only just the box specific config is copied, binaries and libs are provided by the newroot image.
+int stage_newroot(const char* newroot, int multilib, int config_only, int quiet)
+{
+	const char* lib = multilib ? "lib64" : "lib";
+	struct stage_stats stats;
+	struct timespec start, end;
+	int ret = 1;
+	int i;
+
+	memset(&stats, 0, sizeof(stats));
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (i = 0; i < NEWROOT_ENTRIES; i++)
+	{
+		const struct stage_entry* entry = &newroot_entries[i];
+
+		if ((entry->flags & STAGE_ANDROID) && !android)
+			continue;
+		if ((entry->flags & STAGE_FORMAT) && !format_rootfs)
+			continue;
+		if (config_only && !(entry->flags & STAGE_CONFIG))
+			continue;
+
+		if (stage_entry(entry, lib, newroot, &stats))
+		{
+			// alternative is not needed
+			while ((entry->flags & STAGE_OR_NEXT) && i + 1 < NEWROOT_ENTRIES)
+				entry = &newroot_entries[++i];
+			continue;
+		}
+		if (entry->flags & STAGE_OR_NEXT)
+			continue;
+		if (entry->flags & STAGE_REQUIRED)
+		{
+			my_printf("Error staging %s\n", entry->pattern);
+			ret = 0;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (!quiet)
+		my_printf("Prepared %s: %lu files, %llu bytes in %ld ms\n", newroot, stats.files, stats.bytes,
+			elapsed_ms(&start, &end));
+	return ret;
+}
+
+// Directories of the newroot image which are bind mounted into the new root
+static const char* newroot_image_dirs[] = { "bin", "sbin", "lib", "lib64", "usr" };
+#define NEWROOT_IMAGE_DIRS (int)(sizeof(newroot_image_dirs) / sizeof(newroot_image_dirs[0]))
+
+static void umount_newroot_image(const char* newroot, const char* image_mount)
+{
+	char path[PATH_MAX];
+	int i;
+
+	// directories which are not bind mounted just fail
+	for (i = NEWROOT_IMAGE_DIRS - 1; i >= 0; i--)
+	{
+		snprintf(path, sizeof(path), "%s/%s", newroot, newroot_image_dirs[i]);
+		umount2(path, MNT_DETACH);
+	}
+	umount2(image_mount, MNT_DETACH);
+}
+
+// Provides binaries and libs of the new root from a prebuilt squashfs image instead of copying them.
+// The image has to be built together with the box image, because init u needs the same init version.
+// It is copied into the tmpfs first, as the old rootfs is deleted or formatted while it is still mounted.
+// Returns 0 if the image is not available or can't be mounted. Then staging is used.
+int mount_newroot_image(const char* image, const char* newroot, int quiet)
+{
+	char image_copy[PATH_MAX];
+	char image_mount[PATH_MAX];
+	char src[PATH_MAX];
+	char dst[PATH_MAX];
+	struct stage_stats stats;
+	struct timespec start, end;
+	struct stat st;
+	int i;
+
+	if (stat(image, &st) != 0 || !S_ISREG(st.st_mode))
+	{
+		my_printf("Newroot image %s not found. Copying binaries and libs instead\n", image);
+		return 0;
+	}
+
+	memset(&stats, 0, sizeof(stats));
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	snprintf(image_copy, sizeof(image_copy), "%s/.newroot.img", newroot);
+	snprintf(image_mount, sizeof(image_mount), "%s/.newroot_image", newroot);
+	if (!stage_copy_file(image, image_copy, &st, &stats))
+	{
+		my_printf("Error copying newroot image %s\n", image);
+		unlink(image_copy);
+		return 0;
+	}
+
+	if (!setup_loop_device(image_copy, quiet))
+	{
+		unlink(image_copy);
+		return 0;
+	}
+	mkdir(image_mount, 0755);
+	if (mount(ubi_loop_device, image_mount, "squashfs", MS_RDONLY, NULL) != 0)
+	{
+		my_printf("Error mounting newroot image %s: %s\n", image, strerror(errno));
+		release_loop_device(quiet);
+		rmdir(image_mount);
+		unlink(image_copy);
+		return 0;
+	}
+
+	for (i = 0; i < NEWROOT_IMAGE_DIRS; i++)
+	{
+		snprintf(src, sizeof(src), "%s/%s", image_mount, newroot_image_dirs[i]);
+		snprintf(dst, sizeof(dst), "%s/%s", newroot, newroot_image_dirs[i]);
+		if (stat(src, &st) != 0)
+			continue; // not in image, e.g. lib64 on 32 bit box
+		if (!mkdir_p(dst, 0755) || mount(src, dst, NULL, MS_BIND | MS_REC, NULL) != 0)
+		{
+			my_printf("Error bind mounting %s: %s\n", dst, strerror(errno));
+			umount_newroot_image(newroot, image_mount);
+			release_loop_device(quiet);
+			rmdir(image_mount);
+			unlink(image_copy);
+			return 0;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (!quiet)
+		my_printf("Mounted newroot image %s (%llu bytes) in %ld ms\n", image, stats.bytes,
+			elapsed_ms(&start, &end));
+	return 1;
+}
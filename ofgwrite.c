@@ -14,6 +14,7 @@
 #include <mntent.h>
 #include <unistd.h>
 #include <errno.h>
+#include <time.h>
 #include <openssl/evp.h>
 
 #include "busybox/include/libbb.h"
@@ -37,6 +38,9 @@ typedef struct boot_img_hdr boot_img_hdr;
 #define BOOT_ARGS_SIZE 512
 #define BOOT_EXTRA_ARGS_SIZE 1024
 
+// minimal time to retry the umount of /oldroot after the processes were killed
+#define UMOUNT_RETRY_MIN_MS 1000
+
 struct boot_img_hdr
 {
     uint8_t magic[BOOT_MAGIC_SIZE];
@@ -95,6 +99,10 @@ int flash_kernel  = 0;
 int flash_rootfs  = 0;
 int no_write      = 0;
 int force_e2_stop = 0;
+int format_rootfs = 0;
+int trim_rootfs = 0;
+char newroot_image[1000];
+char report_dir[1000];
 int quiet         = 0;
 int show_help     = 0;
 int newroot_mounted = 0;
@@ -114,6 +122,7 @@ const char ofgwrite_version[] = "4.8.0";
 struct struct_mountlist
 {
 	char* dir;
+	int lazy;		// network and fuse mounts can hang on umount, they are only detached
 	struct struct_mountlist *next;
 } *mountlist, *mountlist_entry;
 
@@ -345,34 +354,6 @@ fail:
     return EXIT_FAILURE;;
 }
 
-void my_printf(char const *fmt, ...)
-{
-	va_list ap, ap2;
-	va_start(ap, fmt);
-	va_copy(ap2, ap);
-	// print to console
-	vprintf(fmt, ap);
-	va_end(ap);
-
-	// print to syslog
-	vsyslog(LOG_INFO, fmt, ap2);
-	va_end(ap2);
-}
-
-void my_fprintf(FILE * f, char const *fmt, ...)
-{
-	va_list ap, ap2;
-	va_start(ap, fmt);
-	va_copy(ap2, ap);
-	// print to file (normally stdout or stderr)
-	vfprintf(f, fmt, ap);
-	va_end(ap);
-
-	// print to syslog
-	vsyslog(LOG_INFO, fmt, ap2);
-	va_end(ap2);
-}
-
 void printUsage()
 {
 	my_printf("Usage: ofgwrite <parameter> <image_directory>\n");
@@ -390,6 +371,15 @@ void printUsage()
 	my_printf("   -mx --multi=x          flash multiboot partition x (x= 1, 2, 3,...). Only supported by some boxes.\n");
 	my_printf("   -n --nowrite           show only found image and mtd partitions (no write)\n");
 	my_printf("   -f --force             force kill e2\n");
+	my_printf("   -F --format            format rootfs partition instead of deleting all files (ext4 only,\n");
+	my_printf("                          runs mkfs.ext4 of the box, deletes all files if it's missing)\n");
+	my_printf("   -t --trim              trim unused blocks of rootfs filesystem after deleting old rootfs\n");
+	my_printf("   -N --newroot-image[=<file>] use prebuilt squashfs for binaries and libs after pivot_root (default %s)\n", NEWROOT_IMAGE_DEFAULT);
+	my_printf("   -S --sync=<policy>     write-back policy for rootfs extraction: legacy (default), syncfs or stream\n");
+	my_printf("   -W --sync-chunk=<MB>   wait for write-back every <MB> MB with sync policy stream (default 8)\n");
+	my_printf("   -R --report=<dir>      write phase timing report to <dir> (default image directory)\n");
+	my_printf("   -l --log-file=<file>   write log additionally to <file>\n");
+	my_printf("   -L --log-level=<console>[,<syslog>[,<file>]] log levels err, warning, notice, info or debug (default info,info,debug)\n");
 	my_printf("   -q --quiet             show less output\n");
 	my_printf("   -h --help              show help\n");
 }
@@ -429,8 +419,8 @@ char* ReadProcEntry(char *filename)
 
 int find_image_files(char* p)
 {
-	DIR *d;
-	struct dirent *entry;
+	struct image_manifest manifest;
+	const struct image_file* file;
 	char path[4097];
 
 	if (realpath(p, path) == NULL)
@@ -451,70 +441,42 @@ int find_image_files(char* p)
 		path[strlen(path)] = '/';
 	}
 
-	d = opendir(path);
-
-	if (!d)
+	if (!build_image_manifest(path, &manifest))
 	{
 		perror("Error reading image_directory");
 		my_printf("\n");
 		return 0;
 	}
+	// the image directory is on a persistent device and available after pivot_root
+	if (report_dir[0] == '\0')
+		strcpy(report_dir, path);
 
-	do
+	file = select_kernel_image(&manifest);
+	if (file)
 	{
-		entry = readdir(d);
-		if (entry)
-		{
-			if ((strstr(entry->d_name, "kernel") != NULL
-			  && strstr(entry->d_name, ".bin")   != NULL)			// ET-xx00, XP1000, VU boxes, DAGS boxes
-			 || strcmp(entry->d_name, "uImage") == 0)				// Spark boxes
-			{
-				strcpy(kernel_filename, path);
-				strcpy(&kernel_filename[strlen(path)], entry->d_name);
-				stat(kernel_filename, &kernel_file_stat);
-				my_printf("Found kernel file: %s\n", kernel_filename);
-			}
-			if (strcmp(entry->d_name, "rootfs.bin") == 0			// ET-xx00, XP1000
-			 || strcmp(entry->d_name, "root_cfe_auto.bin") == 0		// Solo2
-			 || strcmp(entry->d_name, "root_cfe_auto.jffs2") == 0	// other VU boxes
-			 || strcmp(entry->d_name, "oe_rootfs.bin") == 0			// DAGS boxes
-			 || strcmp(entry->d_name, "e2jffs2.img") == 0			// Spark boxes
-			 || strcmp(entry->d_name, "rootfs.tar.bz2") == 0		// solo4k
-			 || strcmp(entry->d_name, "rootfs.ubi") == 0			// Zgemma H9
-			 || strcmp(entry->d_name, "rootfs.tar.xz") == 0		// dream
-			 || strcmp(entry->d_name, "rootfs-one.tar.bz2") == 0		// dreamone
-			 || strcmp(entry->d_name, "rootfs-two.tar.bz2") == 0)		// dreamtwo
-			{
-				strcpy(rootfs_filename, path);
-				strcpy(&rootfs_filename[strlen(path)], entry->d_name);
-				stat(rootfs_filename, &rootfs_file_stat);
-				my_printf("Found rootfs file: %s\n", rootfs_filename);
-				if (strstr(entry->d_name, ".tar.") != NULL)
-					image_type = TAR_BASED;
-				else
-					image_type = UBI;
-			}
-			if (strcmp(&entry->d_name[strlen(entry->d_name)-4], ".nfi") == 0) // dream nfi
-			{
-				strcpy(nfi_filename, path);
-				strcat(nfi_filename, entry->d_name);
-				stat(nfi_filename, &rootfs_file_stat);
-				my_printf("Found nfi file: %s\n", nfi_filename);
-				strcpy(nfi_path, path);
-				image_type = UBI;
-			}
-			if (strcmp(&entry->d_name[strlen(entry->d_name)-7], ".tar.xz") == 0) // dream dm520
-			{
-				strcpy(rootfs_filename, path);
-				strcat(rootfs_filename, entry->d_name);
-				stat(rootfs_filename, &rootfs_file_stat);
-				my_printf("Found tar.xz rootfs file: %s\n", rootfs_filename);
-				image_type = TAR_UBI;
-			}
-		}
-	} while (entry);
+		snprintf(kernel_filename, sizeof(kernel_filename), "%s%s", path, file->name);
+		kernel_file_stat = file->st;
+		my_printf("Found kernel file: %s\n", kernel_filename);
+	}
+	file = select_rootfs_image(&manifest);
+	if (file)
+	{
+		snprintf(rootfs_filename, sizeof(rootfs_filename), "%s%s", path, file->name);
+		rootfs_file_stat = file->st;
+		image_type = rootfs_image_type(file);
+		my_printf("Found %s rootfs file: %s\n", image_magic_name(file->magic), rootfs_filename);
+	}
+	file = select_nfi_image(&manifest); // dream nfi, used instead of the rootfs file
+	if (file)
+	{
+		snprintf(nfi_filename, sizeof(nfi_filename), "%s%s", path, file->name);
+		strcpy(nfi_path, path);
+		rootfs_file_stat = file->st;
+		image_type = UBI;
+		my_printf("Found nfi file: %s\n", nfi_filename);
+	}
 
-	closedir(d);
+	free_image_manifest(&manifest);
 
 	return 1;
 }
@@ -525,7 +487,7 @@ int read_args(int argc, char *argv[])
 	int opt;
 	char *endptr;
 	long val;
-	static const char *short_options = "ac::k::r::ns:m:fqh";
+	static const char *short_options = "ac::k::r::ns:m:fFtN::S:W:R:l:L:qh";
 	static const struct option long_options[] = {
 												{"android"      , no_argument, NULL, 'a'},
 												{"currentslot"  , optional_argument, NULL, 'c'},
@@ -535,6 +497,14 @@ int read_args(int argc, char *argv[])
 												{"slotname"     , required_argument, NULL, 's'},
 												{"multi"        , required_argument, NULL, 'm'},
 												{"force"        , no_argument      , NULL, 'f'},
+												{"format"       , no_argument      , NULL, 'F'},
+												{"trim"         , no_argument      , NULL, 't'},
+												{"newroot-image", optional_argument, NULL, 'N'},
+												{"sync"         , required_argument, NULL, 'S'},
+												{"sync-chunk"   , required_argument, NULL, 'W'},
+												{"report"       , required_argument, NULL, 'R'},
+												{"log-file"     , required_argument, NULL, 'l'},
+												{"log-level"    , required_argument, NULL, 'L'},
 												{"quiet"        , no_argument      , NULL, 'q'},
 												{"help"         , no_argument      , NULL, 'h'},
 												{NULL           , no_argument      , NULL,  0} };
@@ -629,6 +599,55 @@ int read_args(int argc, char *argv[])
 			case 'f':
 				force_e2_stop = 1;
 				break;
+			case 'F':
+				format_rootfs = 1;
+				break;
+			case 't':
+				trim_rootfs = 1;
+				break;
+			case 'N':
+				if (optarg)
+					strcpy(newroot_image, optarg);
+				else
+					strcpy(newroot_image, NEWROOT_IMAGE_DEFAULT);
+				break;
+			case 'S':
+				if (!set_sync_policy(optarg))
+				{
+					my_printf("Error: Unknown sync policy %s!\n", optarg);
+					show_help = 1;
+					return 0;
+				}
+				break;
+			case 'W':
+				errno = 0;
+				val = strtol(optarg, &endptr, 10);
+				if (errno != 0 || endptr == optarg || val <= 0)
+				{
+					my_printf("Error: Wrong sync chunk value. Only positive numeric values are allowed!\n");
+					show_help = 1;
+					return 0;
+				}
+				sync_chunk_mb = val;
+				break;
+			case 'R':
+				strncpy(report_dir, optarg, sizeof(report_dir) - 1);
+				break;
+			case 'l':
+				if (!open_log_file(optarg))
+				{
+					show_help = 1;
+					return 0;
+				}
+				break;
+			case 'L':
+				if (!set_log_levels(optarg))
+				{
+					my_printf("Error: Wrong log level %s!\n", optarg);
+					show_help = 1;
+					return 0;
+				}
+				break;
 			case 'q':
 				quiet = 1;
 				break;
@@ -652,6 +671,7 @@ int read_args(int argc, char *argv[])
 	}
 	else if (optind + 1 == argc)
 	{
+		phase_begin(PHASE_FIND_IMAGES);
 		if (!find_image_files(argv[optind]))
 			return 0;
 
@@ -674,194 +694,153 @@ int read_args(int argc, char *argv[])
 
 int read_mtd_file()
 {
-	FILE* f;
-
-	f = fopen("/proc/mtd", "r");
-	if (f == NULL)
-	{ 
-		perror("Error while opening /proc/mtd");
-		// for testing try to open local mtd file
-		f = fopen("./mtd", "r");
-		if (f == NULL)
-			return 0;
-	}
-
-	char line [1000];
 	char dev  [1000];
 	char size [1000];
 	char esize[1000];
 	char name [1000];
 	char dev_path[] = "/dev/";
-	int line_nr = 0;
+	int i;
 	unsigned long devsize;
 	int wrong_user_mtd = 0;
+	int rule_flags;
+
+	if (!mtd_index_valid)
+		return 0;
 
 	my_printf("Found /proc/mtd entries:\n");
 	my_printf("Device:   Size:     Erasesize:  Name:                   Image:\n");
-	while (fgets(line, 1000, f) != NULL)
-	{
-		line_nr++;
-		if (line_nr == 1) // check header
-		{
-			sscanf(line, "%s%s%s%s", dev, size, esize, name);
-			if (strcmp(dev  , "dev:") != 0
-			 || strcmp(size , "size") != 0
-			 || strcmp(esize, "erasesize") != 0
-			 || strcmp(name , "name") != 0)
-			{
-				my_printf("Error: /proc/mtd has an invalid format\n");
-				fclose(f);
-				return 0;
-			}
-		}
-		else
+	for (i = 0; i < mtd_part_count; i++)
+	{
+		strcpy(dev, mtd_parts[i].dev);
+		strcpy(size, mtd_parts[i].size_str);
+		strcpy(esize, mtd_parts[i].erasesize_str);
+		strcpy(name, mtd_parts[i].name);
+		my_printf("%s: %12s %9s    %-18s", dev, size, esize, name);
+		devsize = strtoul(size, 0, 16);
+		// user selected kernel
+		if (user_kernel && !strcmp(dev, kernel_device_arg))
 		{
-			sscanf(line, "%s%s%s%s", dev, size, esize, name);
-			my_printf("%s %12s %9s    %-18s", dev, size, esize, name);
-			devsize = strtoul(size, 0, 16);
-			if (dev[strlen(dev)-1] == ':') // cut ':'
-				dev[strlen(dev)-1] = '\0';
-			// user selected kernel
-			if (user_kernel && !strcmp(dev, kernel_device_arg))
+			strcpy(&kernel_device[0], dev_path);
+			strcpy(&kernel_device[5], kernel_device_arg);
+			if (kernel_file_stat.st_size <= devsize)
 			{
-				strcpy(&kernel_device[0], dev_path);
-				strcpy(&kernel_device[5], kernel_device_arg);
-				if (kernel_file_stat.st_size <= devsize)
+				if (match_part_name(PART_SRC_MTD_USER, PART_KERNEL, name))
 				{
-					if ((strcmp(name, "\"kernel\"") == 0
-						|| strcmp(name, "\"nkernel\"") == 0
-						|| strcmp(name, "\"kernel2\"") == 0
-						|| strcmp(name, "\"boot\"") == 0))
-					{
-						if (kernel_filename[0] != '\0')
-							my_printf("  ->  %s <- User selected!!\n", kernel_filename);
-						else
-							my_printf("  <-  User selected!!\n");
-						found_kernel_device = 1;
-						kernel_flash_mode = MTD;
-					}
+					if (kernel_filename[0] != '\0')
+						my_printf("  ->  %s <- User selected!!\n", kernel_filename);
 					else
-					{
-						my_printf("  <-  Error: Selected by user is not a kernel mtd!!\n");
-						wrong_user_mtd = 1;
-					}
+						my_printf("  <-  User selected!!\n");
+					found_kernel_device = 1;
+					kernel_flash_mode = MTD;
 				}
 				else
 				{
-					my_printf("  <-  Error: Kernel file is bigger than device size!!\n");
+					my_printf("  <-  Error: Selected by user is not a kernel mtd!!\n");
 					wrong_user_mtd = 1;
 				}
 			}
-			// user selected rootfs
-			else if (user_rootfs && !strcmp(dev, rootfs_device_arg))
+			else
 			{
-				strcpy(&rootfs_device[0], dev_path);
-				strcpy(&rootfs_device[5], rootfs_device_arg);
-				if (rootfs_file_stat.st_size <= devsize
-					&& strcmp(esize, "0001f000") != 0)
+				my_printf("  <-  Error: Kernel file is bigger than device size!!\n");
+				wrong_user_mtd = 1;
+			}
+		}
+		// user selected rootfs
+		else if (user_rootfs && !strcmp(dev, rootfs_device_arg))
+		{
+			strcpy(&rootfs_device[0], dev_path);
+			strcpy(&rootfs_device[5], rootfs_device_arg);
+			if (rootfs_file_stat.st_size <= devsize
+				&& strcmp(esize, "0001f000") != 0)
+			{
+				if (match_part_name(PART_SRC_MTD_USER, PART_ROOTFS, name))
 				{
-					if ((strcmp(name, "\"rootfs\"") == 0
-						|| strcmp(name, "\"rootfs2\"") == 0
-						|| strcmp(name, "\"dreambox-rootfs\"") == 0))
-					{
-						if (rootfs_filename[0] != '\0')
-							my_printf("  ->  %s <- User selected!!\n", rootfs_filename);
-						else
-							my_printf("  <-  User selected!!\n");
-						found_rootfs_device = 1;
-						rootfs_flash_mode = MTD;
-					}
+					if (rootfs_filename[0] != '\0')
+						my_printf("  ->  %s <- User selected!!\n", rootfs_filename);
 					else
-					{
-						my_printf("  <-  Error: Selected by user is not a rootfs mtd!!\n");
-						wrong_user_mtd = 1;
-					}
-				}
-				else if (strcmp(esize, "0001f000") == 0)
-				{
-					my_printf("  <-  Error: Invalid erasesize\n");
-					wrong_user_mtd = 1;
+						my_printf("  <-  User selected!!\n");
+					found_rootfs_device = 1;
+					rootfs_flash_mode = MTD;
 				}
 				else
 				{
-					my_printf("  <-  Error: Rootfs file is bigger than device size!!\n");
+					my_printf("  <-  Error: Selected by user is not a rootfs mtd!!\n");
 					wrong_user_mtd = 1;
 				}
 			}
-			// auto kernel
-			else if (!user_kernel
-					&& (strcmp(name, "\"kernel\"") == 0
-						|| strcmp(name, "\"nkernel\"") == 0
-						|| (strcmp(name, "\"boot\"") == 0 && multiboot_partition == -1)
-						|| (strcmp(name, "\"linuxkernel1\"") == 0 && multiboot_partition == 1)
-						|| (strcmp(name, "\"linuxkernel2\"") == 0 && multiboot_partition == 2)))
+			else if (strcmp(esize, "0001f000") == 0)
 			{
-				if (found_kernel_device)
-				{
-					my_printf("\n");
-					continue;
-				}
-				strcpy(&kernel_device[0], dev_path);
-				strcpy(&kernel_device[5], dev);
-				if (kernel_file_stat.st_size <= devsize)
-				{
-					if (kernel_filename[0] != '\0')
-						my_printf("  ->  %s\n", kernel_filename);
-					else
-						my_printf("\n");
-					found_kernel_device = 1;
-					kernel_flash_mode = MTD;
-				}
+				my_printf("  <-  Error: Invalid erasesize\n");
+				wrong_user_mtd = 1;
+			}
+			else
+			{
+				my_printf("  <-  Error: Rootfs file is bigger than device size!!\n");
+				wrong_user_mtd = 1;
+			}
+		}
+		// auto kernel
+		else if (!user_kernel && match_part_name(PART_SRC_MTD, PART_KERNEL, name))
+		{
+			if (found_kernel_device)
+			{
+				my_printf("\n");
+				continue;
+			}
+			strcpy(&kernel_device[0], dev_path);
+			strcpy(&kernel_device[5], dev);
+			if (kernel_file_stat.st_size <= devsize)
+			{
+				if (kernel_filename[0] != '\0')
+					my_printf("  ->  %s\n", kernel_filename);
 				else
-					my_printf("  <-  Error: Kernel file is bigger than device size!!\n");
+					my_printf("\n");
+				found_kernel_device = 1;
+				kernel_flash_mode = MTD;
 			}
-			// auto rootfs
-			else if (!user_rootfs 
-					&& (strcmp(name, "\"rootfs\"") == 0
-						|| strcmp(name, "\"dreambox-rootfs\"") == 0
-						|| strcmp(name, "\"root\"") == 0
-						|| (strcmp(name, "\"userdata\"") == 0 && multiboot_partition != -1)))
+			else
+				my_printf("  <-  Error: Kernel file is bigger than device size!!\n");
+		}
+		// auto rootfs
+		else if (!user_rootfs && (rule_flags = match_part_name(PART_SRC_MTD, PART_ROOTFS, name)))
+		{
+			if (found_rootfs_device)
 			{
-				if (found_rootfs_device)
-				{
+				my_printf("\n");
+				continue;
+			}
+			strcpy(&rootfs_device[0], dev_path);
+			strcpy(&rootfs_device[5], dev);
+			unsigned long devsize;
+			devsize = strtoul(size, 0, 16);
+			if (rootfs_file_stat.st_size <= devsize
+				&& strcmp(esize, "0001f000") != 0)
+			{
+				if (rootfs_filename[0] != '\0')
+					my_printf("  ->  %s\n", rootfs_filename);
+				else
 					my_printf("\n");
-					continue;
-				}
-				strcpy(&rootfs_device[0], dev_path);
-				strcpy(&rootfs_device[5], dev);
-				unsigned long devsize;
-				devsize = strtoul(size, 0, 16);
-				if (rootfs_file_stat.st_size <= devsize
-					&& strcmp(esize, "0001f000") != 0)
+				found_rootfs_device = 1;
+				if (rule_flags & PART_RULE_SUBDIR) // box with subdir feature in mtd partition e.g. sfx6008
 				{
-					if (rootfs_filename[0] != '\0')
-						my_printf("  ->  %s\n", rootfs_filename);
-					else
-						my_printf("\n");
-					found_rootfs_device = 1;
-					if (strcmp(name, "\"userdata\"") == 0) // box with subdir feature in mtd partition e.g. sfx6008
-					{
-						rootfs_flash_mode = TARBZ2_MTD;
-						sprintf(rootfs_sub_dir, "%s%d", slotname, multiboot_partition);
-					}
-					else
-						rootfs_flash_mode = MTD;
+					rootfs_flash_mode = TARBZ2_MTD;
+					sprintf(rootfs_sub_dir, "%s%d", slotname, multiboot_partition);
 				}
-				else if (strcmp(esize, "0001f000") == 0)
-					my_printf("  <-  Error: Invalid erasesize\n");
 				else
-					my_printf("  <-  Error: Rootfs file is bigger than device size!!\n");
+					rootfs_flash_mode = MTD;
 			}
+			else if (strcmp(esize, "0001f000") == 0)
+				my_printf("  <-  Error: Invalid erasesize\n");
 			else
-				my_printf("\n");
+				my_printf("  <-  Error: Rootfs file is bigger than device size!!\n");
 		}
+		else
+			my_printf("\n");
 	}
 
 	my_printf("Using kernel mtd device: %s\n", kernel_device);
 	my_printf("Using rootfs mtd device: %s\n", rootfs_device);
 
-	fclose(f);
-
 	if (wrong_user_mtd)
 	{
 		my_printf("Error: User selected mtd device cannot be used!\n");
@@ -999,6 +978,10 @@ int readProcMounts()
 						mountlist_entry = malloc(sizeof(*mountlist_entry));
 						mountlist_entry->next = mountlist;
 						mountlist_entry->dir = strdup(mountEntry->mnt_dir);
+						mountlist_entry->lazy = strncmp(mountEntry->mnt_type, "nfs", 3) == 0
+							|| strcmp(mountEntry->mnt_type, "cifs") == 0
+							|| strcmp(mountEntry->mnt_type, "smb3") == 0
+							|| strncmp(mountEntry->mnt_type, "fuse", 4) == 0;
 						mountlist = mountlist_entry;
 					}
 				}
@@ -1016,74 +999,64 @@ int readProcMounts()
 	return 1;
 }
 
-int exec_ps()
-{
-	// call ps
-	optind = 0; // reset getopt_long
-	char* argv[] = {
-		"ps",		// program name
-		NULL
-	};
-	int argc = (int)(sizeof(argv) / sizeof(argv[0])) - 1;
-
-	my_printf("Execute: ps\n");
-	if (ps_main(argc, argv) == 9999)
-	{
-		return 1; // e2 found
-	}
-	return 0; // e2 not found
-}
-
 int check_e2_stopped()
 {
+	int max_time = 70000;
 	int time = 0;
-	int max_time = 70;
-	int e2_found = 1;
+	struct timespec start, now;
+	pid_t pid;
 
 	set_step_progress(0);
 	if (!quiet)
 		my_printf("Checking E2 is running...\n");
-	while (time < max_time && e2_found)
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	// check again after exit, E2 is maybe restarted by its start script
+	while ((pid = find_process("enigma2")) > 0)
 	{
-		e2_found = exec_ps();
-
-		if (!e2_found)
-		{
-			if (!quiet)
-				my_printf("E2 is stopped\n");
-		}
-		else
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (elapsed_ms(&start, &now) >= max_time)
+			return 0;
+		if (!quiet)
+			my_printf("E2 still running (pid %d)\n", pid);
+		while (!wait_process_exit(pid, 1000))
 		{
-			sleep(2);
-			time += 2;
-			if (!quiet)
-				my_printf("E2 still running\n");
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			time = elapsed_ms(&start, &now);
+			if (time >= max_time)
+				return 0;
+			set_step_progress(time * 100 / max_time);
 		}
-		set_step_progress(time * 100 / max_time);
 	}
 
-	if (e2_found)
-		return 0;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	time = elapsed_ms(&start, &now);
+	if (!quiet)
+		my_printf("E2 is stopped after %d ms\n", time);
+	set_step_progress(100);
 
 	return 1;
 }
 
-int exec_fuser_kill()
+// kills all processes which prevent umounting rootfs like fuser -k -m /oldroot/
+int kill_oldroot_processes()
 {
-	optind = 0; // reset getopt_long
-	char* argv[] = {
-		"fuser",		// program name
-		"-k",			// kill
-		"-m",			// mount point
-		"/oldroot/",	// rootfs
-		NULL
-	};
-	int argc = (int)(sizeof(argv) / sizeof(argv[0])) - 1;
-
-	my_printf("Execute: fuser -k -m /oldroot/\n");
-	if (!no_write)
-		if (fuser_main(argc, argv) != 0)
-			return 0;
+	struct process_scan scan;
+	int i;
+
+	my_printf("Killing processes using /oldroot/\n");
+	if (!scan_processes("enigma2", "/oldroot/", &scan))
+		return 0;
+
+	if (scan.comm_pid != 0)
+		my_printf("E2 is running again (pid %d)\n", scan.comm_pid);
+	for (i = 0; i < scan.holder_count; i++)
+	{
+		my_printf("kill %d\n", scan.holders[i]);
+		if (!no_write)
+			kill(scan.holders[i], SIGKILL);
+	}
+	my_printf("Scanned %d processes, %d using /oldroot/\n", scan.processes, scan.holder_count);
+	free_process_scan(&scan);
 
 	return 1;
 }
@@ -1124,14 +1097,82 @@ int daemonize()
 	}
 
 	umask(0);
+	// the logger thread is gone after fork
+	start_logger();
 	my_printf(" successful\n");
 	return 1;
 }
 
+// Polls condition every 50 ms until it is true or timeout_ms passed. Returns the time waited in ms.
+int wait_for(int (*condition)(void), int timeout_ms, const char* what)
+{
+	struct timespec start, now;
+	int waited = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (!condition())
+	{
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		waited = elapsed_ms(&start, &now);
+		if (waited >= timeout_ms)
+		{
+			my_printf("Timeout waiting for %s after %d ms\n", what, waited);
+			return waited;
+		}
+		usleep(50000);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	waited = elapsed_ms(&start, &now);
+	my_printf("Waited %d ms for %s\n", waited, what);
+	return waited;
+}
+
+// stop scripts of the runlevel change are finished
+int rc_finished()
+{
+	return find_process("rc") == 0;
+}
+
+// init was reexecuted from the new root. /sbin can be a bind mount of the newroot image,
+// so the binary is compared instead of the filesystem of /.
+int init_reexecuted()
+{
+	struct stat init_stat, new_init_stat;
+
+	if (stat("/proc/1/exe", &init_stat) != 0 || stat("/sbin/init", &new_init_stat) != 0)
+		return 0;
+	return init_stat.st_dev == new_init_stat.st_dev && init_stat.st_ino == new_init_stat.st_ino;
+}
+
+// no process uses files on the old root anymore
+int oldroot_unused()
+{
+	struct process_scan scan;
+	int unused;
+
+	if (!scan_processes(NULL, "/oldroot/", &scan))
+		return 1;
+	unused = scan.holder_count == 0;
+	free_process_scan(&scan);
+	return unused;
+}
+
+int oldroot_umount_done = 0;
+
+int oldroot_umounted()
+{
+	if (!oldroot_umount_done)
+		oldroot_umount_done = umount("/oldroot/") == 0;
+	return oldroot_umount_done;
+}
+
 int umount_rootfs(int steps)
 {
 	DIR *dir;
 	int multilib = 1;
+	int waited = 0;
+	int umount_wait = 0;
+	int i;
 
 	if ((dir = opendir("/lib64")) == NULL)
 	{
@@ -1175,8 +1216,9 @@ int umount_rootfs(int steps)
 
 	// create maybe needed directory for image files mountpoint
 	char path[1000];
-	snprintf(path, sizeof(path), "mkdir -p /newroot/%s", rootfs_mount_point);
-	ret += system(path);
+	snprintf(path, sizeof(path), "/newroot/%s", rootfs_mount_point);
+	if (!mkdir_p(path, 0777))
+		ret++;
 
 	if (ret != 0)
 	{
@@ -1185,104 +1227,20 @@ int umount_rootfs(int steps)
 	}
 
 	// we need init and libs to be able to exec init u later
-	if (multilib)
-	{
-		ret =  system("cp -arf /bin/busybox*     /newroot/bin");
-		ret += system("cp -arf /bin/sh*          /newroot/bin");
-		ret += system("cp -arf /bin/bash*        /newroot/bin");
-		ret += system("cp -arf /sbin/init*       /newroot/sbin");
-		ret += system("cp -arf /lib64/libc*        /newroot/lib64");
-		ret += system("cp -arf /lib64/ld*          /newroot/lib64");
-		ret += system("cp -arf /lib64/libtinfo*    /newroot/lib64");
-		ret += system("cp -arf /lib64/libdl*       /newroot/lib64");
-		if (android)
-		{
-			ret += system("cp -arf /sbin/blkid*       /newroot/sbin");
-			ret += system("cp -arf /lib64/libblkid.*   /newroot/lib64");
-		}
-	}
+	phase_begin(PHASE_NEWROOT);
+	// with a newroot image only the box specific config is copied
+	if (newroot_image[0] != '\0' && mount_newroot_image(newroot_image, "/newroot", quiet))
+		ret = stage_newroot("/newroot", multilib, 1, quiet);
 	else
-	{
-		ret =  system("cp -arf /bin/busybox*     /newroot/bin");
-		ret += system("cp -arf /bin/sh*          /newroot/bin");
-		ret += system("cp -arf /bin/bash*        /newroot/bin");
-		ret += system("cp -arf /sbin/init*       /newroot/sbin");
-		ret += system("cp -arf /lib/libc*        /newroot/lib");
-		ret += system("cp -arf /lib/ld*          /newroot/lib");
-		ret += system("cp -arf /lib/libtinfo*    /newroot/lib");
-		ret += system("cp -arf /lib/libdl*       /newroot/lib");
-		if (android)
-		{
-			ret += system("cp -arf /sbin/blkid*       /newroot/sbin");
-			ret += system("cp -arf /lib/libblkid.*   /newroot/lib");
-		}
-	}
-
-	if (ret != 0)
+		ret = stage_newroot("/newroot", multilib, 0, quiet);
+	if (!ret)
 	{
 		my_printf("Error copying binary and libs\n");
 		return 0;
 	}
 
-	// libcrypt is moved from /lib to /usr/libX in new OE versions
-	if (multilib)
-	{
-		ret = system("cp -arf /lib64/libcrypt*    /newroot/lib64");
-		if (ret != 0)
-		{
-			ret = system("cp -arf /usr/lib64/libcrypt*    /newroot/usr/lib64");
-			if (ret != 0)
-			{
-				my_printf("Error copying libcrypto lib\n");
-				return 0;
-			}
-		}
-	}
-	else
-	{
-		ret = system("cp -arf /lib/libcrypt*    /newroot/lib");
-		if (ret != 0)
-		{
-			ret = system("cp -arf /usr/lib/libcrypt*    /newroot/usr/lib");
-			if (ret != 0)
-			{
-				my_printf("Error copying libcrypto lib\n");
-				return 0;
-			}
-		}
-	}
-
-	// copy for automount ignore errors as autofs is maybe not installed
-	if (multilib)
-	{
-		ret = system("cp -arf /usr/sbin/autom*  /newroot/bin");
-		ret += system("cp -arf /etc/auto*        /newroot/etc");
-		ret += system("cp -arf /lib64/libpthread*  /newroot/lib64");
-		ret += system("cp -arf /lib64/libnss*      /newroot/lib64");
-		ret += system("cp -arf /lib64/libnsl*      /newroot/lib64");
-		ret += system("cp -arf /lib64/libresolv*   /newroot/lib64");
-		ret += system("cp -arf /lib64/librt*       /newroot/lib64");
-		ret += system("cp -arf /usr/lib64/libtirp* /newroot/usr/lib64");
-		ret += system("cp -arf /usr/lib64/autofs/* /newroot/usr/lib64/autofs");
-		ret += system("cp -arf /etc/nsswitch*    /newroot/etc");
-		ret += system("cp -arf /etc/resolv*      /newroot/etc");
-	}
-	else
-	{
-		ret = system("cp -arf /usr/sbin/autom*  /newroot/bin");
-		ret += system("cp -arf /etc/auto*        /newroot/etc");
-		ret += system("cp -arf /lib/libpthread*  /newroot/lib");
-		ret += system("cp -arf /lib/libnss*      /newroot/lib");
-		ret += system("cp -arf /lib/libnsl*      /newroot/lib");
-		ret += system("cp -arf /lib/libresolv*   /newroot/lib");
-		ret += system("cp -arf /lib/librt*       /newroot/lib");
-		ret += system("cp -arf /usr/lib/libtirp* /newroot/usr/lib");
-		ret += system("cp -arf /usr/lib/autofs/* /newroot/usr/lib/autofs");
-		ret += system("cp -arf /etc/nsswitch*    /newroot/etc");
-		ret += system("cp -arf /etc/resolv*      /newroot/etc");
-	}
-
 	// Switch to user mode 1
+	phase_begin(PHASE_E2_STOP);
 	my_printf("Switching to user mode 2\n");
 	ret = system("init 2");
 	if (ret)
@@ -1311,8 +1269,11 @@ int umount_rootfs(int steps)
 	show_main_window(1, ofgwrite_version);
 	set_overall_text("Flashing image");
 	set_step_without_incr("Wait until E2 is stopped");
-	sleep(2);
+	waited = wait_for(rc_finished, 2000, "runlevel change");
 
+	phase_begin(PHASE_PIVOT);
+	// an open log file on the rootfs would prevent the umount of /oldroot
+	close_log_file_on("/");
 	ret = pivot_root("/newroot/", "oldroot");
 	if (ret)
 	{
@@ -1336,6 +1297,7 @@ int umount_rootfs(int steps)
 		my_printf("Error move mounts to newroot\n");
 		set_error_text1("Error move mounts to newroot. Abort flashing!");
 		set_error_text2("Rebooting in 30 seconds!");
+		write_phase_report(0);
 		sleep(30);
 		reboot(LINUX_REBOOT_CMD_RESTART);
 		return 0;
@@ -1355,16 +1317,44 @@ int umount_rootfs(int steps)
 		mount(oldroot_path, rootfs_mount_point, NULL, MS_MOVE, NULL);
 	}
 
-	// umount all unneeded filesystems
+	// umount all unneeded filesystems, independent mounts in parallel
+	phase_begin(PHASE_UMOUNT);
+	int mount_count = 0;
+	const char** mount_dirs;
+	int* mount_lazy;
+	for (mountlist_entry = mountlist; mountlist_entry != NULL; mountlist_entry = mountlist_entry->next)
+		mount_count++;
+	mount_dirs = malloc(mount_count * sizeof(*mount_dirs));
+	mount_lazy = malloc(mount_count * sizeof(*mount_lazy));
+	if (mount_dirs != NULL && mount_lazy != NULL)
+	{
+		// mountlist is in reverse order of /proc/mounts
+		i = mount_count;
+		for (mountlist_entry = mountlist; mountlist_entry != NULL; mountlist_entry = mountlist_entry->next)
+		{
+			mount_dirs[--i] = mountlist_entry->dir;
+			mount_lazy[i] = mountlist_entry->lazy;
+		}
+		umount_tree(mount_dirs, mount_lazy, mount_count, "/oldroot");
+	}
+	else
+	{
+		// one after the other like before, mountlist has the later mounts first
+		for (mountlist_entry = mountlist; mountlist_entry != NULL; mountlist_entry = mountlist_entry->next)
+		{
+			char oldroot_path[1000];
+			snprintf(oldroot_path, sizeof(oldroot_path), "/oldroot%s", mountlist_entry->dir);
+			umount_dir(oldroot_path, mountlist_entry->dir, mountlist_entry->lazy);
+		}
+	}
+	free(mount_dirs);
+	free(mount_lazy);
 	while (mountlist != NULL)
 	{
-		char oldroot_path[1000];
-		my_printf("umounting: %s\n", mountlist->dir);
-		strcpy(oldroot_path, "/oldroot");
-		strcat(oldroot_path, mountlist->dir);
-		umount2(oldroot_path, MNT_DETACH);
-		free(mountlist->dir);
+		mountlist_entry = mountlist;
 		mountlist = mountlist->next;
+		free(mountlist_entry->dir);
+		free(mountlist_entry);
 	}
 
 	// create link for mount/umount for autofs
@@ -1380,16 +1370,20 @@ int umount_rootfs(int steps)
 
 	// restart init process
 	ret = system("exec init u");
-	sleep(3);
+	waited += wait_for(init_reexecuted, 3000, "init reexec");
 
 	// kill all remaining open processes which prevent umounting rootfs
-	ret = exec_fuser_kill();
-	if (!ret)
-		my_printf("fuser successful\n");
-	sleep(3);
+	ret = kill_oldroot_processes();
+	if (ret)
+		my_printf("kill successful\n");
+	umount_wait = wait_for(oldroot_unused, 3000, "killed processes");
 
 	ret = umount("/oldroot/newroot");
-	ret = umount("/oldroot/");
+	// retry umount within the rest of the former fixed wait, but at least UMOUNT_RETRY_MIN_MS
+	umount_wait += wait_for(oldroot_umounted, umount_wait < 3000 - UMOUNT_RETRY_MIN_MS ? 3000 - umount_wait : UMOUNT_RETRY_MIN_MS, "umount /oldroot/");
+	ret = oldroot_umount_done ? 0 : -1;
+	waited += umount_wait;
+	my_printf("Waited %d ms instead of fixed 8000 ms, saved %d ms\n", waited, 8000 - waited);
 	if (!ret)
 		my_printf("umount successful\n");
 	else
@@ -1411,6 +1405,7 @@ int umount_rootfs(int steps)
 			my_printf("Error remounting root! Abort flashing.\n");
 			set_error_text1("Error remounting root! Abort flashing.");
 			set_error_text2("Rebooting in 30 seconds");
+			write_phase_report(0);
 			sleep(30);
 			reboot(LINUX_REBOOT_CMD_RESTART);
 			return 0;
@@ -1424,6 +1419,7 @@ int umount_rootfs(int steps)
 			my_printf("Error remounting root ro! Abort flashing.\n");
 			set_error_text1("Error remounting root ro! Abort flashing.");
 			set_error_text2("Rebooting in 30 seconds");
+			write_phase_report(0);
 			sleep(30);
 			reboot(LINUX_REBOOT_CMD_RESTART);
 			return 0;
@@ -1558,19 +1554,22 @@ void find_kernel_rootfs_device()
 	{
 		found_kernel_device = 0;
 		found_rootfs_device = 0;
-		// get kernel/rootfs from fdisk
-		// call fdisk -l
-		optind = 0; // reset getopt_long
-		char* argv[] = {
-			"fdisk",		// program name
-			"-l",			// list
-			NULL
-		};
-		int argc = (int)(sizeof(argv) / sizeof(argv[0])) - 1;
-
-		my_printf("Execute: fdisk -l\n");
-		if (fdisk_main(argc, argv) != 0)
-			return;
+		// get kernel/rootfs from partition names in sysfs, without sysfs from fdisk
+		if (!search_indexed_part_names())
+		{
+			// call fdisk -l
+			optind = 0; // reset getopt_long
+			char* argv[] = {
+				"fdisk",		// program name
+				"-l",			// list
+				NULL
+			};
+			int argc = (int)(sizeof(argv) / sizeof(argv[0])) - 1;
+
+			my_printf("Execute: fdisk -l\n");
+			if (fdisk_main(argc, argv) != 0)
+				return;
+		}
 	}
 
 	if (!found_kernel_device && mtd_kernel_found)
@@ -1750,13 +1749,20 @@ int main(int argc, char *argv[])
 		printUsage();
 		return EXIT_FAILURE;
 	}
+	// nothing is written with -n, also no report
+	if (no_write)
+		report_dir[0] = '\0';
+	// from now on the flash loops shouldn't wait for console and syslog
+	start_logger();
 
 	// set rootfs type and more
+	phase_begin(PHASE_DISCOVERY);
 	if (!readProcMounts())
 		return EXIT_FAILURE;
 
 	// find kernel and rootfs devices
 	my_printf("\n");
+	build_partition_index();
 	read_mtd_file();
 	find_kernel_rootfs_device();
 
@@ -1787,6 +1793,9 @@ int main(int argc, char *argv[])
 
 	my_printf("\n");
 
+	// check image files while E2 is stopped, without E2 stop only against checksum files
+	start_image_verify(flash_kernel, flash_rootfs, stop_e2_needed);
+
 	if (flash_kernel && !flash_rootfs) // flash only kernel
 	{
 		if (!quiet)
@@ -1796,10 +1805,24 @@ int main(int argc, char *argv[])
 		show_main_window(0, ofgwrite_version);
 		set_overall_text("Flashing kernel");
 
+		phase_begin(PHASE_VERIFY);
+		if (!wait_image_verify())
+		{
+			my_printf("Error: Kernel file is corrupt. Aborting\n");
+			set_error_text1("Kernel file is corrupt. Abort flashing.");
+			write_phase_report(0);
+			sleep(5);
+			closelog();
+			close_framebuffer();
+			return EXIT_FAILURE;
+		}
+
+		phase_begin(PHASE_KERNEL);
 		if (!kernel_flash(kernel_device, kernel_filename))
 			ret = EXIT_FAILURE;
 		else
 			ret = EXIT_SUCCESS;
+		write_phase_report(ret == EXIT_SUCCESS);
 
 		if (!quiet && ret == EXIT_SUCCESS)
 		{
@@ -1839,6 +1862,7 @@ int main(int argc, char *argv[])
 		show_main_window(0, ofgwrite_version);
 		set_overall_text("Flashing image");
 		set_step("Killing processes");
+		phase_begin(PHASE_KILL_PROCESSES);
 
 		// kill nmbd, smbd, rpc.mountd and rpc.statd -> otherwise remounting root read-only is not possible
 		if (!no_write && stop_e2_needed)
@@ -1872,8 +1896,10 @@ int main(int argc, char *argv[])
 		// sync filesystem
 		my_printf("Syncing filesystem\n");
 		set_step("Syncing filesystem");
+		phase_begin(PHASE_SYNC);
 		sync();
 		sleep(1);
+		phase_end();
 
 		set_step("init 2");
 		if (!no_write && stop_e2_needed)
@@ -1886,6 +1912,7 @@ int main(int argc, char *argv[])
 			}
 			if (!umount_rootfs(steps))
 			{
+				write_phase_report(0);
 				closelog();
 				close_framebuffer();
 				return EXIT_FAILURE;
@@ -1937,12 +1964,33 @@ int main(int argc, char *argv[])
 			bb_make_directory(tmp, -1, FILEUTILS_RECUR);
 		}
 
+		// don't start flashing with corrupt image files
+		set_step("Verifying image");
+		phase_begin(PHASE_VERIFY);
+		if (!wait_image_verify())
+		{
+			my_printf("Error: Image files are corrupt. Nothing was flashed. System will reboot in 30 seconds\n");
+			set_error_text1("Image files are corrupt. Nothing flashed!");
+			set_error_text2("Rebooting in 30 sec");
+			write_phase_report(0);
+			if (stop_e2_needed && !no_write)
+			{
+				sleep(30);
+				reboot(LINUX_REBOOT_CMD_RESTART);
+			}
+			sleep(3);
+			close_framebuffer();
+			return EXIT_FAILURE;
+		}
+
 		// Flash rootfs
+		phase_begin(PHASE_FLASH);
 		if (!rootfs_flash(rootfs_device, rootfs_filename, nfi_filename))
 		{
 			my_printf("Error flashing rootfs! System won't boot. Please flash backup! System will reboot in 60 seconds\n");
 			set_error_text1("Error flashing rootfs. System won't boot!");
 			set_error_text2("Please flash backup! Rebooting in 60 sec");
+			write_phase_report(0);
 			if (stop_e2_needed)
 			{
 				sleep(60);
@@ -1960,11 +2008,13 @@ int main(int argc, char *argv[])
 			if (!quiet)
 				my_printf("Flashing kernel ...\n");
 
+			phase_begin(PHASE_KERNEL);
 			if (!kernel_flash(kernel_device, kernel_filename))
 			{
 				my_printf("Error flashing kernel. System won't boot. Please flash backup! Starting E2 in 60 seconds\n");
 				set_error_text1("Error flashing kernel. System won't boot!");
 				set_error_text2("Please flash backup! Starting E2 in 60 sec");
+				write_phase_report(0);
 				if (stop_e2_needed)
 				{
 					sleep(60);
@@ -1982,6 +2032,7 @@ int main(int argc, char *argv[])
 		if (android)
 		{
 			set_step("Create Kernel.img");
+			phase_begin(PHASE_BOOT_IMAGE);
 			const char *dreamcard_device = "/dev/mmcblk1p1";
 			const char *dreamcard_mount = "/dreamcard";
 			char device_root[256];
@@ -2050,8 +2101,13 @@ int main(int argc, char *argv[])
 			sleep(1);
 		}
 
+		// old rootfs is maybe still deleted in background
+		phase_begin(PHASE_DELETE);
+		wait_background_rm(quiet);
+		phase_begin(PHASE_SYNC);
 		sync();
 		sleep(1);
+		phase_end();
 		if (!stop_e2_needed)
 		{
 			ret = umount2("/oldroot_remount/", MNT_DETACH);
@@ -2067,6 +2123,8 @@ int main(int argc, char *argv[])
 			my_printf("Successfully flashed image Rebooting in 3 seconds...\n");
 			set_step("Successfully flashed! Rebooting in 3 seconds");
 		}
+		write_phase_report(1);
+		flush_logger();
 		fflush(stdout);
 		fflush(stderr);
 		sleep(3);
@@ -1,5 +1,9 @@
+#include <sys/types.h>
 #include <sys/stat.h>
 #include <stdio.h>
+#include <stdarg.h>
+#include <syslog.h>
+#include <time.h>
 
 extern struct stat kernel_file_stat;
 extern struct stat rootfs_file_stat;
@@ -9,6 +13,7 @@ extern char rootfs_device_arg[1000];
 extern char kernel_device[1000];
 extern char rootfs_device[1000];
 extern char rootfs_sub_dir[1000];
+extern const char * rootfs_fs_type;
 
 extern int found_kernel_device;
 extern int found_rootfs_device;
@@ -16,12 +21,23 @@ extern int user_kernel;
 extern int user_rootfs;
 extern int rootsubdir_check;
 extern int multiboot_partition;
+extern int format_rootfs;
+extern int trim_rootfs;
+extern int android;
+extern char newroot_image[1000];
+#define NEWROOT_IMAGE_DEFAULT "/usr/share/ofgwrite/newroot.squashfs"
+extern int sync_policy;
+extern int sync_chunk_mb;
+extern char report_dir[1000];
+extern const char ofgwrite_version[];
 extern char current_rootfs_device[1000];
 extern char current_kernel_device[1000];
 extern char current_rootfs_sub_dir[1000];
 extern char ubi_fs_name[1000];
 extern char ubi_loop_device[1000];
 extern int loop_mtd_device;
+extern char kernel_filename[1000];
+extern char rootfs_filename[1000];
 extern char nfi_filename[1000];
 extern char nfi_path[1000];
 
@@ -48,12 +64,65 @@ enum ImageTypeEnum
 
 extern enum ImageTypeEnum image_type;
 
+enum ImageMagicEnum
+{
+	MAGIC_UNKNOWN, MAGIC_UBI, MAGIC_BZIP2, MAGIC_XZ, MAGIC_NFI, MAGIC_UIMAGE, MAGIC_JFFS2
+};
+
+struct image_file
+{
+	char name[256];
+	enum ImageMagicEnum magic;
+	struct stat st;
+};
+
+struct image_manifest
+{
+	char path[4097];		// ends with /
+	int count;
+	struct image_file* files;	// sorted by name
+};
+
+int build_image_manifest(const char* path, struct image_manifest* manifest);
+void free_image_manifest(struct image_manifest* manifest);
+const char* image_magic_name(enum ImageMagicEnum magic);
+const struct image_file* select_kernel_image(const struct image_manifest* manifest);
+const struct image_file* select_rootfs_image(const struct image_manifest* manifest);
+const struct image_file* select_nfi_image(const struct image_manifest* manifest);
+enum ImageTypeEnum rootfs_image_type(const struct image_file* file);
+
+enum SyncPolicyEnum
+{
+	SYNC_POLICY_LEGACY, SYNC_POLICY_SYNCFS, SYNC_POLICY_STREAM
+};
+
 void my_printf(const char *format, ...);
 void my_fprintf(FILE* stream, const char *format, ...);
 
+// log sinks, levels like syslog
+#define LOG_SINK_CONSOLE 0
+#define LOG_SINK_SYSLOG  1
+#define LOG_SINK_FILE    2
+#define LOG_SINK_COUNT   3
+extern int log_max_level;
+// arguments are only evaluated if a sink logs debug messages
+#define my_debug(...) do { if (log_max_level >= LOG_DEBUG) my_log(LOG_DEBUG, __VA_ARGS__); } while (0)
+void my_log(int level, const char *format, ...);
+void my_vlog(int level, FILE* stream, const char *format, va_list ap);
+int set_log_levels(const char* arg);
+int open_log_file(const char* filename);
+void close_log_file_on(const char* path);
+void start_logger();
+void stop_logger();
+void flush_logger();
+void log_console_progress(const char* line);
+
 int set_step(char*);
 void set_step_without_incr(char* str);
 void set_step_progress(int percent);
+void set_console_progress(const char* fmt, ...);
+void flush_console_progress();
+void set_step_stats(const char* str);
 void set_overall_progress(int step);
 void set_error_text(char* str);
 void set_error_text1(char* str);
@@ -63,8 +132,118 @@ void close_framebuffer();
 void set_overall_text(char* str);
 int show_main_window(int show_background_image, const char* version);
 
+void progress_begin(const char* name, long long total);
+void progress_update(long long done);
+void progress_add(long long bytes);
+void progress_end();
+void progress_detach();
+long elapsed_ms(const struct timespec* from, const struct timespec* to);
+
+enum PhaseEnum
+{
+	PHASE_FIND_IMAGES, PHASE_DISCOVERY, PHASE_KILL_PROCESSES, PHASE_SYNC, PHASE_NEWROOT, PHASE_E2_STOP, PHASE_PIVOT,
+	PHASE_UMOUNT, PHASE_VERIFY, PHASE_DELETE, PHASE_FLASH, PHASE_KERNEL, PHASE_BOOT_IMAGE, PHASE_COUNT
+};
+void phase_begin(enum PhaseEnum phase);
+void phase_end();
+void phase_add_bytes(long long bytes);
+void write_phase_report(int success);
+
 int flash_ext4_kernel(char* device, char* filename, off_t kernel_file_size, int quiet, int no_write);
 int flash_unpack_rootfs(char* filename, int quiet, int no_write);
+int rm_rootfs(char* directory, int quiet, int no_write);
+int rm_tree(const char* directory, int quiet);
+int rootfs_swap_possible(const char* mount_point, off_t image_size);
+void get_rootfs_swap_paths(const char* path, char* new_path, char* old_path);
+int prepare_rootfs_swap(const char* new_path, const char* old_path, int quiet);
+int swap_rootfs_dirs(const char* path, const char* new_path, const char* old_path);
+void start_background_rm(char* directory, int quiet);
+void wait_background_rm(int quiet);
+int fstrim_rootfs(const char* mount_point, int quiet);
+
+struct process_scan
+{
+	int processes;
+	pid_t comm_pid;		// 0 if not running
+	int holder_count;
+	pid_t *holders;		// processes using files on the mount point
+};
+
+int scan_processes(const char* comm, const char* mount_point, struct process_scan* scan);
+void free_process_scan(struct process_scan* scan);
+pid_t find_process(const char* comm);
+int wait_process_exit(pid_t pid, int timeout_ms);
+
+extern pid_t verify_pid;
+void start_image_verify(int kernel, int rootfs, int stream);
+int wait_image_verify();
+
+#define MAX_MTD_PARTS   64
+#define MAX_BLOCK_PARTS 128
+
+struct mtd_part
+{
+	char dev[16];
+	char size_str[16];
+	char erasesize_str[16];
+	char name[72];		// with quotes like in /proc/mtd
+	unsigned long size;
+	unsigned long erasesize;
+};
+
+struct block_part
+{
+	char dev[40];
+	char disk[40];
+	int number;
+	char name[72];		// PARTNAME, e.g. GPT partition name
+	unsigned long long size;
+};
+
+extern struct mtd_part mtd_parts[MAX_MTD_PARTS];
+extern int mtd_part_count;
+extern int mtd_index_valid;
+extern struct block_part block_parts[MAX_BLOCK_PARTS];
+extern int block_part_count;
+
+void build_partition_index();
+int search_indexed_part_names();
+void ext4_kernel_dev_found(const char* dev, int partition_number);
+void ext4_rootfs_dev_found(const char* dev, int partition_number);
+
+// partition name rules
+#define PART_SRC_MTD        0x01
+#define PART_SRC_MTD_USER   0x02	// mtd selected by user
+#define PART_SRC_CMDLINE    0x04	// blkdevparts in /proc/cmdline
+#define PART_SRC_GPT        0x08
+
+#define PART_KERNEL 1
+#define PART_ROOTFS 2
+
+#define PART_RULE_SUBDIR    0x01	// rootfs is a subdir in the partition
+#define PART_RULE_FALLBACK  0x02	// used even if the partitions are not found
+#define PART_RULE_MATCH     0x100
+
+void expand_part_rule_name(const char* pattern, char* name, size_t size);
+int match_part_name(int source, int role, const char* name);
+void match_part_name_rules(int source, const char* name, unsigned long long* kernel_rules, unsigned long long* rootfs_rules);
+int select_part_rule(int source, unsigned long long kernel_rules, unsigned long long rootfs_rules, const char** kernel, const char** rootfs, int* flags);
+int active_part_rule_flags(int source);
+
+int umount_dir(const char* path, const char* name, int lazy);
+void umount_tree(const char** dirs, const int* lazy, int count, const char* prefix);
+
+int mkdir_p(const char* path, mode_t mode);
+int stage_newroot(const char* newroot, int multilib, int config_only, int quiet);
+int mount_newroot_image(const char* image, const char* newroot, int quiet);
+int setup_loop_device(const char* image, int quiet);
+int release_loop_device(int quiet);
+
+int set_sync_policy(const char* name);
+void extract_sync_begin(const char* directory, int quiet);
+void extract_sync_file(int fd, off_t size);
+void extract_sync_end(int success, int quiet);
+void sync_rootfs(int quiet);
 int flash_ubi_jffs2_kernel(char* device, char* filename, int quiet, int no_write);
 int flash_ubi_jffs2_rootfs(char* device, char* filename, enum RootfsTypeEnum rootfs_type, int quiet, int no_write);
 int flash_erase_main(int argc, char **argv);
@@ -75,4 +254,5 @@ int ubiattach_main(int argc, char **argv);
 int flashcp_main(int argc, char **argv);
 int cp_main(int argc, char **argv);
 int losetup_main(int argc, char **argv);
+int tar_main(int argc, char **argv);
 
@@ -0,0 +1,313 @@
+#include "ofgwrite.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+// Index of MTD and block device partitions
+// Built once from /proc/mtd, /proc/partitions and the uevent files in /sys/class/block, so partition
+// names don't need to be read from the partition tables of all disks with fdisk.
+
+struct mtd_part mtd_parts[MAX_MTD_PARTS];
+int mtd_part_count = 0;
+struct block_part block_parts[MAX_BLOCK_PARTS];
+int block_part_count = 0;
+int mtd_index_valid = 0;
+int block_index_valid = 0;
+
+static int index_mtd()
+{
+	char line[1000];
+	FILE* f;
+	int line_nr = 0;
+	struct mtd_part* part;
+
+	f = fopen("/proc/mtd", "r");
+	if (f == NULL)
+	{
+		perror("Error while opening /proc/mtd");
+		// for testing try to open local mtd file
+		f = fopen("./mtd", "r");
+		if (f == NULL)
+			return 0;
+	}
+
+	while (fgets(line, sizeof(line), f) != NULL && mtd_part_count < MAX_MTD_PARTS)
+	{
+		part = &mtd_parts[mtd_part_count];
+		line_nr++;
+		if (line_nr == 1) // check header
+		{
+			sscanf(line, "%15s%15s%15s%71s", part->dev, part->size_str, part->erasesize_str, part->name);
+			if (strcmp(part->dev          , "dev:") != 0
+			 || strcmp(part->size_str     , "size") != 0
+			 || strcmp(part->erasesize_str, "erasesize") != 0
+			 || strcmp(part->name         , "name") != 0)
+			{
+				my_printf("Error: /proc/mtd has an invalid format\n");
+				fclose(f);
+				return 0;
+			}
+			continue;
+		}
+		if (sscanf(line, "%15s%15s%15s%71s", part->dev, part->size_str, part->erasesize_str, part->name) != 4)
+			continue;
+		if (part->dev[strlen(part->dev) - 1] == ':') // cut ':'
+			part->dev[strlen(part->dev) - 1] = '\0';
+		part->size = strtoul(part->size_str, 0, 16);
+		part->erasesize = strtoul(part->erasesize_str, 0, 16);
+		mtd_part_count++;
+	}
+	fclose(f);
+	return 1;
+}
+
+// reads PARTN and PARTNAME of a partition from its uevent file
+static void read_uevent(const char* dev, struct block_part* part)
+{
+	char path[128];
+	char line[256];
+	FILE* f;
+
+	snprintf(path, sizeof(path), "/sys/class/block/%s/uevent", dev);
+	f = fopen(path, "r");
+	if (f == NULL)
+		return;
+	while (fgets(line, sizeof(line), f) != NULL)
+	{
+		line[strcspn(line, "\n")] = '\0';
+		if (strncmp(line, "PARTN=", 6) == 0)
+			part->number = atoi(line + 6);
+		else if (strncmp(line, "PARTNAME=", 9) == 0)
+			snprintf(part->name, sizeof(part->name), "%s", line + 9);
+	}
+	fclose(f);
+}
+
+static int index_block()
+{
+	char line[200];
+	char dev[100];
+	char path[128];
+	char link[512];
+	char* disk;
+	ssize_t len;
+	unsigned int major, minor;
+	unsigned long long blocks;
+	struct block_part* part;
+	FILE* f;
+
+	if (access("/sys/class/block", F_OK) != 0)
+		return 0;
+
+	f = fopen("/proc/partitions", "r");
+	if (f == NULL)
+		return 0;
+	while (fgets(line, sizeof(line), f) != NULL && block_part_count < MAX_BLOCK_PARTS)
+	{
+		if (sscanf(line, " %u %u %llu %99s", &major, &minor, &blocks, dev) != 4)
+			continue;
+
+		// only partitions, the disk is the parent in sysfs
+		snprintf(path, sizeof(path), "/sys/class/block/%s/partition", dev);
+		if (access(path, F_OK) != 0)
+			continue;
+		snprintf(path, sizeof(path), "/sys/class/block/%s", dev);
+		len = readlink(path, link, sizeof(link) - 1);
+		if (len < 0)
+			continue;
+		link[len] = '\0';
+		*strrchr(link, '/') = '\0';
+		disk = strrchr(link, '/') ? strrchr(link, '/') + 1 : link;
+
+		part = &block_parts[block_part_count];
+		memset(part, 0, sizeof(*part));
+		snprintf(part->dev, sizeof(part->dev), "%s", dev);
+		snprintf(part->disk, sizeof(part->disk), "%s", disk);
+		part->size = blocks * 1024;
+		read_uevent(dev, part);
+		if (part->number == 0)
+			continue;
+		block_part_count++;
+	}
+	fclose(f);
+	return 1;
+}
+
+void build_partition_index()
+{
+	mtd_part_count = 0;
+	block_part_count = 0;
+	mtd_index_valid = index_mtd();
+	block_index_valid = index_block();
+}
+
+static struct block_part* find_block_part(const char* disk, int number)
+{
+	int i;
+
+	for (i = 0; i < block_part_count; i++)
+		if (block_parts[i].number == number && strcmp(block_parts[i].disk, disk) == 0)
+			return &block_parts[i];
+	return NULL;
+}
+
+// Searches kernel and rootfs partitions of one disk by their names like fdisk did for GPT disks
+static void search_disk_part_names(const char* disk)
+{
+	char disk_device[64];
+	char kernel_name[72];
+	char rootfs_name[72];
+	char kernel_name_hd51[72];
+	char rootfs_name_hd51[72];
+	const char* partname;
+	struct block_part* part;
+	int found_kernel = 0;
+	int found_rootfs = 0;
+	int part_num = -1;
+	int i;
+
+	snprintf(disk_device, sizeof(disk_device), "/dev/%s", disk);
+	kernel_name[0] = '\0';
+	rootfs_name[0] = '\0';
+	kernel_name_hd51[0] = '\0';
+	rootfs_name_hd51[0] = '\0';
+
+	if (active_part_rule_flags(PART_SRC_GPT) & PART_RULE_SUBDIR) // box with rootSubDir feature
+		sprintf(rootfs_sub_dir, "linuxrootfs%d", multiboot_partition);
+
+	for (i = 0; i < block_part_count; i++)
+	{
+		part = &block_parts[i];
+		if (strcmp(part->disk, disk) != 0)
+			continue;
+		partname = part->name;
+		if (match_part_name(PART_SRC_GPT, PART_KERNEL, partname))
+		{
+			ext4_kernel_dev_found(disk_device, part->number);
+			found_kernel = 1;
+		}
+		if (match_part_name(PART_SRC_GPT, PART_ROOTFS, partname))
+		{
+			ext4_rootfs_dev_found(disk_device, part->number);
+			found_rootfs = 1;
+		}
+		if ((user_kernel || user_rootfs) && (strcmp(partname, "bp30") == 0 || strcmp(partname, "bp31") == 0))
+		{
+			if ((user_kernel && strcmp(kernel_device_arg, part->dev) == 0)
+			 || (user_rootfs && strcmp(rootfs_device_arg, part->dev) == 0))
+			{
+				my_printf("User specified device is a bp30/bp31 partition. These partitions shouldn't be used. Never!\nAborting...\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+		if (found_kernel && found_rootfs)
+			return;
+	}
+
+	// If kernel OR rootfs found, return. If one is missing, handle error later. Don't search for other partitions.
+	// If multiboot partition was specified, return also as user wanted to use a specific partition which was not found.
+	if (found_kernel || found_rootfs || multiboot_partition != -1)
+		return;
+
+	my_printf("No matching partition names are found. Use current kernel and rootfs devices\n");
+
+	// E.g. hd51 in single boot configuration with kernel1 and rootfs1 partitions
+	// or user hasn't specified multiboot partition on a multiboot box like hd51.
+	// In both cases use current used kernel and rootfs devices
+
+	// find partition name of current rootfs device
+	if (sscanf(current_rootfs_device, "%*[a-z/]%*dp%d", &part_num) == EOF)
+		return;
+
+	// No partition number found. Device name is not as expected
+	if (part_num == -1)
+	{
+		my_printf("Error: Partition number not found. Device name: %s\n", current_rootfs_device);
+		return;
+	}
+
+	part = find_block_part(disk, part_num);
+	if (part == NULL)
+		return;
+	partname = part->name;
+	if (current_rootfs_sub_dir[0] == '\0')
+	{
+		// expecting names starting with "rootfs" and after that a number. So e.g. rootfs3
+		if (sscanf(partname, "%*[a-z]%d", &multiboot_partition) == EOF)
+			return;
+		my_printf("Using current multiboot partition %d\n", multiboot_partition);
+	}
+	else // box with rootSubDir feature, part name is either linuxrootfs or userdata
+	{
+		if (strcmp(partname, "linuxrootfs") == 0)
+		{
+			multiboot_partition = 1;
+			my_printf("Using current multiboot partition %d\n", multiboot_partition);
+		}
+		else
+		{
+			multiboot_partition = -1;
+			my_printf("Using current multiboot partition userdata\n");
+		}
+	}
+
+	if (multiboot_partition != -1 && current_rootfs_sub_dir[0] == '\0')
+	{
+		sprintf(kernel_name, "kernel%d", multiboot_partition);
+		sprintf(rootfs_name, "rootfs%d", multiboot_partition);
+	}
+	else if (current_rootfs_sub_dir[0] != '\0')
+	{
+		if (multiboot_partition == 1)
+		{
+			// hd51, h7,... have seperate partition for rootfs1
+			strcpy(kernel_name_hd51, "linuxkernel");
+			strcpy(rootfs_name_hd51, "linuxrootfs");
+		}
+		// h17 don't have this -> so also set kernel_name, rootfs_name
+		snprintf(kernel_name, sizeof(kernel_name), "%s", current_kernel_device);
+		strcpy(rootfs_name, "userdata");
+		strcpy(rootfs_sub_dir, current_rootfs_sub_dir);
+	}
+	else
+		return;
+
+	// now search for both partitions as we need to call both ext4_..._dev_found functions
+	for (i = 0; i < block_part_count; i++)
+	{
+		part = &block_parts[i];
+		if (strcmp(part->disk, disk) != 0)
+			continue;
+		partname = part->name;
+		if (strcmp(partname, kernel_name) == 0 || strcmp(partname, kernel_name_hd51) == 0)
+			ext4_kernel_dev_found(disk_device, part->number);
+		if (strcmp(partname, rootfs_name) == 0 || strcmp(partname, rootfs_name_hd51) == 0)
+			ext4_rootfs_dev_found(disk_device, part->number);
+	}
+}
+
+// Searches kernel and rootfs partitions on all disks with named partitions. Returns 0 if the index is not available.
+int search_indexed_part_names()
+{
+	int i, j;
+
+	if (!block_index_valid)
+		return 0;
+
+	my_printf("Searching partition names of %d block partitions\n", block_part_count);
+	for (i = 0; i < block_part_count; i++)
+	{
+		if (block_parts[i].name[0] == '\0')
+			continue;
+		// each disk only once
+		for (j = 0; j < i; j++)
+			if (block_parts[j].name[0] != '\0' && strcmp(block_parts[j].disk, block_parts[i].disk) == 0)
+				break;
+		if (j == i)
+			search_disk_part_names(block_parts[i].disk);
+	}
+	return 1;
+}
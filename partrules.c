@@ -0,0 +1,365 @@
+#include "ofgwrite.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Partition name rules for finding kernel and rootfs partitions
+// The same table is used for /proc/mtd, blkdevparts in /proc/cmdline and GPT partition names.
+// Rules are in order of priority. In names %d is replaced by the multiboot partition.
+// Additional rules can be added in PART_RULES_FILE, they have priority over the built-in ones:
+//   <sources> <condition> <kernel name|-> <rootfs name|-> [subdir]
+//   e.g.: gpt,cmdline singleboot mykernel myrootfs
+
+#define PART_RULES_FILE  "/etc/ofgwrite/partitions.conf"
+#define MAX_PART_RULES   64
+#define PART_HASH_SIZE   256
+#define PART_NAME_LEN    72
+
+enum PartRuleCondition
+{
+	COND_ANY,
+	COND_SINGLEBOOT,			// no multiboot partition selected
+	COND_MULTIBOOT,				// multiboot partition selected
+	COND_MULTIBOOT_NO_SUBDIR,	// multiboot partition on box with separate rootfs partitions
+	COND_MULTIBOOT_SUBDIR,		// multiboot partition on box with rootSubDir feature
+	COND_MULTIBOOT1_SUBDIR,		// multiboot partition 1 on box with rootSubDir feature
+	COND_SUBDIR,				// box with rootSubDir feature
+	COND_SUBDIR_FLAG			// box with rootSubDir feature and /dev/block/by-name/flag
+};
+
+struct part_rule
+{
+	int sources;
+	enum PartRuleCondition condition;
+	const char* kernel;
+	const char* rootfs;
+	int flags;
+};
+
+static const char* condition_names[] = {
+	"any", "singleboot", "multiboot", "multiboot-nosubdir", "multiboot-subdir", "multiboot1-subdir", "subdir", "subdir-flag"
+};
+
+static const struct part_rule builtin_rules[] = {
+	// mtd: kernel and rootfs are searched independently
+	{ PART_SRC_MTD,      COND_ANY,               "kernel",        "rootfs",          0 },
+	{ PART_SRC_MTD,      COND_ANY,               "nkernel",       "dreambox-rootfs", 0 },
+	{ PART_SRC_MTD,      COND_ANY,               NULL,            "root",            0 },
+	{ PART_SRC_MTD,      COND_SINGLEBOOT,        "boot",          NULL,              0 },
+	{ PART_SRC_MTD,      COND_MULTIBOOT,         "linuxkernel%d", "userdata",        PART_RULE_SUBDIR }, // e.g. sfx6008
+	// mtd selected by user
+	{ PART_SRC_MTD_USER, COND_ANY,               "kernel",        "rootfs",          0 },
+	{ PART_SRC_MTD_USER, COND_ANY,               "nkernel",       "rootfs2",         0 },
+	{ PART_SRC_MTD_USER, COND_ANY,               "kernel2",       "dreambox-rootfs", 0 },
+	{ PART_SRC_MTD_USER, COND_ANY,               "boot",          NULL,              0 },
+	// blkdevparts: first rule with both partitions on the same device
+	{ PART_SRC_CMDLINE,  COND_ANY,               "kernel",        "dreambox-rootfs", 0 },
+	{ PART_SRC_CMDLINE,  COND_ANY,               "kernel",        "rootfs",          0 },
+	{ PART_SRC_CMDLINE,  COND_ANY,               "ekernel",       "rootfs",          0 },
+	{ PART_SRC_CMDLINE,  COND_ANY,               "exkernel",      "exrootfs",        0 },
+	{ PART_SRC_CMDLINE,  COND_ANY,               "boot",          "root",            0 },
+	{ PART_SRC_CMDLINE,  COND_ANY,               "linuxkernel",   "linuxrootfs",     0 },
+	{ PART_SRC_CMDLINE,  COND_SUBDIR_FLAG,       "linuxkernel%d", "rootfs",          PART_RULE_SUBDIR | PART_RULE_FALLBACK },
+	{ PART_SRC_CMDLINE,  COND_SUBDIR,            "linuxkernel%d", "userdata",        PART_RULE_SUBDIR | PART_RULE_FALLBACK },
+	// gpt
+	{ PART_SRC_GPT,      COND_MULTIBOOT_NO_SUBDIR, "kernel%d",    "rootfs%d",        0 },
+	{ PART_SRC_GPT,      COND_MULTIBOOT1_SUBDIR, "linuxkernel",   "linuxrootfs",     PART_RULE_SUBDIR }, // hd51, h7,... have seperate partition for rootfs1
+	{ PART_SRC_GPT,      COND_MULTIBOOT_SUBDIR,  "linuxkernel%d", "userdata",        PART_RULE_SUBDIR },
+	{ PART_SRC_GPT,      COND_SINGLEBOOT,        "kernel",        "rootfs",          0 },
+};
+#define BUILTIN_RULES (int)(sizeof(builtin_rules) / sizeof(builtin_rules[0]))
+
+struct part_name_entry
+{
+	char name[PART_NAME_LEN];	// empty if unused
+	int source;
+	unsigned long long kernel_rules;
+	unsigned long long rootfs_rules;
+};
+
+static struct part_rule rules[MAX_PART_RULES];
+static int rule_count = 0;
+static int rules_loaded = 0;
+static int subdir_flag = 0;
+
+// compiled hash of the expanded names of all active rules
+static struct part_name_entry name_hash[PART_HASH_SIZE];
+static unsigned long long active_rules = 0;
+static int compiled_multiboot = -2;
+static int compiled_subdir = -1;
+
+static int parse_sources(char* str)
+{
+	int sources = 0;
+	char* token;
+
+	for (token = strtok(str, ","); token; token = strtok(NULL, ","))
+	{
+		if (strcmp(token, "mtd") == 0)
+			sources |= PART_SRC_MTD | PART_SRC_MTD_USER;
+		else if (strcmp(token, "cmdline") == 0)
+			sources |= PART_SRC_CMDLINE;
+		else if (strcmp(token, "gpt") == 0)
+			sources |= PART_SRC_GPT;
+		else
+			return 0;
+	}
+	return sources;
+}
+
+static void load_rules_file()
+{
+	char line[256];
+	char sources[64], condition[32], kernel[PART_NAME_LEN], rootfs[PART_NAME_LEN], option[16];
+	struct part_rule* rule;
+	int line_nr = 0;
+	int fields;
+	int i;
+	FILE* f;
+
+	f = fopen(PART_RULES_FILE, "r");
+	if (f == NULL)
+		return;
+	while (fgets(line, sizeof(line), f) != NULL && rule_count < MAX_PART_RULES - BUILTIN_RULES)
+	{
+		line_nr++;
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+		option[0] = '\0';
+		fields = sscanf(line, "%63s %31s %71s %71s %15s", sources, condition, kernel, rootfs, option);
+		if (fields < 4)
+		{
+			my_printf("Error in %s line %d\n", PART_RULES_FILE, line_nr);
+			continue;
+		}
+
+		rule = &rules[rule_count];
+		memset(rule, 0, sizeof(*rule));
+		rule->sources = parse_sources(sources);
+		for (i = 0; i < (int)(sizeof(condition_names) / sizeof(condition_names[0])); i++)
+			if (strcmp(condition, condition_names[i]) == 0)
+				break;
+		if (rule->sources == 0 || i == (int)(sizeof(condition_names) / sizeof(condition_names[0])))
+		{
+			my_printf("Error in %s line %d\n", PART_RULES_FILE, line_nr);
+			continue;
+		}
+		rule->condition = i;
+		rule->kernel = strcmp(kernel, "-") != 0 ? strdup(kernel) : NULL;
+		rule->rootfs = strcmp(rootfs, "-") != 0 ? strdup(rootfs) : NULL;
+		if (strcmp(option, "subdir") == 0)
+			rule->flags |= PART_RULE_SUBDIR;
+		rule_count++;
+	}
+	fclose(f);
+	if (rule_count > 0)
+		my_printf("Loaded %d partition name rules from %s\n", rule_count, PART_RULES_FILE);
+}
+
+static void load_rules()
+{
+	int i;
+
+	rule_count = 0;
+	load_rules_file();
+	for (i = 0; i < BUILTIN_RULES; i++)
+		rules[rule_count++] = builtin_rules[i];
+	subdir_flag = access("/dev/block/by-name/flag", F_OK) != -1;
+	rules_loaded = 1;
+}
+
+static int rule_active(const struct part_rule* rule)
+{
+	int subdir = current_rootfs_sub_dir[0] != '\0';
+
+	switch (rule->condition)
+	{
+		case COND_ANY:                 return 1;
+		case COND_SINGLEBOOT:          return multiboot_partition == -1;
+		case COND_MULTIBOOT:           return multiboot_partition != -1;
+		case COND_MULTIBOOT_NO_SUBDIR: return multiboot_partition != -1 && !subdir;
+		case COND_MULTIBOOT_SUBDIR:    return multiboot_partition != -1 && subdir;
+		case COND_MULTIBOOT1_SUBDIR:   return multiboot_partition == 1 && subdir;
+		case COND_SUBDIR:              return subdir;
+		case COND_SUBDIR_FLAG:         return subdir && subdir_flag;
+	}
+	return 0;
+}
+
+static unsigned int hash_name(int source, const char* name)
+{
+	unsigned int hash = 2166136261u ^ source;
+
+	while (*name)
+		hash = (hash ^ (unsigned char)*name++) * 16777619u;
+	return hash;
+}
+
+static struct part_name_entry* lookup(int source, const char* name, int insert)
+{
+	unsigned int pos = hash_name(source, name) % PART_HASH_SIZE;
+	int i;
+
+	for (i = 0; i < PART_HASH_SIZE; i++, pos = (pos + 1) % PART_HASH_SIZE)
+	{
+		struct part_name_entry* entry = &name_hash[pos];
+		if (entry->name[0] == '\0')
+		{
+			if (!insert)
+				return NULL;
+			snprintf(entry->name, sizeof(entry->name), "%s", name);
+			entry->source = source;
+			return entry;
+		}
+		if (entry->source == source && strcmp(entry->name, name) == 0)
+			return entry;
+	}
+	return NULL;
+}
+
+// Patterns can come from the rules file, so only %d is replaced and they are never used as format
+void expand_part_rule_name(const char* pattern, char* name, size_t size)
+{
+	size_t pos = 0;
+
+	if (pattern == NULL)
+	{
+		name[0] = '\0';
+		return;
+	}
+	while (*pattern && pos + 1 < size)
+	{
+		if (pattern[0] == '%' && pattern[1] == 'd')
+		{
+			pos += snprintf(&name[pos], size - pos, "%d", multiboot_partition);
+			if (pos >= size)
+				pos = size - 1;
+			pattern += 2;
+		}
+		else
+			name[pos++] = *pattern++;
+	}
+	name[pos] = '\0';
+}
+
+static void add_name(int sources, const char* pattern, int rule_index, int kernel)
+{
+	char name[PART_NAME_LEN];
+	struct part_name_entry* entry;
+	int source;
+
+	if (pattern == NULL)
+		return;
+	expand_part_rule_name(pattern, name, sizeof(name));
+	for (source = PART_SRC_MTD; source <= PART_SRC_GPT; source <<= 1)
+	{
+		if (!(sources & source) || (entry = lookup(source, name, 1)) == NULL)
+			continue;
+		if (kernel)
+			entry->kernel_rules |= 1ULL << rule_index;
+		else
+			entry->rootfs_rules |= 1ULL << rule_index;
+	}
+}
+
+// Builds the hash of the names of all rules active in the current multiboot configuration
+static void compile_rules()
+{
+	int subdir = current_rootfs_sub_dir[0] != '\0';
+	int i;
+
+	if (!rules_loaded)
+		load_rules();
+	if (compiled_multiboot == multiboot_partition && compiled_subdir == subdir)
+		return;
+
+	memset(name_hash, 0, sizeof(name_hash));
+	active_rules = 0;
+	for (i = 0; i < rule_count; i++)
+	{
+		if (!rule_active(&rules[i]))
+			continue;
+		active_rules |= 1ULL << i;
+		add_name(rules[i].sources, rules[i].kernel, i, 1);
+		add_name(rules[i].sources, rules[i].rootfs, i, 0);
+	}
+	compiled_multiboot = multiboot_partition;
+	compiled_subdir = subdir;
+}
+
+// Returns 0 if name is no kernel/rootfs partition name for source, otherwise PART_RULE_MATCH and the flags of the rule
+int match_part_name(int source, int role, const char* name)
+{
+	char unquoted[PART_NAME_LEN];
+	struct part_name_entry* entry;
+	unsigned long long matches;
+	int flags = PART_RULE_MATCH;
+	int i;
+
+	// names in /proc/mtd are quoted
+	if (name[0] == '"')
+	{
+		snprintf(unquoted, sizeof(unquoted), "%s", name + 1);
+		unquoted[strcspn(unquoted, "\"")] = '\0';
+		name = unquoted;
+	}
+
+	compile_rules();
+	entry = lookup(source, name, 0);
+	if (entry == NULL)
+		return 0;
+	matches = role == PART_KERNEL ? entry->kernel_rules : entry->rootfs_rules;
+	if (matches == 0)
+		return 0;
+	for (i = 0; i < rule_count; i++)
+		if (matches & (1ULL << i))
+			flags |= rules[i].flags;
+	return flags;
+}
+
+// Returns the rule numbers of source which have name as kernel or rootfs partition name
+void match_part_name_rules(int source, const char* name, unsigned long long* kernel_rules, unsigned long long* rootfs_rules)
+{
+	struct part_name_entry* entry;
+
+	compile_rules();
+	entry = lookup(source, name, 0);
+	*kernel_rules = entry ? entry->kernel_rules : 0;
+	*rootfs_rules = entry ? entry->rootfs_rules : 0;
+}
+
+// Returns the first active rule of source which is in both rule sets or is a fallback. -1 if none.
+int select_part_rule(int source, unsigned long long kernel_rules, unsigned long long rootfs_rules, const char** kernel, const char** rootfs, int* flags)
+{
+	int i;
+
+	compile_rules();
+	for (i = 0; i < rule_count; i++)
+	{
+		if (!(active_rules & (1ULL << i)) || !(rules[i].sources & source))
+			continue;
+		if ((kernel_rules & rootfs_rules & (1ULL << i)) || (rules[i].flags & PART_RULE_FALLBACK))
+		{
+			*kernel = rules[i].kernel;
+			*rootfs = rules[i].rootfs;
+			*flags = rules[i].flags;
+			return i;
+		}
+	}
+	return -1;
+}
+
+// Returns the flags of all active rules of source
+int active_part_rule_flags(int source)
+{
+	int flags = 0;
+	int i;
+
+	compile_rules();
+	for (i = 0; i < rule_count; i++)
+		if ((active_rules & (1ULL << i)) && (rules[i].sources & source))
+			flags |= rules[i].flags;
+	return flags;
+}
@@ -0,0 +1,182 @@
+#include "ofgwrite.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+
+// Timing of the flash phases
+// Every phase accumulates its duration and the bytes reported by the flash steps. At the end of the
+// run a report is written to report_dir: ofgwrite_report.json with the last run and
+// ofgwrite_report.csv with one line per phase of every run, to compare runs and boxes.
+
+static const char* phase_names[PHASE_COUNT] = {
+	"find_images", "discovery", "kill_processes", "sync", "newroot", "e2_stop", "pivot", "umount",
+	"verify", "delete", "flash", "kernel", "boot_image"
+};
+
+struct phase_stats
+{
+	int count;
+	long start_ms;		// first start, relative to the start of the run
+	long duration_ms;
+	long long bytes;
+};
+
+static struct phase_stats phases[PHASE_COUNT];
+static int current_phase = -1;
+static struct timespec run_start;
+static struct timespec phase_start;
+static time_t run_start_time;
+static int report_written = 0;
+
+// Ends the current phase and starts phase. A phase can be entered more than once.
+void phase_begin(enum PhaseEnum phase)
+{
+	phase_end();
+	clock_gettime(CLOCK_MONOTONIC, &phase_start);
+	if (run_start.tv_sec == 0 && run_start.tv_nsec == 0)
+	{
+		run_start = phase_start;
+		run_start_time = time(NULL);
+	}
+	if (phases[phase].count == 0)
+		phases[phase].start_ms = elapsed_ms(&run_start, &phase_start);
+	phases[phase].count++;
+	current_phase = phase;
+}
+
+void phase_end()
+{
+	struct timespec now;
+
+	if (current_phase < 0)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	phases[current_phase].duration_ms += elapsed_ms(&phase_start, &now);
+	current_phase = -1;
+}
+
+// Adds processed bytes to the current phase
+void phase_add_bytes(long long bytes)
+{
+	if (current_phase >= 0)
+		phases[current_phase].bytes += bytes;
+}
+
+static void read_box_model(char* model, size_t size)
+{
+	FILE* f;
+
+	strcpy(model, "unknown");
+	f = fopen("/proc/stb/info/model", "r");
+	if (f == NULL)
+		return;
+	if (fgets(model, size, f) == NULL)
+		strcpy(model, "unknown");
+	model[strcspn(model, "\r\n\",")] = '\0';
+	fclose(f);
+}
+
+static int close_report(FILE* f, const char* filename)
+{
+	int ret = fflush(f) == 0 && fsync(fileno(f)) == 0;
+
+	if (fclose(f) != 0)
+		ret = 0;
+	if (!ret)
+		my_printf("Error writing %s: %s\n", filename, strerror(errno));
+	return ret;
+}
+
+static int write_json_report(const char* filename, const char* model, const char* start, const char* result, long total_ms)
+{
+	FILE* f;
+	int first = 1;
+	int i;
+
+	f = fopen(filename, "w");
+	if (f == NULL)
+	{
+		my_printf("Error creating %s: %s\n", filename, strerror(errno));
+		return 0;
+	}
+	fprintf(f, "{\n");
+	fprintf(f, "  \"version\": \"%s\",\n", ofgwrite_version);
+	fprintf(f, "  \"box\": \"%s\",\n", model);
+	fprintf(f, "  \"start\": \"%s\",\n", start);
+	fprintf(f, "  \"result\": \"%s\",\n", result);
+	fprintf(f, "  \"total_ms\": %ld,\n", total_ms);
+	fprintf(f, "  \"phases\": [");
+	for (i = 0; i < PHASE_COUNT; i++)
+	{
+		if (phases[i].count == 0)
+			continue;
+		fprintf(f, "%s\n    { \"name\": \"%s\", \"start_ms\": %ld, \"duration_ms\": %ld, \"count\": %d, \"bytes\": %lld }",
+				first ? "" : ",", phase_names[i], phases[i].start_ms, phases[i].duration_ms, phases[i].count, phases[i].bytes);
+		first = 0;
+	}
+	fprintf(f, "\n  ]\n}\n");
+	return close_report(f, filename);
+}
+
+static int write_csv_report(const char* filename, const char* model, const char* start, const char* result)
+{
+	FILE* f;
+	int i;
+
+	f = fopen(filename, "a");
+	if (f == NULL)
+	{
+		my_printf("Error opening %s: %s\n", filename, strerror(errno));
+		return 0;
+	}
+	if (ftell(f) == 0)
+		fprintf(f, "start,version,box,result,phase,start_ms,duration_ms,count,bytes\n");
+	for (i = 0; i < PHASE_COUNT; i++)
+	{
+		if (phases[i].count == 0)
+			continue;
+		fprintf(f, "%s,%s,%s,%s,%s,%ld,%ld,%d,%lld\n", start, ofgwrite_version, model, result,
+				phase_names[i], phases[i].start_ms, phases[i].duration_ms, phases[i].count, phases[i].bytes);
+	}
+	return close_report(f, filename);
+}
+
+// Ends the current phase, logs all phases and writes the report. Only the first call writes it.
+void write_phase_report(int success)
+{
+	char filename[1050];
+	char model[40];
+	char start[32];
+	const char* sep;
+	struct timespec now;
+	long total_ms;
+	int i;
+
+	if (report_written || run_start.tv_sec == 0)
+		return;
+	report_written = 1;
+	phase_end();
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	total_ms = elapsed_ms(&run_start, &now);
+
+	my_printf("Phase timing (%s, %ld ms):\n", success ? "success" : "failed", total_ms);
+	for (i = 0; i < PHASE_COUNT; i++)
+		if (phases[i].count != 0)
+			my_printf("  %-15s %7ld ms  %lld bytes\n", phase_names[i], phases[i].duration_ms, phases[i].bytes);
+
+	if (report_dir[0] == '\0')
+		return;
+	read_box_model(model, sizeof(model));
+	// UTC, because the time zone isn't available after pivot_root
+	strftime(start, sizeof(start), "%Y-%m-%dT%H:%M:%SZ", gmtime(&run_start_time));
+
+	sep = report_dir[strlen(report_dir) - 1] == '/' ? "" : "/";
+	snprintf(filename, sizeof(filename), "%s%sofgwrite_report.json", report_dir, sep);
+	if (write_json_report(filename, model, start, success ? "success" : "failed", total_ms))
+		my_printf("Phase report written to %s\n", filename);
+	snprintf(filename, sizeof(filename), "%s%sofgwrite_report.csv", report_dir, sep);
+	write_csv_report(filename, model, start, success ? "success" : "failed");
+}
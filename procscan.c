@@ -0,0 +1,261 @@
+#include "ofgwrite.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dirent.h>
+#include <poll.h>
+#include <signal.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+
+// Process table snapshot built in one pass over /proc
+// For each process the command name is checked and, if a mount point is given, whether the
+// process uses files on it via cwd, root, exe, open fds or mapped files (like fuser -m).
+
+// VU+, GB and octagon specific processes and ntfs/exfat fuse drivers which must not be killed
+static const char* keep_alive_exe[] = {
+	"/oldroot/usr/bin/dvb_server",
+	"/oldroot/usr/bin/init_client",
+	"/oldroot/usr/bin/ntfs-3g",
+	"/oldroot/usr/share/platform/dvb_init",
+	"/oldroot/usr/bin/nxserver",
+	"/oldroot/usr/bin/init_driver",
+	"/oldroot/usr/share/platform/dvb_init.bin",
+	"/oldroot/usr/share/platform/nxserver",
+	"/oldroot/usr/bin/showiframe",
+	"/oldroot/sbin/mount.exfat-fuse",
+	NULL
+};
+
+// Reads the command name of a process from /proc/<pid>/stat like ps does
+static int read_comm(const char* pid, char* comm, size_t size)
+{
+	char path[64];
+	char buf[512];
+	char *start, *end;
+	ssize_t len;
+	int fd;
+
+	snprintf(path, sizeof(path), "/proc/%s/stat", pid);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0)
+		return 0;
+	buf[len] = '\0';
+
+	// format: pid (comm) state ... comm may contain ')'
+	start = strchr(buf, '(');
+	end = strrchr(buf, ')');
+	if (start == NULL || end == NULL || end < start)
+		return 0;
+	start++;
+	len = end - start;
+	if ((size_t)len >= size)
+		len = size - 1;
+	memcpy(comm, start, len);
+	comm[len] = '\0';
+	return 1;
+}
+
+// Waits until process pid has exited. Returns 1 if it is gone, 0 on timeout.
+int wait_process_exit(pid_t pid, int timeout_ms)
+{
+	int waited = 0;
+
+#ifdef __NR_pidfd_open
+	// a pidfd gets readable as soon as the process exits
+	struct pollfd pfd;
+	int ret;
+
+	pfd.fd = syscall(__NR_pidfd_open, pid, 0);
+	if (pfd.fd >= 0)
+	{
+		pfd.events = POLLIN;
+		do
+			ret = poll(&pfd, 1, timeout_ms);
+		while (ret < 0 && errno == EINTR);
+		close(pfd.fd);
+		if (ret >= 0)
+			return ret > 0;
+	}
+	else if (errno == ESRCH)
+		return 1;
+#endif
+
+	// kernel without pidfd support
+	while (kill(pid, 0) == 0 || errno != ESRCH)
+	{
+		if (waited >= timeout_ms)
+			return 0;
+		usleep(100000);
+		waited += 100;
+	}
+	return 1;
+}
+
+static int keep_alive_process(const char* exe)
+{
+	int i;
+
+	for (i = 0; keep_alive_exe[i] != NULL; i++)
+		if (strcmp(exe, keep_alive_exe[i]) == 0)
+			break;
+	if (keep_alive_exe[i] == NULL
+	 && !(strncmp(exe, "/oldroot/lib/modules/", 21) == 0 && strstr(exe, "/extra/hi_play.ko") != NULL))
+		return 0;
+
+	my_printf("found vu or gb or octagon or ntfs process %s -> don't kill\n", exe);
+	return 1;
+}
+
+static int link_on_dev(const char* pid, const char* name, dev_t dev)
+{
+	char path[64];
+	struct stat st;
+
+	snprintf(path, sizeof(path), "/proc/%s/%s", pid, name);
+	return stat(path, &st) == 0 && st.st_dev == dev;
+}
+
+static int fds_on_dev(const char* pid, dev_t dev)
+{
+	char path[64];
+	char fd_path[96];
+	struct dirent* entry;
+	struct stat st;
+	int found = 0;
+	DIR* dir;
+
+	snprintf(path, sizeof(path), "/proc/%s/fd", pid);
+	dir = opendir(path);
+	if (dir == NULL)
+		return 0;
+	while (!found && (entry = readdir(dir)) != NULL)
+	{
+		if (entry->d_name[0] == '.')
+			continue;
+		snprintf(fd_path, sizeof(fd_path), "%s/%s", path, entry->d_name);
+		found = stat(fd_path, &st) == 0 && st.st_dev == dev;
+	}
+	closedir(dir);
+	return found;
+}
+
+static int maps_on_dev(const char* pid, dev_t dev)
+{
+	char path[64];
+	char line[PATH_MAX + 128];
+	unsigned int major, minor;
+	unsigned long inode;
+	int found = 0;
+	FILE* f;
+
+	snprintf(path, sizeof(path), "/proc/%s/maps", pid);
+	f = fopen(path, "r");
+	if (f == NULL)
+		return 0;
+	// format: address perms offset major:minor inode path
+	while (!found && fgets(line, sizeof(line), f) != NULL)
+	{
+		if (sscanf(line, "%*s %*s %*s %x:%x %lu", &major, &minor, &inode) == 3)
+			found = inode != 0 && makedev(major, minor) == dev;
+	}
+	fclose(f);
+	return found;
+}
+
+static int uses_dev(const char* pid, dev_t dev)
+{
+	return link_on_dev(pid, "cwd", dev)
+		|| link_on_dev(pid, "root", dev)
+		|| link_on_dev(pid, "exe", dev)
+		|| fds_on_dev(pid, dev)
+		|| maps_on_dev(pid, dev);
+}
+
+// Scans all processes once. Returns pid of process comm and all processes using files on
+// mount_point (if not NULL) except own process and processes which must not be killed.
+int scan_processes(const char* comm, const char* mount_point, struct process_scan* scan)
+{
+	char name[64];
+	char path[64];
+	char exe[PATH_MAX];
+	struct dirent* entry;
+	struct stat st;
+	ssize_t len;
+	pid_t self = getpid();
+	pid_t pid;
+	pid_t* holders;
+	DIR* dir;
+
+	memset(scan, 0, sizeof(*scan));
+	if (mount_point != NULL)
+	{
+		if (stat(mount_point, &st) != 0)
+		{
+			my_printf("Error stat %s: %s\n", mount_point, strerror(errno));
+			return 0;
+		}
+	}
+
+	dir = opendir("/proc");
+	if (dir == NULL)
+		return 0;
+	while ((entry = readdir(dir)) != NULL)
+	{
+		if (entry->d_name[0] < '1' || entry->d_name[0] > '9')
+			continue;
+		pid = atoi(entry->d_name);
+		scan->processes++;
+
+		if (comm != NULL && scan->comm_pid == 0
+		 && read_comm(entry->d_name, name, sizeof(name)) && strcmp(name, comm) == 0)
+			scan->comm_pid = pid;
+
+		// the image verification runs independent of /oldroot
+		if (mount_point == NULL || pid == self || pid == verify_pid)
+			continue;
+
+		// kernel threads and zombies have no exe
+		snprintf(path, sizeof(path), "/proc/%s/exe", entry->d_name);
+		len = readlink(path, exe, sizeof(exe) - 1);
+		if (len < 0)
+			continue;
+		exe[len] = '\0';
+		if (!uses_dev(entry->d_name, st.st_dev) || keep_alive_process(exe))
+			continue;
+
+		holders = realloc(scan->holders, (scan->holder_count + 1) * sizeof(pid_t));
+		if (holders == NULL)
+			break;
+		scan->holders = holders;
+		scan->holders[scan->holder_count++] = pid;
+	}
+	closedir(dir);
+	return 1;
+}
+
+void free_process_scan(struct process_scan* scan)
+{
+	free(scan->holders);
+	scan->holders = NULL;
+	scan->holder_count = 0;
+}
+
+// Returns pid of the first process with the command name comm or 0 if not running
+pid_t find_process(const char* comm)
+{
+	struct process_scan scan;
+
+	scan_processes(comm, NULL, &scan);
+	return scan.comm_pid;
+}
@@ -0,0 +1,165 @@
+#include "ofgwrite.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+
+// Progress accounting of the flash steps
+// All flash modes report the processed bytes of their step here, so throughput, elapsed time and ETA
+// are calculated the same way everywhere. The state is in a shared mapping, because busybox tar runs
+// the decompressor in a forked child, which reports the compressed bytes it has read.
+
+#define PROGRESS_STATS_INTERVAL_MS 500
+#define MB (1024.0 * 1024.0)
+
+struct progress_state
+{
+	const char* name;
+	int active;
+	int percent;
+	long long total;		// 0 if unknown
+	long long done;
+	long long last_done;	// done at the last stats update
+	double rate;			// smoothed bytes per second
+	struct timespec start;
+	struct timespec last;	// time of the last stats update
+};
+
+static struct progress_state* progress = NULL;
+
+// Milliseconds between two CLOCK_MONOTONIC times
+long elapsed_ms(const struct timespec* from, const struct timespec* to)
+{
+	return (to->tv_sec - from->tv_sec) * 1000 + (to->tv_nsec - from->tv_nsec) / 1000000;
+}
+
+static int progress_init()
+{
+	void* state;
+
+	if (progress != NULL)
+		return 1;
+	state = mmap(NULL, sizeof(*progress), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (state == MAP_FAILED)
+	{
+		my_printf("Error: Cannot map progress state: %s\n", strerror(errno));
+		return 0;
+	}
+	progress = state;
+	return 1;
+}
+
+static void format_time(char* buf, size_t size, long seconds)
+{
+	snprintf(buf, size, "%ld:%02ld", seconds / 60, seconds % 60);
+}
+
+// e.g. "12.3 MB/s  45/120 MB  0:12  ETA 0:20"
+static void show_stats(const struct timespec* now)
+{
+	char line[100];
+	char elapsed[20];
+	char eta[20];
+	int precision;
+
+	format_time(elapsed, sizeof(elapsed), elapsed_ms(&progress->start, now) / 1000);
+	if (progress->total > 0 && progress->rate > 0)
+		format_time(eta, sizeof(eta), (long)((progress->total - progress->done) / progress->rate));
+	else
+		strcpy(eta, "--:--");
+
+	// small images like kernels need a decimal place
+	precision = (progress->total > 0 ? progress->total : progress->done) < 100 * MB ? 1 : 0;
+	if (progress->total > 0)
+		snprintf(line, sizeof(line), "%.1f MB/s  %.*f/%.*f MB  %s  ETA %s", progress->rate / MB,
+				precision, progress->done / MB, precision, progress->total / MB, elapsed, eta);
+	else
+		snprintf(line, sizeof(line), "%.1f MB/s  %.*f MB  %s", progress->rate / MB,
+				precision, progress->done / MB, elapsed);
+	set_step_stats(line);
+}
+
+// Starts the accounting of a step with total bytes (0 if unknown). name is used for the log.
+void progress_begin(const char* name, long long total)
+{
+	if (!progress_init())
+		return;
+	memset(progress, 0, sizeof(*progress));
+	progress->name = name;
+	progress->total = total;
+	progress->active = 1;
+	clock_gettime(CLOCK_MONOTONIC, &progress->start);
+	progress->last = progress->start;
+}
+
+// Reports done bytes of the current step. Reports without an active step are ignored.
+void progress_update(long long done)
+{
+	struct timespec now;
+	long ms;
+	double rate;
+	int percent;
+
+	if (progress == NULL || !progress->active)
+		return;
+	if (progress->total > 0 && done > progress->total)
+		done = progress->total;
+	progress->done = done;
+
+	if (progress->total > 0)
+	{
+		percent = (int)(done * 100 / progress->total);
+		if (percent != progress->percent)
+		{
+			set_step_progress(percent);
+			progress->percent = percent;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ms = elapsed_ms(&progress->last, &now);
+	if (ms < PROGRESS_STATS_INTERVAL_MS)
+		return;
+	// current rate, smoothed a bit to get a stable ETA
+	rate = (done - progress->last_done) * 1000.0 / ms;
+	progress->rate = progress->rate == 0 ? rate : 0.7 * progress->rate + 0.3 * rate;
+	progress->last_done = done;
+	progress->last = now;
+	show_stats(&now);
+}
+
+void progress_add(long long bytes)
+{
+	if (progress == NULL || !progress->active)
+		return;
+	progress_update(progress->done + bytes);
+}
+
+// Finishes the current step successfully. Shows the average rate and logs it.
+void progress_end()
+{
+	struct timespec now;
+	long ms;
+
+	if (progress == NULL || !progress->active)
+		return;
+	progress->active = 0;
+	if (progress->total > 0)
+		set_step_progress(100);
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ms = elapsed_ms(&progress->start, &now);
+	progress->rate = ms > 0 ? progress->done * 1000.0 / ms : 0;
+	show_stats(&now);
+	phase_add_bytes(progress->done);
+	my_printf("%s: %lld bytes in %ld.%03ld s (%.1f MB/s)\n", progress->name, progress->done,
+			ms / 1000, ms % 1000, progress->rate / MB);
+}
+
+// Used by forked children which must not report into the step of the parent
+void progress_detach()
+{
+	progress = NULL;
+}
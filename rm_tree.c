@@ -0,0 +1,320 @@
+#include "ofgwrite.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <sys/stat.h>
+
+#define RM_TREE_MIN_THREADS 4
+#define RM_TREE_MAX_THREADS 8
+#define RM_TREE_DENTS_BUF 32768
+
+// Parallel recursive delete
+// Directories are read with getdents64 by several threads. Files are unlinked relative to the
+// directory fd, subdirectories are put into a shared work queue. A directory is removed relative to
+// the fd of its parent as soon as its own scan is finished and all its subdirectories are removed
+// (bottom-up), so the fd of a directory stays open until then. The queue is a stack, so the tree is
+// walked mostly depth first and only a few directory fds are open at the same time.
+
+struct linux_dirent64
+{
+	unsigned long long d_ino;
+	long long d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+struct rm_dir
+{
+	struct rm_dir *parent;
+	struct rm_dir *next;	// work queue
+	int pending;			// own scan + not yet removed subdirectories
+	int fd;					// open from the scan until the directory is removed
+	char name[];
+};
+
+struct rm_tree_ctx
+{
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct rm_dir *queue;
+	int done;
+	unsigned long files;
+	unsigned long dirs;
+	unsigned long errors;
+};
+
+static struct rm_dir* new_rm_dir(struct rm_dir *parent, const char* name)
+{
+	struct rm_dir *dir = malloc(sizeof(*dir) + strlen(name) + 1);
+	if (!dir)
+		return NULL;
+	dir->parent = parent;
+	dir->next = NULL;
+	dir->pending = 1;
+	dir->fd = -1;
+	strcpy(dir->name, name);
+	return dir;
+}
+
+static int build_path(struct rm_dir *dir, char* path, size_t size)
+{
+	size_t len = 0;
+	size_t pos;
+	struct rm_dir *d;
+
+	for (d = dir; d; d = d->parent)
+		len += strlen(d->name) + 1;
+	if (len > size)
+		return 0;
+
+	pos = len - 1;
+	path[pos] = '\0';
+	for (d = dir; d; d = d->parent)
+	{
+		size_t name_len = strlen(d->name);
+		pos -= name_len;
+		memcpy(&path[pos], d->name, name_len);
+		if (d->parent)
+			path[--pos] = '/';
+	}
+	return 1;
+}
+
+static void queue_dir(struct rm_tree_ctx *ctx, struct rm_dir *dir)
+{
+	pthread_mutex_lock(&ctx->lock);
+	dir->parent->pending++;
+	dir->next = ctx->queue;
+	ctx->queue = dir;
+	pthread_cond_signal(&ctx->cond);
+	pthread_mutex_unlock(&ctx->lock);
+}
+
+// Called when the scan of a directory or the removal of a subdirectory is finished
+static void dir_finished(struct rm_tree_ctx *ctx, struct rm_dir *dir)
+{
+	char path[PATH_MAX];
+	struct rm_dir *parent;
+	int pending;
+
+	path[0] = '\0';
+	pthread_mutex_lock(&ctx->lock);
+	pending = --dir->pending;
+	pthread_mutex_unlock(&ctx->lock);
+
+	while (pending == 0)
+	{
+		if (dir->fd >= 0)
+			close(dir->fd);
+		// the parent is still open, its pending count includes this directory
+		if (dir->parent ? unlinkat(dir->parent->fd, dir->name, AT_REMOVEDIR) == 0 : rmdir(dir->name) == 0)
+		{
+			pthread_mutex_lock(&ctx->lock);
+			ctx->dirs++;
+			pthread_mutex_unlock(&ctx->lock);
+		}
+		else
+		{
+			// top directory might be a mountpoint, rm -rf also fails in this case
+			if (dir->parent && build_path(dir, path, sizeof(path)))
+				my_printf("Error removing directory %s: %s\n", path, strerror(errno));
+			pthread_mutex_lock(&ctx->lock);
+			ctx->errors++;
+			pthread_mutex_unlock(&ctx->lock);
+		}
+
+		parent = dir->parent;
+		free(dir);
+		pthread_mutex_lock(&ctx->lock);
+		if (!parent)
+		{
+			ctx->done = 1;
+			pthread_cond_broadcast(&ctx->cond);
+			pthread_mutex_unlock(&ctx->lock);
+			return;
+		}
+		pending = --parent->pending;
+		pthread_mutex_unlock(&ctx->lock);
+		dir = parent;
+	}
+}
+
+static void scan_dir(struct rm_tree_ctx *ctx, struct rm_dir *dir)
+{
+	char path[PATH_MAX];
+	char buf[RM_TREE_DENTS_BUF];
+	struct linux_dirent64 *entry;
+	struct rm_dir *subdir;
+	struct stat st;
+	unsigned long files = 0;
+	unsigned long errors = 0;
+	int is_dir;
+	long nread;
+	long pos;
+	int fd;
+
+	// only for messages, the directories are accessed relative to their parent
+	if (!build_path(dir, path, sizeof(path)))
+		snprintf(path, sizeof(path), ".../%s", dir->name);
+
+	if (dir->parent)
+		fd = openat(dir->parent->fd, dir->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	else
+		fd = open(dir->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0)
+	{
+		my_printf("Error opening directory %s: %s\n", path, strerror(errno));
+		errors++;
+		goto out;
+	}
+	// subdirectories are opened and removed relative to fd, it's closed by dir_finished
+	dir->fd = fd;
+
+	while ((nread = syscall(SYS_getdents64, fd, buf, sizeof(buf))) > 0)
+	{
+		for (pos = 0; pos < nread; pos += entry->d_reclen)
+		{
+			entry = (struct linux_dirent64 *)(buf + pos);
+			if (strcmp(entry->d_name, ".") == 0
+			 || strcmp(entry->d_name, "..") == 0)
+				continue;
+
+			if (entry->d_type == DT_UNKNOWN)
+				is_dir = fstatat(fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+			else
+				is_dir = entry->d_type == DT_DIR;
+
+			if (is_dir)
+			{
+				subdir = new_rm_dir(dir, entry->d_name);
+				if (subdir)
+					queue_dir(ctx, subdir);
+				else
+					errors++;
+			}
+			else if (unlinkat(fd, entry->d_name, 0) == 0)
+				files++;
+			else
+			{
+				my_printf("Error removing %s/%s: %s\n", path, entry->d_name, strerror(errno));
+				errors++;
+			}
+		}
+	}
+	if (nread < 0)
+	{
+		my_printf("Error reading directory %s: %s\n", path, strerror(errno));
+		errors++;
+	}
+
+out:
+	pthread_mutex_lock(&ctx->lock);
+	ctx->files += files;
+	ctx->errors += errors;
+	pthread_mutex_unlock(&ctx->lock);
+	dir_finished(ctx, dir);
+}
+
+static void* rm_tree_worker(void* arg)
+{
+	struct rm_tree_ctx *ctx = arg;
+	struct rm_dir *dir;
+
+	while (1)
+	{
+		pthread_mutex_lock(&ctx->lock);
+		while (!ctx->queue && !ctx->done)
+			pthread_cond_wait(&ctx->cond, &ctx->lock);
+		if (!ctx->queue)
+		{
+			pthread_mutex_unlock(&ctx->lock);
+			break;
+		}
+		dir = ctx->queue;
+		ctx->queue = dir->next;
+		pthread_mutex_unlock(&ctx->lock);
+
+		scan_dir(ctx, dir);
+	}
+
+	return NULL;
+}
+
+static int rm_tree_threads()
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	// deleting is mostly waiting for the storage, so use more threads than cpus
+	if (cpus < RM_TREE_MIN_THREADS)
+		return RM_TREE_MIN_THREADS;
+	if (cpus > RM_TREE_MAX_THREADS)
+		return RM_TREE_MAX_THREADS;
+	return cpus;
+}
+
+// Deletes directory with all content like rm -r -f. Returns 1 on success, 0 if something couldn't be removed.
+int rm_tree(const char* directory, int quiet)
+{
+	struct rm_tree_ctx ctx;
+	struct rm_dir *root;
+	struct stat st;
+	char top[PATH_MAX];
+	struct timespec start, end;
+	pthread_t threads[RM_TREE_MAX_THREADS];
+	int thread_count = rm_tree_threads();
+	int started = 0;
+	int i;
+
+	if (lstat(directory, &st) != 0)
+		return errno == ENOENT;
+	if (!S_ISDIR(st.st_mode))
+		return unlink(directory) == 0;
+
+	// cut trailing '/'
+	snprintf(top, sizeof(top), "%s", directory);
+	while (strlen(top) > 1 && top[strlen(top) - 1] == '/')
+		top[strlen(top) - 1] = '\0';
+
+	root = new_rm_dir(NULL, top);
+	if (!root)
+		return 0;
+
+	memset(&ctx, 0, sizeof(ctx));
+	pthread_mutex_init(&ctx.lock, NULL);
+	pthread_cond_init(&ctx.cond, NULL);
+	ctx.queue = root;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	// the calling thread is also a worker
+	for (i = 0; i < thread_count - 1; i++)
+	{
+		if (pthread_create(&threads[started], NULL, rm_tree_worker, &ctx) != 0)
+			break;
+		started++;
+	}
+	rm_tree_worker(&ctx);
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	if (!quiet)
+		my_printf("Deleted %lu files and %lu directories in %ld ms using %d threads\n", ctx.files, ctx.dirs,
+			elapsed_ms(&start, &end), started + 1);
+
+	pthread_cond_destroy(&ctx.cond);
+	pthread_mutex_destroy(&ctx.lock);
+
+	return ctx.errors == 0;
+}
@@ -0,0 +1,194 @@
+#include "ofgwrite.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+// Write-back policy used while extracting the rootfs
+// legacy: kernel default write-back, global sync() at the end (old behaviour)
+// syncfs: raise dirty limits during extraction to batch writes, one syncfs() of the target at the end
+// stream: start write-back after each file, wait for it every sync_chunk_mb MB, one syncfs() at the end
+
+#define DIRTY_RATIO_BATCH            60
+#define DIRTY_BACKGROUND_RATIO_BATCH 30
+
+int sync_policy = SYNC_POLICY_LEGACY;
+int sync_chunk_mb = 8;
+
+static const char* vm_dirty_files[] = {
+	"/proc/sys/vm/dirty_ratio",
+	"/proc/sys/vm/dirty_background_ratio",
+	"/proc/sys/vm/dirty_bytes",
+	"/proc/sys/vm/dirty_background_bytes"
+};
+#define VM_DIRTY_FILES (int)(sizeof(vm_dirty_files) / sizeof(vm_dirty_files[0]))
+
+static char saved_dirty[VM_DIRTY_FILES][32];
+static int dirty_saved = 0;
+static int target_fd = -1;
+static unsigned long long stream_pending_bytes = 0;
+static long stream_wait_ms = 0;
+static int stream_waits = 0;
+
+static int read_vm_value(const char* file, char* value, int size)
+{
+	FILE* f = fopen(file, "r");
+	if (f == NULL)
+		return 0;
+	if (fgets(value, size, f) == NULL)
+	{
+		fclose(f);
+		return 0;
+	}
+	fclose(f);
+	value[strcspn(value, "\n")] = '\0';
+	return 1;
+}
+
+static int write_vm_value(const char* file, const char* value)
+{
+	FILE* f = fopen(file, "w");
+	if (f == NULL)
+		return 0;
+	fprintf(f, "%s\n", value);
+	return fclose(f) == 0;
+}
+
+static void raise_dirty_limits(int quiet)
+{
+	char value[32];
+	int i;
+
+	for (i = 0; i < VM_DIRTY_FILES; i++)
+		if (!read_vm_value(vm_dirty_files[i], saved_dirty[i], sizeof(saved_dirty[i])))
+			return;
+	dirty_saved = 1;
+
+	// writing a ratio resets the corresponding *_bytes value
+	snprintf(value, sizeof(value), "%d", DIRTY_RATIO_BATCH);
+	write_vm_value(vm_dirty_files[0], value);
+	snprintf(value, sizeof(value), "%d", DIRTY_BACKGROUND_RATIO_BATCH);
+	write_vm_value(vm_dirty_files[1], value);
+	if (!quiet)
+		my_printf("Raised dirty limits to %d/%d%%\n", DIRTY_RATIO_BATCH, DIRTY_BACKGROUND_RATIO_BATCH);
+}
+
+static void restore_dirty_limits()
+{
+	int i;
+
+	if (!dirty_saved)
+		return;
+	// a *_bytes value of 0 means the ratio was active
+	for (i = 0; i < 2; i++)
+	{
+		if (strcmp(saved_dirty[i + 2], "0") != 0)
+			write_vm_value(vm_dirty_files[i + 2], saved_dirty[i + 2]);
+		else
+			write_vm_value(vm_dirty_files[i], saved_dirty[i]);
+	}
+	dirty_saved = 0;
+}
+
+int set_sync_policy(const char* name)
+{
+	if (strcmp(name, "legacy") == 0)
+		sync_policy = SYNC_POLICY_LEGACY;
+	else if (strcmp(name, "syncfs") == 0)
+		sync_policy = SYNC_POLICY_SYNCFS;
+	else if (strcmp(name, "stream") == 0)
+		sync_policy = SYNC_POLICY_STREAM;
+	else
+		return 0;
+	return 1;
+}
+
+// Called before the rootfs is extracted into directory
+void extract_sync_begin(const char* directory, int quiet)
+{
+	stream_pending_bytes = 0;
+	stream_wait_ms = 0;
+	stream_waits = 0;
+
+	if (sync_policy == SYNC_POLICY_LEGACY)
+		return;
+
+	if (target_fd < 0)
+		target_fd = open(directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (target_fd < 0)
+		my_printf("Error opening %s for syncfs: %s\n", directory, strerror(errno));
+
+	if (sync_policy == SYNC_POLICY_SYNCFS)
+		raise_dirty_limits(quiet);
+}
+
+// Called by the tar extractor for each regular file before it is closed
+void extract_sync_file(int fd, off_t size)
+{
+	struct timespec start, end;
+
+	if (sync_policy != SYNC_POLICY_STREAM)
+		return;
+
+	// start write-back of this file without waiting for it
+	sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+
+	stream_pending_bytes += size;
+	if (stream_pending_bytes < (unsigned long long)sync_chunk_mb * 1024 * 1024)
+		return;
+
+	// limit the amount of data in flight
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (target_fd >= 0)
+		syncfs(target_fd);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	stream_wait_ms += elapsed_ms(&start, &end);
+	stream_waits++;
+	stream_pending_bytes = 0;
+}
+
+// Called after the rootfs is extracted. After an error the target isn't synced by sync_rootfs,
+// so it's closed here to not keep the filesystem busy.
+void extract_sync_end(int success, int quiet)
+{
+	restore_dirty_limits();
+	if (!success && target_fd >= 0)
+	{
+		close(target_fd);
+		target_fd = -1;
+	}
+	if (sync_policy == SYNC_POLICY_STREAM && !quiet)
+		my_printf("Stream sync: %d waits every %d MB took %ld ms\n", stream_waits, sync_chunk_mb, stream_wait_ms);
+}
+
+// Makes the new rootfs durable
+void sync_rootfs(int quiet)
+{
+	struct timespec start, end;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (sync_policy == SYNC_POLICY_LEGACY || target_fd < 0)
+	{
+		// sync filesystem double because of sdcard
+		sync();
+		sync();
+		sleep(1);
+	}
+	else
+	{
+		if (syncfs(target_fd) != 0)
+		{
+			my_printf("Error syncfs: %s\n", strerror(errno));
+			sync();
+		}
+		close(target_fd);
+		target_fd = -1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (!quiet)
+		my_printf("Final sync took %ld ms\n", elapsed_ms(&start, &end));
+}
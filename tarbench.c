@@ -0,0 +1,622 @@
+#include "ofgwrite.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/mount.h>
+
+#include "busybox/include/libbb.h"
+#include "busybox/include/bb_archive.h"
+
+// Benchmark of the rootfs extraction
+// Generates a rootfs like tree (many small files, some large libraries, symlinks and hardlinks), packs it
+// as tar.bz2 and tar.xz with the host tools and measures the busybox decompressors and tar of ofgwrite:
+// decompression only and extraction with the write-back policy into a tmpfs or a loop mounted ext4.
+// jobs is the number of extractions running at the same time, each one is a tar process with its
+// decompressor process like in ofgwrite.
+
+#define TARBENCH_MAX_VALUES 16
+#define TARBENCH_MAX_JOBS 64
+
+enum FormatEnum
+{
+	FORMAT_BZ2, FORMAT_XZ, FORMAT_COUNT
+};
+
+static const char* format_names[FORMAT_COUNT] = { "bz2", "xz" };
+static const char* format_pack_cmd[FORMAT_COUNT] = { "bzip2 -9", "xz -6 --check=crc32" };
+
+enum ModeEnum
+{
+	MODE_DECOMPRESS, MODE_EXTRACT, MODE_COUNT
+};
+
+static const char* mode_names[MODE_COUNT] = { "decompress", "extract" };
+
+struct tree_stats
+{
+	int dirs;
+	int files;
+	int symlinks;
+	int hardlinks;
+	long long bytes;
+};
+
+static char work_dir[900] = "/tmp/ofgwrite_tarbench";
+static char target_dir[900] = "/dev/shm/ofgwrite_tarbench";
+static char archive_filenames[FORMAT_COUNT][1000];
+static long long archive_sizes[FORMAT_COUNT];
+static struct tree_stats tree;
+static char* loop_device = NULL;
+static int small_files = 3000;
+static int large_files = 8;
+static int large_mb = 4;
+static int verbose = 0;
+
+// UI of ofgwrite isn't available
+int set_step(char* str) { return 0; }
+void set_step_progress(int percent) {}
+void set_step_stats(const char* str) {}
+void set_console_progress(const char* fmt, ...) {}
+void flush_console_progress() {}
+void set_info_text(char* str) {}
+void phase_add_bytes(long long bytes) {}
+
+// Only tar of the busybox applets is linked
+const char *applet_name = "tar";
+void FAST_FUNC bb_show_usage(void) { exit(EXIT_FAILURE); }
+void handle_busybox_fatal_error() { exit(EXIT_FAILURE); }
+
+static void printUsage()
+{
+	printf("Usage: ofgwrite_tarbench <parameter>\n");
+	printf("Options:\n");
+	printf("   -w --work-dir=<dir>    directory for the generated tree and archives (default /tmp/ofgwrite_tarbench)\n");
+	printf("   -d --target=<dir>      extraction target, e.g. on a tmpfs (default /dev/shm/ofgwrite_tarbench)\n");
+	printf("   -x --ext4=<MB>         extract into a loop mounted ext4 image of this size at the target\n");
+	printf("   -n --files=<n>         number of small files (default 3000)\n");
+	printf("   -l --large=<n>         number of large libraries (default 8)\n");
+	printf("   -m --large-size=<MB>   size of a large library (default 4)\n");
+	printf("   -f --format=<f>[,<f>]  bz2 and/or xz (default both)\n");
+	printf("   -j --jobs=<n>[,<n>]    number of extractions at the same time (default 1,2)\n");
+	printf("   -b --buffer=<KB>[,<KB>] decompressor buffer sizes, 0 = default (default 0,16,64)\n");
+	printf("   -S --sync=<policy>     write-back policy: legacy, syncfs or stream (default legacy)\n");
+	printf("   -r --repeat=<n>        repeat every test n times and use the fastest run (default 3)\n");
+	printf("   -k --keep              keep the generated tree and archives\n");
+	printf("   -v --verbose           show output of tar\n");
+	printf("   -h --help              show help\n");
+}
+
+static int parse_int(const char* str, int* val, int min)
+{
+	char* endptr;
+	long l;
+
+	errno = 0;
+	l = strtol(str, &endptr, 10);
+	if (errno != 0 || endptr == str || *endptr != '\0' || l < min || l > INT32_MAX)
+		return 0;
+	*val = l;
+	return 1;
+}
+
+// Comma separated list of numbers. Returns the number of values, 0 on error.
+static int parse_list(const char* arg, int* values, int min)
+{
+	char buf[1000];
+	char* tok;
+	int count = 0;
+
+	snprintf(buf, sizeof(buf), "%s", arg);
+	for (tok = strtok(buf, ","); tok != NULL; tok = strtok(NULL, ","))
+		if (count == TARBENCH_MAX_VALUES || !parse_int(tok, &values[count++], min))
+			return 0;
+	return count;
+}
+
+static int parse_formats(const char* arg, int* formats)
+{
+	char buf[1000];
+	char* tok;
+	int i;
+
+	snprintf(buf, sizeof(buf), "%s", arg);
+	memset(formats, 0, FORMAT_COUNT * sizeof(*formats));
+	for (tok = strtok(buf, ","); tok != NULL; tok = strtok(NULL, ","))
+	{
+		for (i = 0; i < FORMAT_COUNT; i++)
+			if (strcmp(tok, format_names[i]) == 0)
+				break;
+		if (i == FORMAT_COUNT)
+			return 0;
+		formats[i] = 1;
+	}
+	return 1;
+}
+
+static uint32_t next_random(uint32_t* state)
+{
+	*state ^= *state << 13;
+	*state ^= *state >> 17;
+	*state ^= *state << 5;
+	return *state;
+}
+
+// Mix of text, random and zero runs, compresses about like the files of an image
+static void fill_data(unsigned char* buf, size_t len, uint32_t* state)
+{
+	static const char* words[] = {
+		"config", "enigma2", "python", "service", "plugin", "the ", "lib", "include", "return ", "value",
+		"\n", "    ", "=", "/usr/share/", "0x00000000", "_init", "error", "skin", "def ", "<screen "
+	};
+	size_t i = 0;
+	size_t run;
+	size_t n;
+	uint32_t r;
+	const char* w;
+
+	while (i < len)
+	{
+		r = next_random(state);
+		run = 64 + (r >> 8) % 448;
+		if (run > len - i)
+			run = len - i;
+		switch (r % 8)
+		{
+			case 0: case 1:
+				for (n = 0; n < run; n++)
+					buf[i + n] = next_random(state);
+				break;
+			case 2:
+				memset(buf + i, 0, run);
+				break;
+			default:
+				for (n = 0; n < run; )
+				{
+					w = words[next_random(state) % (sizeof(words) / sizeof(words[0]))];
+					while (*w != '\0' && n < run)
+						buf[i + n++] = *w++;
+				}
+				break;
+		}
+		i += run;
+	}
+}
+
+static int write_file(const char* path, size_t size, uint32_t* state)
+{
+	static unsigned char buf[65536];
+	size_t chunk;
+	int fd;
+	int ret = 1;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return 0;
+	while (size > 0 && ret)
+	{
+		chunk = size < sizeof(buf) ? size : sizeof(buf);
+		fill_data(buf, chunk, state);
+		ret = write(fd, buf, chunk) == (ssize_t)chunk;
+		size -= chunk;
+	}
+	if (close(fd) != 0)
+		ret = 0;
+	return ret;
+}
+
+static int make_dir(const char* path)
+{
+	if (mkdir(path, 0755) != 0 && errno != EEXIST)
+		return 0;
+	tree.dirs++;
+	return 1;
+}
+
+// Small files in a few levels of directories like /usr/lib/enigma2/python, large libraries in /usr/lib
+// with the usual .so symlinks, applet symlinks in /bin and hardlinks in /usr/sbin
+static int create_tree(const char* root)
+{
+	static const char* top_dirs[] = { "bin", "sbin", "etc", "lib", "usr", "usr/bin", "usr/sbin", "usr/lib", "usr/share" };
+	char path[1100];
+	char target[1100];
+	uint32_t state = 0x2545F491;
+	size_t size;
+	int dir_count = small_files / 40 + 1;
+	int i;
+
+	memset(&tree, 0, sizeof(tree));
+	if (!make_dir(root))
+		return 0;
+	for (i = 0; i < (int)(sizeof(top_dirs) / sizeof(top_dirs[0])); i++)
+	{
+		snprintf(path, sizeof(path), "%s/%s", root, top_dirs[i]);
+		if (!make_dir(path))
+			return 0;
+	}
+	for (i = 0; i < dir_count; i++)
+	{
+		snprintf(path, sizeof(path), "%s/usr/share/pkg%d", root, i % 16);
+		if (!make_dir(path))
+			return 0;
+		snprintf(path, sizeof(path), "%s/usr/share/pkg%d/sub%d", root, i % 16, i);
+		if (!make_dir(path))
+			return 0;
+	}
+
+	for (i = 0; i < small_files; i++)
+	{
+		// mostly a few KB, some up to 64 KB
+		size = 1 << (6 + next_random(&state) % 11);
+		size += next_random(&state) % size;
+		snprintf(path, sizeof(path), "%s/usr/share/pkg%d/sub%d/file%d", root, i % dir_count % 16, i % dir_count, i);
+		if (!write_file(path, size, &state))
+			return 0;
+		tree.files++;
+		tree.bytes += size;
+		if (i % 25 == 0)
+		{
+			snprintf(target, sizeof(target), "%s/usr/sbin/link%d", root, i);
+			if (link(path, target) != 0)
+				return 0;
+			tree.hardlinks++;
+		}
+		if (i % 10 == 0)
+		{
+			snprintf(path, sizeof(path), "%s/bin/applet%d", root, i);
+			if (symlink("busybox", path) != 0)
+				return 0;
+			tree.symlinks++;
+		}
+	}
+
+	for (i = 0; i < large_files; i++)
+	{
+		snprintf(path, sizeof(path), "%s/usr/lib/libbench%d.so.1.0", root, i);
+		size = (size_t)large_mb * 1024 * 1024;
+		if (!write_file(path, size, &state))
+			return 0;
+		tree.files++;
+		tree.bytes += size;
+		snprintf(path, sizeof(path), "%s/usr/lib/libbench%d.so.1", root, i);
+		snprintf(target, sizeof(target), "libbench%d.so.1.0", i);
+		if (symlink(target, path) != 0)
+			return 0;
+		snprintf(path, sizeof(path), "%s/usr/lib/libbench%d.so", root, i);
+		snprintf(target, sizeof(target), "libbench%d.so.1", i);
+		if (symlink(target, path) != 0)
+			return 0;
+		tree.symlinks += 2;
+	}
+
+	snprintf(path, sizeof(path), "%s/bin/busybox", root);
+	if (!write_file(path, 600 * 1024, &state))
+		return 0;
+	tree.files++;
+	tree.bytes += 600 * 1024;
+	return 1;
+}
+
+// The busybox tar of ofgwrite can only extract, so the archives are packed with the host tools
+static int pack_tree(const char* root, int format)
+{
+	char cmd[3000];
+	struct stat st;
+
+	snprintf(archive_filenames[format], sizeof(archive_filenames[format]), "%s/rootfs.tar.%s", work_dir, format_names[format]);
+	snprintf(cmd, sizeof(cmd), "tar -C '%s' -cf - . | %s > '%s'", root, format_pack_cmd[format], archive_filenames[format]);
+	if (system(cmd) != 0 || stat(archive_filenames[format], &st) != 0)
+	{
+		fprintf(stderr, "Error packing %s\n", archive_filenames[format]);
+		return 0;
+	}
+	archive_sizes[format] = st.st_size;
+	return 1;
+}
+
+static int mount_ext4(int size_mb)
+{
+	char image[1000];
+	char cmd[2100];
+	int fd;
+
+	snprintf(image, sizeof(image), "%s/target.ext4", work_dir);
+	fd = open(image, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0 || ftruncate(fd, (off_t)size_mb * 1024 * 1024) != 0)
+	{
+		fprintf(stderr, "Error creating %s: %s\n", image, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return 0;
+	}
+	close(fd);
+	snprintf(cmd, sizeof(cmd), "mkfs.ext4 -F -q '%s'", image);
+	if (system(cmd) != 0)
+	{
+		fprintf(stderr, "Error: mkfs.ext4 failed\n");
+		return 0;
+	}
+	if (set_loop(&loop_device, image, 0, 0) < 0)
+	{
+		fprintf(stderr, "Error setting up loop device for %s: %s\n", image, strerror(errno));
+		loop_device = NULL;
+		return 0;
+	}
+	if (mount(loop_device, target_dir, "ext4", 0, NULL) != 0)
+	{
+		fprintf(stderr, "Error mounting %s: %s\n", loop_device, strerror(errno));
+		del_loop(loop_device);
+		free(loop_device);
+		loop_device = NULL;
+		return 0;
+	}
+	return 1;
+}
+
+static void umount_ext4()
+{
+	char image[1000];
+
+	if (loop_device == NULL)
+		return;
+	if (umount(target_dir) != 0)
+		fprintf(stderr, "Error unmounting %s: %s\n", target_dir, strerror(errno));
+	del_loop(loop_device);
+	free(loop_device);
+	loop_device = NULL;
+	snprintf(image, sizeof(image), "%s/target.ext4", work_dir);
+	unlink(image);
+}
+
+static int decompress(const char* filename, int format)
+{
+	transformer_state_t xstate;
+	int ret;
+
+	init_transformer_state(&xstate);
+	xstate.check_signature = 1;
+	xstate.src_fd = open(filename, O_RDONLY);
+	xstate.dst_fd = open("/dev/null", O_WRONLY);
+	if (xstate.src_fd < 0 || xstate.dst_fd < 0)
+		return 0;
+	if (format == FORMAT_XZ)
+		ret = unpack_xz_stream(&xstate);
+	else
+		ret = unpack_bz2_stream(&xstate);
+	return ret >= 0;
+}
+
+// Same steps as untar_rootfs
+static int extract(const char* filename, char* directory)
+{
+	optind = 0; // reset getopt_long
+	char* argv[] = { "tar", "-x", "-f", (char*)filename, "-C", directory, NULL };
+	int ret;
+
+	if (mkdir(directory, 0755) != 0)
+		return 0;
+	extract_sync_begin(directory, 1);
+	ret = tar_main(6, argv);
+	extract_sync_end(ret == 0, 1);
+	sync_rootfs(1);
+	return ret == 0;
+}
+
+// Runs the job in a child, the busybox code leaves through exit() on errors
+static pid_t start_job(int mode, int format, int job)
+{
+	char directory[1000];
+	pid_t pid;
+	int ret;
+
+	pid = fork();
+	if (pid != 0)
+		return pid;
+
+	if (!verbose)
+		freopen("/dev/null", "w", stdout);
+	progress_begin("Extracting rootfs", archive_sizes[format]);
+	if (mode == MODE_DECOMPRESS)
+		ret = decompress(archive_filenames[format], format);
+	else
+	{
+		snprintf(directory, sizeof(directory), "%s/job%d", target_dir, job);
+		ret = extract(archive_filenames[format], directory);
+	}
+	if (ret)
+		progress_end();
+	fflush(stdout);
+	_exit(ret ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+static void clean_target(int jobs)
+{
+	char directory[1000];
+	int i;
+
+	for (i = 0; i < jobs; i++)
+	{
+		snprintf(directory, sizeof(directory), "%s/job%d", target_dir, i);
+		if (access(directory, F_OK) == 0)
+			rm_tree(directory, 1);
+	}
+	sync();
+}
+
+// Returns the time of the fastest run in ms, -1 on error
+static long run_bench(int mode, int format, int jobs, int bufsize_kb, int repeat)
+{
+	struct timespec start, end;
+	pid_t pids[TARBENCH_MAX_JOBS];
+	long best = -1;
+	long ms;
+	int status;
+	int failed;
+	int i;
+	int r;
+
+	transformer_bufsize = bufsize_kb * 1024;
+	// the children would write the buffered output again
+	fflush(stdout);
+	fflush(stderr);
+	for (r = 0; r < repeat; r++)
+	{
+		clean_target(jobs);
+		failed = 0;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (i = 0; i < jobs; i++)
+			if ((pids[i] = start_job(mode, format, i)) < 0)
+				failed = 1;
+		for (i = 0; i < jobs; i++)
+			if (pids[i] > 0 && (waitpid(pids[i], &status, 0) != pids[i] || !WIFEXITED(status) || WEXITSTATUS(status) != 0))
+				failed = 1;
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		ms = elapsed_ms(&start, &end);
+		if (failed)
+			return -1;
+		if (best < 0 || ms < best)
+			best = ms;
+	}
+	clean_target(jobs);
+	return best;
+}
+
+int main(int argc, char *argv[])
+{
+	static const char *short_options = "w:d:x:n:l:m:f:j:b:S:r:kvh";
+	static const struct option long_options[] = {
+												{"work-dir"  , required_argument, NULL, 'w'},
+												{"target"    , required_argument, NULL, 'd'},
+												{"ext4"      , required_argument, NULL, 'x'},
+												{"files"     , required_argument, NULL, 'n'},
+												{"large"     , required_argument, NULL, 'l'},
+												{"large-size", required_argument, NULL, 'm'},
+												{"format"    , required_argument, NULL, 'f'},
+												{"jobs"      , required_argument, NULL, 'j'},
+												{"buffer"    , required_argument, NULL, 'b'},
+												{"sync"      , required_argument, NULL, 'S'},
+												{"repeat"    , required_argument, NULL, 'r'},
+												{"keep"      , no_argument      , NULL, 'k'},
+												{"verbose"   , no_argument      , NULL, 'v'},
+												{"help"      , no_argument      , NULL, 'h'},
+												{NULL        , no_argument      , NULL,  0} };
+	int formats[FORMAT_COUNT] = { 1, 1 };
+	int jobs[TARBENCH_MAX_VALUES] = { 1, 2 };
+	int buffers[TARBENCH_MAX_VALUES] = { 0, 16, 64 };
+	int job_count = 2;
+	int buffer_count = 3;
+	int ext4_mb = 0;
+	int repeat = 3;
+	int keep = 0;
+	int ok = 1;
+	char tree_dir[1000];
+	const char* sync_name = "legacy";
+	long ms;
+	double s;
+	int opt;
+	int mode, format, j, b;
+
+	while ((opt = getopt_long(argc, argv, short_options, long_options, NULL)) != -1)
+	{
+		switch (opt)
+		{
+			case 'w': snprintf(work_dir, sizeof(work_dir), "%s", optarg); break;
+			case 'd': snprintf(target_dir, sizeof(target_dir), "%s", optarg); break;
+			case 'x': ok = parse_int(optarg, &ext4_mb, 16); break;
+			case 'n': ok = parse_int(optarg, &small_files, 0); break;
+			case 'l': ok = parse_int(optarg, &large_files, 0); break;
+			case 'm': ok = parse_int(optarg, &large_mb, 1); break;
+			case 'f': ok = parse_formats(optarg, formats); break;
+			case 'j': ok = (job_count = parse_list(optarg, jobs, 1)) > 0; break;
+			case 'b': ok = (buffer_count = parse_list(optarg, buffers, 0)) > 0; break;
+			case 'S': ok = set_sync_policy(optarg); sync_name = optarg; break;
+			case 'r': ok = parse_int(optarg, &repeat, 1); break;
+			case 'k': keep = 1; break;
+			case 'v': verbose = 1; break;
+			default: ok = 0; break;
+		}
+		if (!ok)
+		{
+			printUsage();
+			return EXIT_FAILURE;
+		}
+	}
+	for (j = 0; j < job_count; j++)
+		if (jobs[j] > TARBENCH_MAX_JOBS)
+		{
+			fprintf(stderr, "Error: At most %d jobs\n", TARBENCH_MAX_JOBS);
+			return EXIT_FAILURE;
+		}
+
+	set_log_levels(verbose ? "info,emerg" : "err,emerg");
+
+	snprintf(tree_dir, sizeof(tree_dir), "%s/rootfs", work_dir);
+	if ((mkdir(work_dir, 0755) != 0 && errno != EEXIST) || (mkdir(target_dir, 0755) != 0 && errno != EEXIST))
+	{
+		fprintf(stderr, "Error creating %s or %s: %s\n", work_dir, target_dir, strerror(errno));
+		return EXIT_FAILURE;
+	}
+	if (access(tree_dir, F_OK) == 0)
+		rm_tree(tree_dir, 1);
+	if (!create_tree(tree_dir))
+	{
+		fprintf(stderr, "Error creating tree %s: %s\n", tree_dir, strerror(errno));
+		return EXIT_FAILURE;
+	}
+	for (format = 0; format < FORMAT_COUNT; format++)
+		if (formats[format] && !pack_tree(tree_dir, format))
+			return EXIT_FAILURE;
+	if (ext4_mb > 0 && !mount_ext4(ext4_mb))
+		return EXIT_FAILURE;
+
+	fprintf(stderr, "Tree: %d files, %d dirs, %d symlinks, %d hardlinks, %.1f MB\n", tree.files, tree.dirs,
+			tree.symlinks, tree.hardlinks, tree.bytes / (1024.0 * 1024));
+	for (format = 0; format < FORMAT_COUNT; format++)
+		if (formats[format])
+			fprintf(stderr, "%s: %.1f MB\n", archive_filenames[format], archive_sizes[format] / (1024.0 * 1024));
+	fprintf(stderr, "Target: %s%s, sync policy %s\n", target_dir, ext4_mb > 0 ? " (loop mounted ext4)" : "", sync_name);
+
+	printf("\n%-6s %-10s %4s %7s %8s %9s %9s %9s\n", "format", "test", "jobs", "buf KB", "ms", "in MB/s", "out MB/s", "files/s");
+	for (format = 0; format < FORMAT_COUNT; format++)
+	{
+		if (!formats[format])
+			continue;
+		for (mode = 0; mode < MODE_COUNT; mode++)
+			for (j = 0; j < job_count; j++)
+				for (b = 0; b < buffer_count; b++)
+				{
+					ms = run_bench(mode, format, jobs[j], buffers[b], repeat);
+					if (ms < 0)
+					{
+						printf("%-6s %-10s %4d %7d failed\n", format_names[format], mode_names[mode], jobs[j], buffers[b]);
+						continue;
+					}
+					s = ms > 0 ? ms / 1000.0 : 0.001;
+					// all jobs together
+					printf("%-6s %-10s %4d %7d %8ld %9.1f %9.1f %9.0f\n", format_names[format], mode_names[mode], jobs[j], buffers[b], ms,
+							jobs[j] * archive_sizes[format] / s / (1024 * 1024), jobs[j] * tree.bytes / s / (1024 * 1024),
+							mode == MODE_EXTRACT ? jobs[j] * (tree.files + tree.symlinks + tree.hardlinks) / s : 0.0);
+					fflush(stdout);
+				}
+	}
+
+	umount_ext4();
+	if (!keep)
+	{
+		rm_tree(tree_dir, 1);
+		for (format = 0; format < FORMAT_COUNT; format++)
+			if (formats[format])
+				unlink(archive_filenames[format]);
+		rmdir(work_dir);
+	}
+	rmdir(target_dir);
+	return EXIT_SUCCESS;
+}
@@ -47,6 +47,12 @@
 #include "common.h"
 #include "ubiutils-common.h"
 
+// progress output of ofgwrite UI
+void set_console_progress(const char* fmt, ...);
+void progress_begin(const char* name, long long total);
+void progress_update(long long done);
+void progress_end();
+
 /* The variables below are set by command line arguments */
 struct args {
 	unsigned int yes:1;
@@ -437,6 +443,7 @@ static int flash_image(libmtd_t libmtd, const struct mtd_dev_info *mtd,
 		return fd;
 
 	img_ebs = st_size / mtd->eb_size;
+	progress_begin("Flashing UBI image", st_size);
 
 	if (img_ebs > si->good_cnt) {
 		sys_errmsg("file \"%s\" is too large (%lld bytes)",
@@ -458,10 +465,9 @@ static int flash_image(libmtd_t libmtd, const struct mtd_dev_info *mtd,
 		long long ec;
 
 		if (!args.quiet && !args.verbose) {
-			printf("\r" PROGRAM_NAME ": flashing eraseblock %d -- %2lld %% complete  ",
+			set_console_progress("\r" PROGRAM_NAME ": flashing eraseblock %d -- %2lld %% complete  ",
 			       eb, (long long)(eb + 1) * 100 / divisor);
-			set_step_progress((int)((long long)(eb + 1) * 100 / divisor));
-			fflush(stdout);
+			progress_update((long long)written_ebs * mtd->eb_size);
 		}
 
 		if (si->ec[eb] == EB_BAD) {
@@ -554,6 +560,8 @@ static int flash_image(libmtd_t libmtd, const struct mtd_dev_info *mtd,
 	if (!args.quiet && !args.verbose)
 		my_printf("\n");
 	close(fd);
+	progress_update((long long)written_ebs * mtd->eb_size);
+	progress_end();
 	return eb + 1;
 
 out_close:
@@ -581,14 +589,14 @@ static int format(libmtd_t libmtd, const struct mtd_dev_info *mtd,
 		return sys_errmsg("cannot allocate %d bytes of memory", write_size);
 	memset(hdr, 0xFF, write_size);
 
+	progress_begin("Formatting remaining eraseblocks", (long long)(mtd->eb_cnt - start_eb) * mtd->eb_size);
 	for (eb = start_eb; eb < mtd->eb_cnt; eb++) {
 		long long ec;
 
 		if (!args.quiet && !args.verbose) {
-			printf("\r" PROGRAM_NAME ": formatting eraseblock %d -- %2lld %% complete  ",
+			set_console_progress("\r" PROGRAM_NAME ": formatting eraseblock %d -- %2lld %% complete  ",
 			       eb, (long long)(eb + 1 - start_eb) * 100 / (mtd->eb_cnt - start_eb));
-			set_step_progress((int)((long long)(eb + 1 - start_eb) * 100 / (mtd->eb_cnt - start_eb)));
-			fflush(stdout);
+			progress_update((long long)(eb - start_eb) * mtd->eb_size);
 		}
 
 		if (si->ec[eb] == EB_BAD)
@@ -666,6 +674,8 @@ static int format(libmtd_t libmtd, const struct mtd_dev_info *mtd,
 
 	if (!args.quiet && !args.verbose)
 		my_printf("Format end\n");
+	progress_update((long long)(mtd->eb_cnt - start_eb) * mtd->eb_size);
+	progress_end();
 
 	if (!novtbl) {
 		if (eb1 == -1 || eb2 == -1) {
@@ -0,0 +1,162 @@
+#include "ofgwrite.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mount.h>
+
+#define UMOUNT_MAX_THREADS 8
+
+// Unmounts mounts in parallel
+// Mounts are arranged in a tree by their path. Independent subtrees are unmounted in parallel,
+// inside a subtree nested mounts are unmounted before their parent. The umounts are real umounts,
+// which flush the filesystem and can take a while (e.g. USB sticks). Only busy mounts and lazy ones
+// (network and fuse mounts, whose umount can hang) are detached.
+
+struct umount_node
+{
+	const char* dir;
+	int lazy;
+	int parent;			// index of parent mount or -1
+};
+
+struct umount_ctx
+{
+	pthread_mutex_t lock;
+	struct umount_node* nodes;
+	int count;
+	int next_root;		// next subtree to process
+	const char* prefix;
+};
+
+// checks if mount b is below mount a
+static int is_below(const char* a, const char* b)
+{
+	size_t len = strlen(a);
+
+	if (strncmp(a, b, len) != 0)
+		return 0;
+	return b[len] == '/' || b[len] == '\0' || (len > 0 && a[len - 1] == '/');
+}
+
+// Unmounts path and detaches it if it's busy or lazy is set. Returns 0 on success.
+int umount_dir(const char* path, const char* name, int lazy)
+{
+	struct timespec start, end;
+	const char* result = "done";
+	int ret = -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (!lazy)
+		ret = umount2(path, 0);
+	if (lazy || (ret != 0 && errno == EBUSY))
+	{
+		ret = umount2(path, MNT_DETACH);
+		result = "detached";
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	my_printf("umounting: %s %s (%ld ms)\n", name, ret == 0 ? result : strerror(errno), elapsed_ms(&start, &end));
+	return ret;
+}
+
+static void umount_subtree(struct umount_ctx* ctx, int index)
+{
+	char path[1000];
+	int i;
+
+	// children first, later mounts hide earlier ones on the same dir
+	for (i = ctx->count - 1; i >= 0; i--)
+		if (ctx->nodes[i].parent == index)
+			umount_subtree(ctx, i);
+
+	snprintf(path, sizeof(path), "%s%s", ctx->prefix, ctx->nodes[index].dir);
+	umount_dir(path, ctx->nodes[index].dir, ctx->nodes[index].lazy);
+}
+
+static void* umount_worker(void* arg)
+{
+	struct umount_ctx* ctx = arg;
+	int index;
+
+	while (1)
+	{
+		pthread_mutex_lock(&ctx->lock);
+		while (ctx->next_root < ctx->count && ctx->nodes[ctx->next_root].parent != -1)
+			ctx->next_root++;
+		index = ctx->next_root++;
+		pthread_mutex_unlock(&ctx->lock);
+
+		if (index >= ctx->count)
+			break;
+		umount_subtree(ctx, index);
+	}
+	return NULL;
+}
+
+// Unmounts all dirs (in /proc/mounts order) located under prefix. lazy[i] marks mounts which are only detached.
+void umount_tree(const char** dirs, const int* lazy, int count, const char* prefix)
+{
+	struct umount_ctx ctx;
+	char path[1000];
+	pthread_t threads[UMOUNT_MAX_THREADS];
+	struct timespec start, end;
+	int roots = 0;
+	int started = 0;
+	int i, j;
+
+	if (count == 0)
+		return;
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.nodes = malloc(count * sizeof(*ctx.nodes));
+	if (ctx.nodes == NULL)
+	{
+		// one after the other, later mounts first
+		for (i = count - 1; i >= 0; i--)
+		{
+			snprintf(path, sizeof(path), "%s%s", prefix, dirs[i]);
+			umount_dir(path, dirs[i], lazy[i]);
+		}
+		return;
+	}
+	ctx.count = count;
+	ctx.prefix = prefix;
+	pthread_mutex_init(&ctx.lock, NULL);
+
+	// parent is the latest earlier mount with the longest path above, this is also an earlier mount on the same dir
+	for (i = 0; i < count; i++)
+	{
+		ctx.nodes[i].dir = dirs[i];
+		ctx.nodes[i].lazy = lazy[i];
+		ctx.nodes[i].parent = -1;
+		for (j = 0; j < i; j++)
+		{
+			if (!is_below(dirs[j], dirs[i]))
+				continue;
+			if (ctx.nodes[i].parent == -1 || strlen(dirs[j]) >= strlen(dirs[ctx.nodes[i].parent]))
+				ctx.nodes[i].parent = j;
+		}
+		if (ctx.nodes[i].parent == -1)
+			roots++;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < roots - 1 && i < UMOUNT_MAX_THREADS; i++)
+	{
+		if (pthread_create(&threads[started], NULL, umount_worker, &ctx) != 0)
+			break;
+		started++;
+	}
+	umount_worker(&ctx);
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	my_printf("Unmounted %d mounts in %d independent groups in %ld ms\n", count, roots, elapsed_ms(&start, &end));
+
+	pthread_mutex_destroy(&ctx.lock);
+	free(ctx.nodes);
+}
@@ -0,0 +1,259 @@
+#include "ofgwrite.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <openssl/evp.h>
+
+#include "busybox/include/libbb.h"
+#include "busybox/include/bb_archive.h"
+
+// Preflight image verification
+// The image files are checked in a child process while E2 is stopped and /newroot is prepared.
+// If <file>.sha256 exists the file is checked against it, otherwise xz and bzip2 rootfs files are
+// decompressed to /dev/null to check their stream checksums. The result is sent through a pipe.
+// Without an E2 stop (flashing another slot) there is nothing to overlap the decompression with,
+// so only files with a .sha256 file are checked then.
+// A child process is used and not a thread, because the busybox decompressors exit on errors and
+// daemonize() forks, which would drop a thread.
+
+enum VerifyResultEnum
+{
+	VERIFY_FAILED, VERIFY_OK, VERIFY_SKIPPED
+};
+
+pid_t verify_pid = 0;
+static int verify_fd = -1;
+static struct timespec verify_start;
+
+// Reads the expected hash from <filename>.sha256. Format like sha256sum output or just the hash.
+static int read_sha256_file(const char* filename, char* hash)
+{
+	char sha_filename[1010];
+	FILE* f;
+	int ret;
+
+	snprintf(sha_filename, sizeof(sha_filename), "%s.sha256", filename);
+	f = fopen(sha_filename, "r");
+	if (f == NULL)
+		return 0;
+	ret = fscanf(f, "%64s", hash) == 1 && strlen(hash) == 64;
+	fclose(f);
+	if (!ret)
+		my_printf("Verify: Invalid hash in %s\n", sha_filename);
+	return ret;
+}
+
+static int verify_sha256(const char* filename, const char* expected)
+{
+	unsigned char buf[65536];
+	unsigned char hash[EVP_MAX_MD_SIZE];
+	char hex[2 * EVP_MAX_MD_SIZE + 1];
+	unsigned int hash_len = 0;
+	EVP_MD_CTX* mdctx;
+	ssize_t len;
+	unsigned int i;
+	int fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+	{
+		my_printf("Verify: Error opening %s: %s\n", filename, strerror(errno));
+		return 0;
+	}
+	mdctx = EVP_MD_CTX_new();
+	if (mdctx == NULL || EVP_DigestInit_ex(mdctx, EVP_sha256(), NULL) != 1)
+	{
+		my_printf("Verify: EVP_DigestInit_ex() failed.\n");
+		close(fd);
+		return 0;
+	}
+	while ((len = read(fd, buf, sizeof(buf))) > 0)
+		EVP_DigestUpdate(mdctx, buf, len);
+	close(fd);
+	if (len < 0 || EVP_DigestFinal_ex(mdctx, hash, &hash_len) != 1)
+	{
+		EVP_MD_CTX_free(mdctx);
+		my_printf("Verify: Error reading %s\n", filename);
+		return 0;
+	}
+	EVP_MD_CTX_free(mdctx);
+
+	for (i = 0; i < hash_len; i++)
+		sprintf(&hex[2 * i], "%02x", hash[i]);
+	if (strcasecmp(hex, expected) != 0)
+	{
+		my_printf("Verify: SHA-256 of %s doesn't match\n", filename);
+		return 0;
+	}
+	my_printf("Verify: SHA-256 of %s ok\n", filename);
+	return 1;
+}
+
+// Decompresses filename to /dev/null. The decompressors check the stream checksums.
+static int verify_stream(const char* filename)
+{
+	transformer_state_t xstate;
+	int ret;
+
+	init_transformer_state(&xstate);
+	xstate.check_signature = 1;
+	xstate.src_fd = open(filename, O_RDONLY);
+	xstate.dst_fd = open("/dev/null", O_WRONLY);
+	if (xstate.src_fd < 0 || xstate.dst_fd < 0)
+	{
+		my_printf("Verify: Error opening %s: %s\n", filename, strerror(errno));
+		return 0;
+	}
+	if (image_type == TAR_UBI)
+		ret = unpack_xz_stream(&xstate);
+	else
+		ret = unpack_bz2_stream(&xstate);
+	close(xstate.src_fd);
+	close(xstate.dst_fd);
+	if (ret < 0)
+	{
+		my_printf("Verify: %s is corrupt\n", filename);
+		return 0;
+	}
+	my_printf("Verify: %s ok\n", filename);
+	return 1;
+}
+
+static int verify_file(const char* filename, int stream)
+{
+	char hash[65];
+
+	if (filename[0] == '\0')
+		return VERIFY_SKIPPED;
+	if (read_sha256_file(filename, hash))
+		return verify_sha256(filename, hash) ? VERIFY_OK : VERIFY_FAILED;
+	if (stream)
+		return verify_stream(filename) ? VERIFY_OK : VERIFY_FAILED;
+	return VERIFY_SKIPPED;
+}
+
+static int verify_images(int kernel, int rootfs, int stream)
+{
+	int result = VERIFY_SKIPPED;
+	int ret;
+
+	if (kernel)
+	{
+		ret = verify_file(kernel_filename, 0);
+		if (ret == VERIFY_FAILED)
+			return ret;
+		if (ret == VERIFY_OK)
+			result = ret;
+	}
+	if (rootfs)
+	{
+		if (nfi_filename[0] != '\0')
+			ret = verify_file(nfi_filename, 0);
+		else
+			ret = verify_file(rootfs_filename, stream && (image_type == TAR_BASED || image_type == TAR_UBI));
+		if (ret != VERIFY_SKIPPED)
+			result = ret;
+	}
+	return result;
+}
+
+static int has_sha256_file(const char* filename)
+{
+	char sha256_filename[1010];
+
+	if (filename[0] == '\0')
+		return 0;
+	snprintf(sha256_filename, sizeof(sha256_filename), "%s.sha256", filename);
+	return access(sha256_filename, R_OK) == 0;
+}
+
+// Starts verification of the kernel and/or rootfs file in the background.
+// stream: decompress xz and bzip2 rootfs files without .sha256 file
+void start_image_verify(int kernel, int rootfs, int stream)
+{
+	int fds[2];
+	unsigned char result;
+
+	if (!stream
+	 && !(kernel && has_sha256_file(kernel_filename))
+	 && !(rootfs && has_sha256_file(nfi_filename[0] != '\0' ? nfi_filename : rootfs_filename)))
+	{
+		my_printf("Verify: No checksum files. Skipping verification\n");
+		return;
+	}
+
+	if (pipe(fds) != 0)
+	{
+		my_printf("Verify: Error creating pipe: %s\n", strerror(errno));
+		return;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &verify_start);
+	fflush(stdout);
+	verify_pid = fork();
+	if (verify_pid < 0)
+	{
+		my_printf("Verify: Error fork failed\n");
+		verify_pid = 0;
+		close(fds[0]);
+		close(fds[1]);
+		return;
+	}
+	if (verify_pid == 0)
+	{
+		// own session, so the child isn't stopped together with E2
+		close(fds[0]);
+		setsid();
+		if (chdir("/") != 0)
+			_exit(EXIT_FAILURE);
+		die_func = NULL;
+		progress_detach();
+		xfunc_error_retval = EXIT_FAILURE;
+		signal(SIGPIPE, SIG_IGN);
+		result = verify_images(kernel, rootfs, stream);
+		fflush(stdout);
+		if (write(fds[1], &result, 1) != 1)
+			_exit(EXIT_FAILURE);
+		_exit(EXIT_SUCCESS);
+	}
+	close(fds[1]);
+	verify_fd = fds[0];
+	my_printf("Verifying image files in background (pid %d)\n", verify_pid);
+}
+
+// Waits for the verification result. Returns 0 if the image files are corrupt.
+int wait_image_verify()
+{
+	struct timespec wait_start, now;
+	unsigned char result = VERIFY_FAILED;
+	ssize_t len;
+
+	if (verify_fd == -1)
+		return 1;
+
+	clock_gettime(CLOCK_MONOTONIC, &wait_start);
+	do
+		len = read(verify_fd, &result, 1);
+	while (len < 0 && errno == EINTR);
+	close(verify_fd);
+	verify_fd = -1;
+	// only a child as long as not daemonized
+	waitpid(verify_pid, NULL, 0);
+	verify_pid = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (len != 1)
+		result = VERIFY_FAILED;
+	my_printf("Image verification %s after %ld ms (waited %ld ms)\n",
+		result == VERIFY_OK ? "successful" : (result == VERIFY_SKIPPED ? "skipped, no checksums" : "failed"),
+		elapsed_ms(&verify_start, &now),
+		elapsed_ms(&wait_start, &now));
+	return result != VERIFY_FAILED;
+}